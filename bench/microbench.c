@@ -0,0 +1,308 @@
+// Microbenchmarks of the hot paths of the editor: the allocator, the message
+// stack, the append buffer and the row operations, each at a few sizes.
+//
+// Results are printed as JSON, a benchmark per line. Given --baseline with
+// the output of a previous run, the times are compared on stderr, and the
+// exit status is 1 if any is slower by more than --threshold percent.
+#define DITTO_NO_MAIN
+#include "../src/main.c"
+
+// Each benchmark is run this many times, and the fastest run kept
+#define MB_RUNS 5
+// Slowdown over the baseline reported as a regression, in percent
+#define MB_THRESHOLD 10.0
+#define MB_MAX_RESULTS 64
+// Allocations kept alive at once by the allocator benchmarks
+#define MB_LIVE 64
+
+typedef struct {
+  char name[64];
+  long size;
+  long ops;
+  double ns_per_op;
+} MbResult;
+
+static MbResult mb_results[MB_MAX_RESULTS];
+static int mb_nresults;
+
+// State shared by the setup and the run of a benchmark
+static void *mb_ptrs[MB_LIVE];
+static FixedSizeStack *mb_stack;
+static char mb_text[1 << 16];
+
+static double mb_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Runs the benchmark of ops operations at the size MB_RUNS times, setup and
+// teardown (which may be NULL) excluded from the time
+static void mb_run(const char *name, long size, long ops,
+                   void (*setup)(long size), void (*run)(long size, long ops),
+                   void (*teardown)(void)) {
+  double best = 0;
+  for (int r = 0; r < MB_RUNS; r++) {
+    if (setup)
+      setup(size);
+    double start = mb_now_ns();
+    run(size, ops);
+    double ns = (mb_now_ns() - start) / ops;
+    if (teardown)
+      teardown();
+    if (r == 0 || ns < best)
+      best = ns;
+  }
+
+  MbResult *res = &mb_results[mb_nresults++];
+  snprintf(res->name, sizeof(res->name), "%s", name);
+  res->size = size;
+  res->ops = ops;
+  res->ns_per_op = best;
+}
+
+/*** allocator ***/
+
+static void mb_dmalloc(long size, long ops) {
+  for (long j = 0; j < ops; j++) {
+    dfree(mb_ptrs[j % MB_LIVE]);
+    mb_ptrs[j % MB_LIVE] = dmalloc(size);
+  }
+}
+
+// Grows and shrinks the blocks between size / 2 and size
+static void mb_drealloc(long size, long ops) {
+  for (long j = 0; j < ops; j++)
+    mb_ptrs[j % MB_LIVE] =
+        drealloc(mb_ptrs[j % MB_LIVE], (j / MB_LIVE) % 2 ? size / 2 : size);
+}
+
+static void mb_free_ptrs(void) {
+  for (int j = 0; j < MB_LIVE; j++) {
+    dfree(mb_ptrs[j]);
+    mb_ptrs[j] = NULL;
+  }
+}
+
+/*** message stack ***/
+
+// A full stack of size messages, as E.messages is after a while
+static void mb_stack_setup(long size) {
+  mb_stack = fss_create(size);
+  for (long j = 0; j < size; j++)
+    fss_push(mb_stack, mb_text, 80);
+}
+
+static void mb_stack_teardown(void) { fss_destroy(mb_stack); }
+
+static void mb_fss_push(long size, long ops) {
+  UNUSED(size);
+  for (long j = 0; j < ops; j++)
+    fss_push(mb_stack, mb_text, 80);
+}
+
+// A pop needs something pushed first, so it's timed along with the push
+static void mb_fss_push_pop(long size, long ops) {
+  UNUSED(size);
+  for (long j = 0; j < ops; j++) {
+    fss_push(mb_stack, mb_text, 80);
+    dfree(fss_pop(mb_stack, NULL));
+  }
+}
+
+// Peeks the oldest message, the whole stack away
+static void mb_fss_peek(long size, long ops) {
+  size_t len;
+  for (long j = 0; j < ops; j++)
+    dfree(fss_peek(mb_stack, size - 1, &len));
+}
+
+/*** append buffer ***/
+
+// Appends of size bytes, in frames of 64 KB freed once full
+static void mb_abappend(long size, long ops) {
+  AppendBuffer ab = ABUF_INIT;
+  for (long j = 0; j < ops; j++) {
+    abAppend(&ab, mb_text, size);
+    if (ab.len + size > (int)sizeof(mb_text)) {
+      abFree(&ab);
+      ab = (AppendBuffer)ABUF_INIT;
+    }
+  }
+  abFree(&ab);
+}
+
+/*** rows ***/
+
+// A single row of size bytes, plain ASCII or with tabs and UTF-8
+static void mb_row_setup(long size, int plain) {
+  char *s = dmalloc(size);
+  for (long j = 0; j < size; j++)
+    s[j] = 'a' + j % 26;
+  if (!plain) {
+    for (long j = 0; j + 2 < size; j += 16) {
+      s[j] = '\t';
+      s[j + 1] = '\xc3';
+      s[j + 2] = '\xa9';
+    }
+  }
+  editorInsertRow(0, s, size);
+  dfree(s);
+}
+
+static void mb_row_setup_plain(long size) { mb_row_setup(size, 1); }
+
+static void mb_row_setup_utf8(long size) { mb_row_setup(size, 0); }
+
+static void mb_rows_teardown(void) {
+  editorDeleteRows(0, E.buf->numrows);
+}
+
+static void mb_update_row(long size, long ops) {
+  UNUSED(size);
+  for (long j = 0; j < ops; j++)
+    editorUpdateRow(&E.buf->row[0]);
+}
+
+// Columns of bytes all over the row, as the cursor moves
+static void mb_cx_to_rx(long size, long ops) {
+  unsigned long x = 1;
+  int sum = 0;
+  for (long j = 0; j < ops; j++) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    sum += editorRowCxToRx(&E.buf->row[0], (int)((x >> 33) % size));
+  }
+  if (sum == -1)
+    printf("unreachable\n");
+}
+
+// A buffer of size rows
+static void mb_rows_setup(long size) {
+  for (long j = 0; j < size; j++)
+    editorInsertRow(E.buf->numrows, mb_text, 40);
+}
+
+// Rows inserted and deleted in the middle of the buffer
+static void mb_insert_row(long size, long ops) {
+  for (long j = 0; j < ops; j++)
+    editorInsertRow(size / 2, mb_text, 40);
+}
+
+static void mb_delete_row(long size, long ops) {
+  for (long j = 0; j < ops; j++)
+    editorDeleteRow(size / 2 - ops / 2);
+}
+
+/*** output ***/
+
+static void mb_print_json(void) {
+  printf("{\"benchmarks\": [\n");
+  for (int j = 0; j < mb_nresults; j++) {
+    MbResult *r = &mb_results[j];
+    printf("{\"name\": \"%s\", \"size\": %ld, \"ops\": %ld, "
+           "\"ns_per_op\": %.3f}%s\n",
+           r->name, r->size, r->ops, r->ns_per_op,
+           j + 1 < mb_nresults ? "," : "");
+  }
+  printf("]}\n");
+}
+
+// Compares with the results of a previous run. Returns the number of
+// regressions, or -1 if the baseline can't be read.
+static int mb_compare(const char *path, double threshold) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  int regressions = 0;
+  char line[256];
+  fprintf(stderr, "%-24s %8s %12s %12s %8s\n", "benchmark", "size",
+          "baseline", "now", "change");
+  while (fgets(line, sizeof(line), fp)) {
+    MbResult base;
+    if (sscanf(line,
+               "{\"name\": \"%63[^\"]\", \"size\": %ld, \"ops\": %ld, "
+               "\"ns_per_op\": %lf}",
+               base.name, &base.size, &base.ops, &base.ns_per_op) != 4)
+      continue;
+
+    for (int j = 0; j < mb_nresults; j++) {
+      MbResult *r = &mb_results[j];
+      if (strcmp(r->name, base.name) != 0 || r->size != base.size)
+        continue;
+      double change = (r->ns_per_op / base.ns_per_op - 1) * 100;
+      int regressed = change > threshold;
+      regressions += regressed;
+      fprintf(stderr, "%-24s %8ld %9.2f ns %9.2f ns %+7.1f%%%s\n", r->name,
+              r->size, base.ns_per_op, r->ns_per_op, change,
+              regressed ? "  REGRESSION" : "");
+    }
+  }
+  fclose(fp);
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  const char *baseline = NULL;
+  double threshold = MB_THRESHOLD;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+      baseline = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = atof(argv[++i]);
+  }
+
+  // The row operations work on the current buffer, without a terminal
+  FILE *log = fopen("/dev/null", "w");
+  E.logger = dlog_initf(log, DLOG_LEVEL_ERROR);
+  E.buf = editorBufferNew();
+  memset(mb_text, 'x', sizeof(mb_text));
+
+  static const long alloc_sizes[] = {16, 256, 4096, 65536};
+  for (int j = 0; j < 4; j++) {
+    mb_run("dmalloc_dfree", alloc_sizes[j], 1000000, NULL, mb_dmalloc,
+           mb_free_ptrs);
+    mb_run("drealloc", alloc_sizes[j], 1000000, NULL, mb_drealloc,
+           mb_free_ptrs);
+  }
+
+  static const long stack_sizes[] = {10, 100, 1000};
+  for (int j = 0; j < 3; j++) {
+    mb_run("fss_push", stack_sizes[j], 1000000, mb_stack_setup, mb_fss_push,
+           mb_stack_teardown);
+    mb_run("fss_push_pop", stack_sizes[j], 1000000, mb_stack_setup,
+           mb_fss_push_pop, mb_stack_teardown);
+    mb_run("fss_peek", stack_sizes[j], 100000, mb_stack_setup, mb_fss_peek,
+           mb_stack_teardown);
+  }
+
+  static const long append_sizes[] = {1, 16, 256};
+  for (int j = 0; j < 3; j++)
+    mb_run("abAppend", append_sizes[j], 1000000, NULL, mb_abappend, NULL);
+
+  static const long row_sizes[] = {16, 256, 4096};
+  for (int j = 0; j < 3; j++) {
+    mb_run("editorUpdateRow/plain", row_sizes[j], 100000,
+           mb_row_setup_plain, mb_update_row, mb_rows_teardown);
+    mb_run("editorUpdateRow/utf8", row_sizes[j], 100000, mb_row_setup_utf8,
+           mb_update_row, mb_rows_teardown);
+    mb_run("editorRowCxToRx/utf8", row_sizes[j], 1000000, mb_row_setup_utf8,
+           mb_cx_to_rx, mb_rows_teardown);
+  }
+
+  static const long buffer_sizes[] = {1000, 100000, 1000000};
+  for (int j = 0; j < 3; j++) {
+    mb_run("editorInsertRow", buffer_sizes[j], 100, mb_rows_setup,
+           mb_insert_row, mb_rows_teardown);
+    mb_run("editorDeleteRow", buffer_sizes[j], 100, mb_rows_setup,
+           mb_delete_row, mb_rows_teardown);
+  }
+
+  mb_print_json();
+
+  int regressions = baseline ? mb_compare(baseline, threshold) : 0;
+  dlog_close(E.logger);
+  return regressions != 0;
+}
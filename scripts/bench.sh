@@ -0,0 +1,46 @@
+#!/bin/sh
+# Replays the standard workloads in a headless terminal (ditto --bench) and
+# prints, for each, the latency of the commands, the bytes written per frame
+# and the peak memory.
+# Usage: scripts/bench.sh [ditto binary] [lines of the file]
+
+DITTO=${1:-bin/ditto}
+LINES=${2:-200000}
+DIR=$(mktemp -d /tmp/ditto-bench.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+
+# Some C-looking text, with comments, strings and tabs
+awk -v n="$LINES" 'BEGIN {
+  for (i = 0; i < n; i++) {
+    if (i % 10 == 0)
+      printf "/* Block %d: some comment text here */\n", i / 10
+    else if (i % 10 == 5)
+      printf "\tprintf(\"value %%d\\n\", x[%d]);\n", i
+    else
+      printf "int v%d = %d * %d + factor(%d); // line\n", i, i, i % 7, i
+  }
+}' > "$DIR/big.c"
+
+# Repeats a string n times
+rep() {
+  awk -v s="$1" -v n="$2" 'BEGIN { for (i = 0; i < n; i++) printf "%s", s }'
+}
+
+ESC=$(printf '\033')
+CR=$(printf '\r')
+
+printf 'G:q!\r' > "$DIR/open"
+{ rep j 3000; rep "$ESC[6~" 300; rep "$ESC[5~" 300; printf ':q!\r'; } \
+  > "$DIR/scroll"
+{ printf 'i'; rep "the quick brown fox jumps over the lazy dog$CR" 100
+  printf '\033:q!\r'; } > "$DIR/type"
+{ rep dd 1000; rep 10dd 100; printf ':q!\r'; } > "$DIR/dd"
+{ printf yy; rep p 1000; printf 100yy; rep P 100; printf ':q!\r'; } \
+  > "$DIR/paste"
+{ rep "x:w$CR" 20; printf ':q\r'; } > "$DIR/save"
+
+for w in open scroll type dd paste save; do
+  cp "$DIR/big.c" "$DIR/file.c"
+  rm -f "$DIR/.file.c.dswp"
+  "$DITTO" --bench "$DIR/$w" "$DIR/file.c" || exit 1
+done
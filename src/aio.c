@@ -0,0 +1,541 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include "aio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "dmalloc.h"
+
+// Workers of the thread pool backend
+#define AIO_THREADS 4
+
+struct Aio {
+  int uring;
+  int inflight;
+  // Requests waiting for a free ring slot or a worker
+  AioRequest *queue_head, *queue_tail;
+  // Completed requests, not reaped yet
+  AioRequest *done_head, *done_tail;
+  // Readable when there are completions: the eventfd registered with the
+  // ring, or the read end of a pipe written by the workers
+  int notify_fd;
+  int notify_wfd;
+
+  // Thread pool
+  pthread_t threads[AIO_THREADS];
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int stop;
+
+#ifdef __linux__
+  // io_uring, driven through raw syscalls
+  int ring_fd;
+  unsigned ring_entries;
+  unsigned ring_used;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_sz, cq_sz;
+  struct io_uring_sqe *sqes;
+  size_t sqes_sz;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+static void aio_push(AioRequest **head, AioRequest **tail, AioRequest *r) {
+  r->next = NULL;
+  if (*tail)
+    (*tail)->next = r;
+  else
+    *head = r;
+  *tail = r;
+}
+
+static AioRequest *aio_pop(AioRequest **head, AioRequest **tail) {
+  AioRequest *r = *head;
+  if (r) {
+    *head = r->next;
+    if (!*head)
+      *tail = NULL;
+  }
+  return r;
+}
+
+// Points the vector at what's left to transfer
+static void aio_prepare(AioRequest *r) {
+  r->iov.iov_base = r->buf + r->done;
+  r->iov.iov_len = r->len - r->done;
+}
+
+static int aio_pop_done(Aio *a, AioRequest **reqs, int max) {
+  int n = 0;
+  AioRequest *r;
+  while (n < max && (r = aio_pop(&a->done_head, &a->done_tail)))
+    reqs[n++] = r;
+  a->inflight -= n;
+  return n;
+}
+
+/*** thread pool ***/
+
+static void aio_transfer(AioRequest *r) {
+  while (r->done < r->len) {
+    ssize_t n = r->op == AIO_READ
+                    ? pread(r->fd, r->buf + r->done, r->len - r->done,
+                            r->off + r->done)
+                    : pwrite(r->fd, r->buf + r->done, r->len - r->done,
+                             r->off + r->done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      r->error = errno;
+      return;
+    }
+    if (n == 0) {
+      // EOF for reads, a write making no progress is an error
+      if (r->op == AIO_WRITE)
+        r->error = EIO;
+      return;
+    }
+    r->done += n;
+  }
+}
+
+static void *aio_worker(void *arg) {
+  Aio *a = arg;
+
+  pthread_mutex_lock(&a->lock);
+  while (1) {
+    while (!a->stop && !a->queue_head)
+      pthread_cond_wait(&a->work, &a->lock);
+    AioRequest *r = aio_pop(&a->queue_head, &a->queue_tail);
+    if (!r)
+      break;
+
+    pthread_mutex_unlock(&a->lock);
+    aio_transfer(r);
+    pthread_mutex_lock(&a->lock);
+
+    aio_push(&a->done_head, &a->done_tail, r);
+    pthread_cond_signal(&a->done);
+    // A full pipe already signals pending completions
+    char c = 0;
+    if (write(a->notify_wfd, &c, 1) == -1 && errno != EAGAIN)
+      break;
+  }
+  pthread_mutex_unlock(&a->lock);
+  return NULL;
+}
+
+static int pool_setup(Aio *a) {
+  int fds[2];
+  if (pipe(fds) == -1)
+    return -1;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  a->notify_fd = fds[0];
+  a->notify_wfd = fds[1];
+
+  for (int t = 0; t < AIO_THREADS; t++) {
+    if (pthread_create(&a->threads[t], NULL, aio_worker, a) != 0)
+      break;
+    a->nthreads++;
+  }
+  return a->nthreads > 0 ? 0 : -1;
+}
+
+static void pool_teardown(Aio *a) {
+  pthread_mutex_lock(&a->lock);
+  a->stop = 1;
+  pthread_cond_broadcast(&a->work);
+  pthread_mutex_unlock(&a->lock);
+
+  for (int t = 0; t < a->nthreads; t++)
+    pthread_join(a->threads[t], NULL);
+}
+
+static int pool_reap(Aio *a, AioRequest **reqs, int max, int wait) {
+  pthread_mutex_lock(&a->lock);
+  char drain[256];
+  while (read(a->notify_fd, drain, sizeof(drain)) > 0)
+    ;
+  while (wait && !a->done_head && a->inflight > 0)
+    pthread_cond_wait(&a->done, &a->lock);
+  int n = aio_pop_done(a, reqs, max);
+  pthread_mutex_unlock(&a->lock);
+  return n;
+}
+
+/*** io_uring ***/
+
+#ifdef __linux__
+static int uring_enter(Aio *a, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, a->ring_fd, to_submit, min_complete,
+                  flags, NULL, 0);
+  } while (ret == -1 && errno == EINTR);
+  return ret;
+}
+
+static void uring_teardown(Aio *a) {
+  if (a->sqes && a->sqes != MAP_FAILED)
+    munmap(a->sqes, a->sqes_sz);
+  if (a->cq_ptr && a->cq_ptr != MAP_FAILED && a->cq_ptr != a->sq_ptr)
+    munmap(a->cq_ptr, a->cq_sz);
+  if (a->sq_ptr && a->sq_ptr != MAP_FAILED)
+    munmap(a->sq_ptr, a->sq_sz);
+  if (a->notify_fd != -1)
+    close(a->notify_fd);
+  if (a->ring_fd != -1)
+    close(a->ring_fd);
+  a->sqes = NULL;
+  a->sq_ptr = a->cq_ptr = NULL;
+  a->notify_fd = a->ring_fd = -1;
+}
+
+// Fails where io_uring is missing or forbidden (old kernels, seccomp), and
+// the thread pool is used instead
+static int uring_setup(Aio *a, unsigned depth) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  a->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+  if (a->ring_fd < 0) {
+    a->ring_fd = -1;
+    return -1;
+  }
+
+  a->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  a->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single)
+    a->sq_sz = a->cq_sz = a->sq_sz > a->cq_sz ? a->sq_sz : a->cq_sz;
+
+  a->sq_ptr = mmap(NULL, a->sq_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQ_RING);
+  if (a->sq_ptr == MAP_FAILED)
+    goto fail;
+  a->cq_ptr = single ? a->sq_ptr
+                     : mmap(NULL, a->cq_sz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, a->ring_fd,
+                            IORING_OFF_CQ_RING);
+  if (a->cq_ptr == MAP_FAILED)
+    goto fail;
+  a->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  a->sqes = mmap(NULL, a->sqes_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQES);
+  if (a->sqes == MAP_FAILED)
+    goto fail;
+
+  char *sq = a->sq_ptr, *cq = a->cq_ptr;
+  a->sq_head = (unsigned *)(sq + p.sq_off.head);
+  a->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  a->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  a->sq_array = (unsigned *)(sq + p.sq_off.array);
+  a->cq_head = (unsigned *)(cq + p.cq_off.head);
+  a->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  a->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  a->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  a->ring_entries = p.sq_entries;
+
+  a->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (a->notify_fd == -1 ||
+      syscall(__NR_io_uring_register, a->ring_fd, IORING_REGISTER_EVENTFD,
+              &a->notify_fd, 1) == -1)
+    goto fail;
+
+  a->uring = 1;
+  return 0;
+
+fail:
+  uring_teardown(a);
+  return -1;
+}
+
+// Moves queued requests into free slots of the ring and submits them
+static void uring_submit_queue(Aio *a) {
+  while (a->queue_head && a->ring_used < a->ring_entries) {
+    AioRequest *r = aio_pop(&a->queue_head, &a->queue_tail);
+    // Only this thread produces entries, the kernel reads the tail
+    unsigned tail = *a->sq_tail;
+    unsigned idx = tail & *a->sq_mask;
+    struct io_uring_sqe *sqe = &a->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->op == AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = r->fd;
+    sqe->off = r->off + r->done;
+    sqe->addr = (uintptr_t)&r->iov;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)r;
+    a->sq_array[idx] = idx;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    a->ring_used++;
+  }
+
+  // Entries left over by a failed enter are retried here as well
+  unsigned pending =
+      *a->sq_tail - __atomic_load_n(a->sq_head, __ATOMIC_ACQUIRE);
+  if (pending > 0)
+    uring_enter(a, pending, 0, 0);
+}
+
+// Collects the completion queue: short transfers are resumed, finished
+// requests move to the done list
+static void uring_collect(Aio *a) {
+  uint64_t count;
+  if (read(a->notify_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    return;
+
+  unsigned head = *a->cq_head;
+  unsigned tail = __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &a->cqes[head & *a->cq_mask];
+    AioRequest *r = (AioRequest *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    head++;
+    a->ring_used--;
+
+    if (res == -EINTR || res == -EAGAIN) {
+      aio_push(&a->queue_head, &a->queue_tail, r);
+      continue;
+    }
+    if (res < 0) {
+      r->error = -res;
+    } else {
+      r->done += res;
+      if (res > 0 && r->done < r->len) {
+        aio_prepare(r);
+        aio_push(&a->queue_head, &a->queue_tail, r);
+        continue;
+      }
+      if (res == 0 && r->op == AIO_WRITE && r->done < r->len)
+        r->error = EIO;
+    }
+    aio_push(&a->done_head, &a->done_tail, r);
+  }
+  __atomic_store_n(a->cq_head, head, __ATOMIC_RELEASE);
+
+  uring_submit_queue(a);
+}
+
+static int uring_reap(Aio *a, AioRequest **reqs, int max, int wait) {
+  while (1) {
+    uring_collect(a);
+    if (a->done_head || !wait || a->inflight == 0)
+      return aio_pop_done(a, reqs, max);
+    uring_enter(a, 0, 1, IORING_ENTER_GETEVENTS);
+  }
+}
+#endif
+
+/*** api ***/
+
+Aio *aio_create(unsigned depth, enum AioBackend backend) {
+  Aio *a = dmalloc(sizeof(Aio));
+  memset(a, 0, sizeof(Aio));
+  a->notify_fd = a->notify_wfd = -1;
+  pthread_mutex_init(&a->lock, NULL);
+  pthread_cond_init(&a->work, NULL);
+  pthread_cond_init(&a->done, NULL);
+
+#ifdef __linux__
+  a->ring_fd = -1;
+  if (backend == AIO_BACKEND_AUTO && uring_setup(a, depth) == 0)
+    return a;
+#else
+  (void)depth;
+  (void)backend;
+#endif
+
+  if (pool_setup(a) == -1) {
+    aio_destroy(a);
+    return NULL;
+  }
+  return a;
+}
+
+const char *aio_backend_name(Aio *a) {
+  return a->uring ? "io_uring" : "threads";
+}
+
+void aio_submit(Aio *a, AioRequest *req) {
+  req->done = 0;
+  req->error = 0;
+  aio_prepare(req);
+
+#ifdef __linux__
+  if (a->uring) {
+    a->inflight++;
+    aio_push(&a->queue_head, &a->queue_tail, req);
+    uring_submit_queue(a);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&a->lock);
+  a->inflight++;
+  aio_push(&a->queue_head, &a->queue_tail, req);
+  pthread_cond_signal(&a->work);
+  pthread_mutex_unlock(&a->lock);
+}
+
+int aio_fd(Aio *a) { return a->notify_fd; }
+
+int aio_reap(Aio *a, AioRequest **reqs, int max) {
+#ifdef __linux__
+  if (a->uring)
+    return uring_reap(a, reqs, max, 0);
+#endif
+  return pool_reap(a, reqs, max, 0);
+}
+
+int aio_wait(Aio *a, AioRequest **reqs, int max) {
+#ifdef __linux__
+  if (a->uring)
+    return uring_reap(a, reqs, max, 1);
+#endif
+  return pool_reap(a, reqs, max, 1);
+}
+
+int aio_inflight(Aio *a) { return a->inflight; }
+
+void aio_destroy(Aio *a) {
+  if (!a)
+    return;
+
+#ifdef __linux__
+  if (a->uring) {
+    // The kernel may still be writing into the buffers of these requests
+    while (a->ring_used > 0) {
+      uring_enter(a, 0, 1, IORING_ENTER_GETEVENTS);
+      uring_collect(a);
+    }
+    uring_teardown(a);
+  }
+#endif
+  if (!a->uring) {
+    pool_teardown(a);
+    if (a->notify_fd != -1)
+      close(a->notify_fd);
+    if (a->notify_wfd != -1)
+      close(a->notify_wfd);
+  }
+
+  pthread_mutex_destroy(&a->lock);
+  pthread_cond_destroy(&a->work);
+  pthread_cond_destroy(&a->done);
+  dfree(a);
+}
+
+#ifdef TESTS_AIO
+#define TEST_CHUNK (256 * 1024)
+#define TEST_CHUNKS 32
+
+static void test_backend(enum AioBackend backend) {
+  const char *path = "/tmp/ditto-aio-test";
+  Aio *a = aio_create(8, backend);
+  if (!a) {
+    fprintf(stderr, "Could not create the backend\n");
+    exit(1);
+  }
+  printf("Testing %s backend\n", aio_backend_name(a));
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  AioRequest reqs[TEST_CHUNKS];
+  AioRequest *done[TEST_CHUNKS];
+  char *data = dmalloc(TEST_CHUNK * TEST_CHUNKS);
+  for (int j = 0; j < TEST_CHUNK * TEST_CHUNKS; j++)
+    data[j] = (char)(j * 31 + j / 7);
+
+  // --------- Queued writes beyond the depth ---------
+  for (int c = 0; c < TEST_CHUNKS; c++) {
+    reqs[c].op = AIO_WRITE;
+    reqs[c].fd = fd;
+    reqs[c].buf = data + c * TEST_CHUNK;
+    reqs[c].len = TEST_CHUNK;
+    reqs[c].off = (off_t)c * TEST_CHUNK;
+    aio_submit(a, &reqs[c]);
+  }
+  int completed = 0, n;
+  while ((n = aio_wait(a, done, TEST_CHUNKS)) > 0) {
+    for (int k = 0; k < n; k++) {
+      if (done[k]->error || done[k]->done != TEST_CHUNK) {
+        fprintf(stderr, "Write failed: %s\n", strerror(done[k]->error));
+        exit(1);
+      }
+    }
+    completed += n;
+  }
+  if (completed != TEST_CHUNKS || aio_inflight(a) != 0) {
+    fprintf(stderr, "Missing write completions (%d)\n", completed);
+    exit(1);
+  }
+
+  // --------- Reads, the last one past EOF ---------
+  char *back = dmalloc(TEST_CHUNK * (TEST_CHUNKS + 1));
+  for (int c = 0; c < TEST_CHUNKS; c++) {
+    reqs[c].op = AIO_READ;
+    reqs[c].buf = back + c * TEST_CHUNK;
+    reqs[c].len = c == TEST_CHUNKS - 1 ? 2 * TEST_CHUNK : TEST_CHUNK;
+    aio_submit(a, &reqs[c]);
+  }
+  completed = 0;
+  while (aio_inflight(a) > 0) {
+    n = aio_reap(a, done, TEST_CHUNKS);
+    for (int k = 0; k < n; k++) {
+      if (done[k]->error || done[k]->done != TEST_CHUNK) {
+        fprintf(stderr, "Read returned %zu bytes\n", done[k]->done);
+        exit(1);
+      }
+    }
+    completed += n;
+  }
+  if (completed != TEST_CHUNKS ||
+      memcmp(data, back, TEST_CHUNK * TEST_CHUNKS) != 0) {
+    fprintf(stderr, "Read back different data\n");
+    exit(1);
+  }
+
+  // --------- Errors ---------
+  reqs[0].fd = -1;
+  aio_submit(a, &reqs[0]);
+  if (aio_wait(a, done, 1) != 1 || done[0]->error != EBADF) {
+    fprintf(stderr, "Expected EBADF\n");
+    exit(1);
+  }
+
+  close(fd);
+  unlink(path);
+  dfree(data);
+  dfree(back);
+  aio_destroy(a);
+}
+
+int main(void) {
+  test_backend(AIO_BACKEND_AUTO);
+  test_backend(AIO_BACKEND_THREADS);
+
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  return 0;
+}
+#endif
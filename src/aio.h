@@ -0,0 +1,87 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum AioOp {
+  AIO_READ = 0,
+  AIO_WRITE,
+};
+
+enum AioBackend {
+  // io_uring when the kernel allows it, the thread pool otherwise
+  AIO_BACKEND_AUTO = 0,
+  AIO_BACKEND_THREADS,
+};
+
+// A read or write of len bytes at off. Short transfers are resumed by the
+// backend, a request only completes once done == len, at EOF or on error.
+// The request and its buffer must stay valid until it completes.
+typedef struct AioRequest {
+  enum AioOp op;
+  int fd;
+  char *buf;
+  size_t len;
+  off_t off;
+  // Bytes transferred so far
+  size_t done;
+  // errno of the failure, 0 on success
+  int error;
+  // Called by the owner when the request is reaped, with its own data
+  void (*complete)(struct AioRequest *req);
+  void *data;
+
+  // Private to the backend
+  struct iovec iov;
+  struct AioRequest *next;
+} AioRequest;
+
+typedef struct Aio Aio;
+
+/**
+ * Create a backend running up to depth requests at once. Returns NULL on
+ * failure.
+ */
+Aio *aio_create(unsigned depth, enum AioBackend backend);
+
+/**
+ * Name of the backend in use, "io_uring" or "threads".
+ */
+const char *aio_backend_name(Aio *a);
+
+/**
+ * Queue a request. Requests beyond the depth wait in the backend.
+ */
+void aio_submit(Aio *a, AioRequest *req);
+
+/**
+ * Descriptor which becomes readable when completions are ready, to poll it
+ * along with the other event sources.
+ */
+int aio_fd(Aio *a);
+
+/**
+ * Store up to max completed requests in reqs without blocking. Returns how
+ * many were stored.
+ */
+int aio_reap(Aio *a, AioRequest **reqs, int max);
+
+/**
+ * Like aio_reap, but blocks until at least one request completes. Returns 0
+ * only if there's nothing in flight.
+ */
+int aio_wait(Aio *a, AioRequest **reqs, int max);
+
+/**
+ * Number of submitted requests not reaped yet.
+ */
+int aio_inflight(Aio *a);
+
+/**
+ * Destroy the backend, waiting for the requests in flight.
+ */
+void aio_destroy(Aio *a);
+
+#endif
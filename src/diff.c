@@ -0,0 +1,379 @@
+#include "diff.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dmalloc.h"
+
+// Edit cost past which a middle snake search settles for the furthest point
+// reached (GNU diff's "too expensive" heuristic), at least this
+#define DIFF_MIN_COST 256
+// Diagonals searched and lines compared, in total, before whatever is left
+// is replaced as a whole, bounding the time of a diff of unrelated files
+#define DIFF_MAX_WORK (32L * 1024 * 1024)
+
+typedef struct {
+  const uint64_t *a, *b;
+  // Lines deleted from a and inserted in b
+  char *da, *ib;
+  // Furthest reaching x of the forward and backward searches, by diagonal
+  // k = x - y
+  long *fd, *bd;
+  long too_expensive;
+  long work;
+} DiffContext;
+
+uint64_t diff_hash(const char *s, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  while (len >= 8) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+    s += 8;
+    len -= 8;
+  }
+  uint64_t w = 0;
+  memcpy(&w, s, len);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 29;
+  h *= 0xff51afd7ed558ccdull;
+  return h ^ (h >> 32);
+}
+
+// Finds the middle snake of a[xoff, xlim) and b[yoff, ylim), searching from
+// both ends at once until the paths overlap, storing where it splits the
+// edit script in two halves. Past c->too_expensive edits the split is the
+// furthest point reached instead, and the script may not be minimal.
+// Returns -1 once the work budget of the diff is spent.
+static int diff_split(DiffContext *c, long xoff, long xlim, long yoff,
+                      long ylim, long *xmid, long *ymid) {
+  const uint64_t *a = c->a, *b = c->b;
+  long *fd = c->fd, *bd = c->bd;
+  long dmin = xoff - ylim, dmax = xlim - yoff;
+  long fmid = xoff - yoff, bmid = xlim - ylim;
+  long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+  int odd = (fmid - bmid) & 1;
+
+  fd[fmid] = xoff;
+  bd[bmid] = xlim;
+
+  for (long cost = 1;; cost++) {
+    if (c->work > DIFF_MAX_WORK)
+      return -1;
+
+    // One more edit forward
+    if (fmin > dmin)
+      fd[--fmin - 1] = -1;
+    else
+      ++fmin;
+    if (fmax < dmax)
+      fd[++fmax + 1] = -1;
+    else
+      --fmax;
+    for (long d = fmax; d >= fmin; d -= 2) {
+      long lo = fd[d - 1], hi = fd[d + 1];
+      long x = lo >= hi ? lo + 1 : hi;
+      long y = x - d;
+      long x0 = x;
+      while (x < xlim && y < ylim && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      c->work += 1 + x - x0;
+      fd[d] = x;
+      if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+        *xmid = x;
+        *ymid = y;
+        return 0;
+      }
+    }
+
+    // One more edit backward
+    if (bmin > dmin)
+      bd[--bmin - 1] = LONG_MAX;
+    else
+      ++bmin;
+    if (bmax < dmax)
+      bd[++bmax + 1] = LONG_MAX;
+    else
+      --bmax;
+    for (long d = bmax; d >= bmin; d -= 2) {
+      long lo = bd[d - 1], hi = bd[d + 1];
+      long x = lo < hi ? lo : hi - 1;
+      long y = x - d;
+      long x0 = x;
+      while (x > xoff && y > yoff && a[x - 1] == b[y - 1]) {
+        x--;
+        y--;
+      }
+      c->work += 1 + x0 - x;
+      bd[d] = x;
+      if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+        *xmid = x;
+        *ymid = y;
+        return 0;
+      }
+    }
+
+    if (cost < c->too_expensive)
+      continue;
+
+    // Split at the point furthest along either search, x + y being the
+    // progress on a diagonal
+    long fbest = -1, fx = 0, bbest = LONG_MAX, bx = 0;
+    for (long d = fmax; d >= fmin; d -= 2) {
+      long x = fd[d] < xlim ? fd[d] : xlim;
+      if (x - d > ylim)
+        x = ylim + d;
+      if (2 * x - d > fbest) {
+        fbest = 2 * x - d;
+        fx = x;
+      }
+    }
+    for (long d = bmax; d >= bmin; d -= 2) {
+      long x = bd[d] > xoff ? bd[d] : xoff;
+      if (x - d < yoff)
+        x = yoff + d;
+      if (2 * x - d < bbest) {
+        bbest = 2 * x - d;
+        bx = x;
+      }
+    }
+    if (fbest - (xoff + yoff) >= (xlim + ylim) - bbest) {
+      *xmid = fx;
+      *ymid = fbest - fx;
+    } else {
+      *xmid = bx;
+      *ymid = bbest - bx;
+    }
+    return 0;
+  }
+}
+
+static void diff_compare(DiffContext *c, long xoff, long xlim, long yoff,
+                         long ylim) {
+  const uint64_t *a = c->a, *b = c->b;
+
+  // Common prefix and suffix are matched as they are
+  while (xoff < xlim && yoff < ylim && a[xoff] == b[yoff]) {
+    xoff++;
+    yoff++;
+  }
+  while (xlim > xoff && ylim > yoff && a[xlim - 1] == b[ylim - 1]) {
+    xlim--;
+    ylim--;
+  }
+
+  if (xoff == xlim) {
+    memset(c->ib + yoff, 1, ylim - yoff);
+  } else if (yoff == ylim) {
+    memset(c->da + xoff, 1, xlim - xoff);
+  } else {
+    long xmid, ymid;
+    if (diff_split(c, xoff, xlim, yoff, ylim, &xmid, &ymid) == -1) {
+      // Out of time: the rest is replaced as a whole
+      memset(c->da + xoff, 1, xlim - xoff);
+      memset(c->ib + yoff, 1, ylim - yoff);
+      return;
+    }
+    diff_compare(c, xoff, xmid, yoff, ymid);
+    diff_compare(c, xmid, xlim, ymid, ylim);
+  }
+}
+
+long diff_lines(const uint64_t *a, long na, const uint64_t *b, long nb,
+                DiffHunk **hunks) {
+  // Only the middle, differing part needs the search arrays
+  long pre = 0;
+  while (pre < na && pre < nb && a[pre] == b[pre])
+    pre++;
+  long suf = 0;
+  while (suf < na - pre && suf < nb - pre &&
+         a[na - 1 - suf] == b[nb - 1 - suf])
+    suf++;
+
+  *hunks = NULL;
+  long ma = na - pre - suf, mb = nb - pre - suf;
+  if (ma == 0 && mb == 0)
+    return 0;
+
+  DiffContext c;
+  c.a = a + pre;
+  c.b = b + pre;
+  c.da = dmalloc(ma + 1);
+  c.ib = dmalloc(mb + 1);
+  memset(c.da, 0, ma + 1);
+  memset(c.ib, 0, mb + 1);
+  // Diagonals go from -mb to ma, plus one sentinel on each side
+  long ndiags = ma + mb + 3;
+  long *diags = dmalloc(sizeof(long) * 2 * ndiags);
+  c.fd = diags + mb + 1;
+  c.bd = diags + ndiags + mb + 1;
+  // About twice the square root of the diagonals, as GNU diff
+  c.too_expensive = 1;
+  for (long d = ndiags; d != 0; d >>= 2)
+    c.too_expensive <<= 1;
+  if (c.too_expensive < DIFF_MIN_COST)
+    c.too_expensive = DIFF_MIN_COST;
+  c.work = 0;
+
+  diff_compare(&c, 0, ma, 0, mb);
+
+  // Unchanged lines pair up in order, the runs between them are hunks
+  long n = 0, cap = 0;
+  long i = 0, j = 0;
+  while (i < ma || j < mb) {
+    if (i < ma && j < mb && !c.da[i] && !c.ib[j]) {
+      i++;
+      j++;
+      continue;
+    }
+    long si = i, sj = j;
+    while (i < ma && c.da[i])
+      i++;
+    while (j < mb && c.ib[j])
+      j++;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 16;
+      *hunks = drealloc(*hunks, sizeof(DiffHunk) * cap);
+    }
+    (*hunks)[n++] = (DiffHunk){pre + si, i - si, pre + sj, j - sj};
+  }
+
+  dfree(diags);
+  dfree(c.da);
+  dfree(c.ib);
+  return n;
+}
+
+#ifdef TESTS_DIFF
+// Applies the hunks to a, checking that the result is b
+static void test_apply(const uint64_t *a, long na, const uint64_t *b, long nb,
+                       DiffHunk *h, long n, const char *step) {
+  long i = 0, j = 0;
+  for (long k = 0; k < n; k++) {
+    // Unchanged lines up to the hunk
+    while (i < h[k].a) {
+      if (j >= nb || a[i] != b[j]) {
+        fprintf(stderr, "%s: unchanged line %ld differs\n", step, i);
+        exit(1);
+      }
+      i++;
+      j++;
+    }
+    if (j != h[k].b) {
+      fprintf(stderr, "%s: hunk %ld misplaced\n", step, k);
+      exit(1);
+    }
+    i += h[k].alen;
+    j += h[k].blen;
+  }
+  while (i < na && j < nb && a[i] == b[j]) {
+    i++;
+    j++;
+  }
+  if (i != na || j != nb) {
+    fprintf(stderr, "%s: hunks don't cover the sequences\n", step);
+    exit(1);
+  }
+}
+
+int main(void) {
+  srand(42);
+
+  // --------- Known edit ---------
+  uint64_t a[] = {1, 2, 3, 4, 5, 6};
+  uint64_t b[] = {1, 3, 4, 9, 5, 6, 7};
+  DiffHunk *h;
+  long n = diff_lines(a, 6, b, 7, &h);
+  if (n != 3 || h[0].a != 1 || h[0].alen != 1 || h[0].blen != 0 ||
+      h[1].a != 4 || h[1].b != 3 || h[1].blen != 1 || h[2].a != 6 ||
+      h[2].blen != 1) {
+    fprintf(stderr, "Wrong hunks for the known edit (%ld)\n", n);
+    exit(1);
+  }
+  dfree(h);
+
+  // --------- Same and empty ---------
+  if (diff_lines(a, 6, a, 6, &h) != 0 || diff_lines(a, 0, a, 0, &h) != 0) {
+    fprintf(stderr, "Equal sequences have no hunks\n");
+    exit(1);
+  }
+  n = diff_lines(a, 0, b, 7, &h);
+  if (n != 1 || h[0].blen != 7) {
+    fprintf(stderr, "Everything is inserted into an empty sequence\n");
+    exit(1);
+  }
+  dfree(h);
+
+  // --------- Random edits ---------
+  for (int round = 0; round < 200; round++) {
+    long na = rand() % 2000;
+    uint64_t *x = dmalloc(sizeof(uint64_t) * (na + 1));
+    uint64_t *y = dmalloc(sizeof(uint64_t) * (na * 2 + 64));
+    for (long i = 0; i < na; i++)
+      x[i] = rand() % 50;
+    long nb = 0;
+    for (long i = 0; i < na; i++) {
+      int r = rand() % 100;
+      if (r < 3)
+        continue;
+      if (r < 6)
+        y[nb++] = rand() % 50;
+      y[nb++] = x[i];
+    }
+    n = diff_lines(x, na, y, nb, &h);
+    test_apply(x, na, y, nb, h, n, "random");
+    dfree(h);
+    dfree(x);
+    dfree(y);
+  }
+
+  // --------- Too expensive ---------
+  // Unrelated sequences, and many scattered changes: past the cost cap the
+  // hunks may not be minimal, but they must still turn a into b
+  for (int round = 0; round < 2; round++) {
+    long na = 40000;
+    uint64_t *x = dmalloc(sizeof(uint64_t) * na);
+    uint64_t *y = dmalloc(sizeof(uint64_t) * na);
+    for (long i = 0; i < na; i++) {
+      x[i] = i;
+      y[i] = round == 0 ? na + i : (rand() % 4 ? i : na + i);
+    }
+    n = diff_lines(x, na, y, na, &h);
+    test_apply(x, na, y, na, h, n, round == 0 ? "unrelated" : "scattered");
+    dfree(h);
+    dfree(x);
+    dfree(y);
+  }
+
+  // --------- Few changes in a large file ---------
+  long big = 1000000;
+  uint64_t *x = dmalloc(sizeof(uint64_t) * big);
+  uint64_t *y = dmalloc(sizeof(uint64_t) * big);
+  for (long i = 0; i < big; i++) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "line %ld", i);
+    x[i] = y[i] = diff_hash(line, len);
+  }
+  for (int k = 1; k <= 10; k++)
+    y[k * 90000] ^= 1;
+  n = diff_lines(x, big, y, big, &h);
+  if (n != 10) {
+    fprintf(stderr, "Expected 10 hunks, got %ld\n", n);
+    exit(1);
+  }
+  test_apply(x, big, y, big, h, n, "large");
+  dfree(h);
+  dfree(x);
+  dfree(y);
+
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  return 0;
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lines a[a, a + alen) are replaced by b[b, b + blen). One of the lengths can
+// be 0, for pure insertions or deletions.
+typedef struct {
+  long a, alen;
+  long b, blen;
+} DiffHunk;
+
+/**
+ * Hash of a line, lines are compared by hash only.
+ */
+uint64_t diff_hash(const char *s, size_t len);
+
+/**
+ * Line diff of two sequences of line hashes, with Myers' linear space
+ * algorithm after trimming the common prefix and suffix. It takes
+ * O((na + nb) * D) time for D differences and O(na + nb) memory, except
+ * that past a cost, as in GNU diff, hunks may be larger than needed so that
+ * very different sequences take bounded time.
+ * Returns the number of hunks, stored in order in *hunks (to be freed with
+ * dfree), or -1 on error.
+ */
+long diff_lines(const uint64_t *a, long na, const uint64_t *b, long nb,
+                DiffHunk **hunks);
+
+#endif
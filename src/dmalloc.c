@@ -3,7 +3,21 @@
 #include <stdio.h>
 #include <string.h>
 
+// Updated atomically as background workers (e.g. the trigram indexer) allocate
+// too
 static size_t total_mem = 0;
+// Highest total_mem seen
+static size_t peak_mem = 0;
+// Calls to dmalloc and drealloc
+static size_t nallocs = 0;
+
+static void track_peak(size_t total) {
+  size_t peak = __atomic_load_n(&peak_mem, __ATOMIC_RELAXED);
+  while (total > peak &&
+         !__atomic_compare_exchange_n(&peak_mem, &peak, total, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
 
 void *dmalloc(size_t size) {
   size_t realsize = size + sizeof(size_t);
@@ -14,7 +28,8 @@ void *dmalloc(size_t size) {
     exit(1);
   }
 
-  total_mem += realsize;
+  track_peak(__atomic_add_fetch(&total_mem, realsize, __ATOMIC_RELAXED));
+  __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
   *((size_t*)p) = (size_t)size;
 
   return p + sizeof(size_t);
@@ -34,7 +49,11 @@ void *drealloc(void *p, size_t size) {
   }
 
   // Overhead size_t space remains
-  total_mem = total_mem - oldsize + size;
+  if (size > oldsize)
+    track_peak(__atomic_add_fetch(&total_mem, size - oldsize, __ATOMIC_RELAXED));
+  else
+    __atomic_sub_fetch(&total_mem, oldsize - size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
   *((size_t*)(newp)) = (size_t)size;
 
   return newp + sizeof(size_t);
@@ -46,7 +65,7 @@ void dfree(void *p) {
   void *realp = p - sizeof(size_t);
   size_t objsize = *((size_t*)(realp));
   free(realp);
-  total_mem -= (objsize + sizeof(size_t));
+  __atomic_sub_fetch(&total_mem, objsize + sizeof(size_t), __ATOMIC_RELAXED);
 }
 
 char *dstrdup(const char *s) {
@@ -57,7 +76,15 @@ char *dstrdup(const char *s) {
 }
 
 size_t used_memory(void) {
-  return total_mem;
+  return __atomic_load_n(&total_mem, __ATOMIC_RELAXED);
+}
+
+size_t peak_memory(void) {
+  return __atomic_load_n(&peak_mem, __ATOMIC_RELAXED);
+}
+
+size_t alloc_count(void) {
+  return __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
 }
 
 #ifdef TESTS_DMALLOC
@@ -126,5 +153,17 @@ int main(void) {
     fprintf(stderr, "Wrong memory usage after dfree of reallocated 't' = %zu\n", used_memory());
     exit(1);
   }
+
+  // --------- Peak ---------
+  if (peak_memory() != 300 + 3*sizeof(size_t)) {
+    fprintf(stderr, "Wrong peak memory usage = %zu\n", peak_memory());
+    exit(1);
+  }
+
+  // --------- Count ---------
+  if (alloc_count() != 5) {
+    fprintf(stderr, "Wrong count of allocations = %zu\n", alloc_count());
+    exit(1);
+  }
 }
 #endif
@@ -6,5 +6,9 @@ void *drealloc(void *p, size_t size);
 void dfree(void *p);
 char *dstrdup(const char *s);
 size_t used_memory(void);
+// Highest used_memory() so far
+size_t peak_memory(void);
+// Allocations so far, dmalloc and drealloc calls
+size_t alloc_count(void);
 
 #endif
@@ -0,0 +1,150 @@
+#include "hist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dmalloc.h"
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+// Values below 2 * HIST_SUB exactly, then HIST_SUB buckets for each power
+// of two up to 2^HIST_MAX_BITS
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct Hist {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+};
+
+Hist *hist_create(void) {
+  Hist *h = dmalloc(sizeof(Hist));
+  hist_reset(h);
+  return h;
+}
+
+void hist_destroy(Hist *h) { dfree(h); }
+
+void hist_reset(Hist *h) { memset(h, 0, sizeof(Hist)); }
+
+// The top HIST_SUB_BITS + 1 bits of v pick its bucket among those of its
+// power of two
+static int hist_bucket(uint64_t v) {
+  if (v < 2 * HIST_SUB)
+    return (int)v;
+  int e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return (e + 1) * HIST_SUB + (int)(v >> e) - HIST_SUB;
+}
+
+// Middle of the values of bucket b
+static uint64_t hist_value(int b) {
+  if (b < 2 * HIST_SUB)
+    return b;
+  int e = b / HIST_SUB - 1;
+  uint64_t low = (uint64_t)(b % HIST_SUB + HIST_SUB) << e;
+  return low + ((uint64_t)1 << e) / 2;
+}
+
+void hist_record(Hist *h, uint64_t v) {
+  if (v > h->max)
+    h->max = v;
+  if (v >= (uint64_t)1 << HIST_MAX_BITS)
+    v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+  h->counts[hist_bucket(v)]++;
+  h->count++;
+}
+
+uint64_t hist_count(Hist *h) { return h->count; }
+
+uint64_t hist_max(Hist *h) { return h->max; }
+
+uint64_t hist_quantile(Hist *h, double q) {
+  if (h->count == 0)
+    return 0;
+
+  // Nearest rank, from 1 to count
+  uint64_t rank = (uint64_t)(q * h->count + 0.5);
+  rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+  // The largest value is known exactly
+  if (rank == h->count)
+    return h->max;
+  uint64_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen >= rank) {
+      uint64_t v = hist_value(b);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+#ifdef TESTS_HIST
+static void expect_near(const char *what, uint64_t got, uint64_t want) {
+  // Within the precision of a bucket
+  uint64_t err = got > want ? got - want : want - got;
+  if (err * HIST_SUB > want) {
+    fprintf(stderr, "%s is %llu, expected ~%llu\n", what,
+            (unsigned long long)got, (unsigned long long)want);
+    exit(1);
+  }
+}
+
+int main(void) {
+  Hist *h = hist_create();
+  if (hist_quantile(h, 0.5) != 0 || hist_max(h) != 0) {
+    fprintf(stderr, "Empty histogram not 0\n");
+    exit(1);
+  }
+
+  // --------- Buckets ---------
+  // Contiguous, and each value in the bucket of the same middle
+  for (uint64_t v = 1; v < 1 << 20; v++) {
+    int b = hist_bucket(v);
+    if (b != hist_bucket(v - 1) && b != hist_bucket(v - 1) + 1) {
+      fprintf(stderr, "Bucket of %llu is %d\n", (unsigned long long)v, b);
+      exit(1);
+    }
+    if (hist_bucket(hist_value(b)) != b) {
+      fprintf(stderr, "Middle of bucket %d is out of it\n", b);
+      exit(1);
+    }
+  }
+  if (hist_bucket(((uint64_t)1 << HIST_MAX_BITS) - 1) != HIST_BUCKETS - 1) {
+    fprintf(stderr, "Wrong number of buckets\n");
+    exit(1);
+  }
+
+  // --------- Quantiles ---------
+  // 1..10000, and an outlier
+  for (uint64_t v = 1; v <= 10000; v++)
+    hist_record(h, v);
+  hist_record(h, (uint64_t)1 << 50);
+  expect_near("p50", hist_quantile(h, 0.5), 5000);
+  expect_near("p99", hist_quantile(h, 0.99), 9900);
+  expect_near("p0", hist_quantile(h, 0), 1);
+  if (hist_count(h) != 10001 || hist_max(h) != (uint64_t)1 << 50 ||
+      hist_quantile(h, 1) != hist_max(h)) {
+    fprintf(stderr, "Wrong count or max\n");
+    exit(1);
+  }
+
+  // Small values are exact
+  hist_reset(h);
+  hist_record(h, 3);
+  hist_record(h, 7);
+  hist_record(h, 42);
+  if (hist_quantile(h, 0.5) != 7 || hist_quantile(h, 1) != 42) {
+    fprintf(stderr, "Small values not exact\n");
+    exit(1);
+  }
+
+  hist_destroy(h);
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked %zu bytes\n", used_memory());
+    exit(1);
+  }
+  printf("All tests passed\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,37 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+// Histogram of values (latencies in microseconds), HDR style: exact below
+// 64, then 32 buckets per power of two, so that quantiles are within ~3% of
+// the values recorded. Recording is O(1) in a fixed array.
+typedef struct Hist Hist;
+
+Hist *hist_create(void);
+void hist_destroy(Hist *h);
+
+/**
+ * Record a value. Values past the last bucket (2^40) are recorded in it.
+ */
+void hist_record(Hist *h, uint64_t v);
+
+/**
+ * Forget the values recorded.
+ */
+void hist_reset(Hist *h);
+
+uint64_t hist_count(Hist *h);
+
+/**
+ * Largest value recorded, exactly.
+ */
+uint64_t hist_max(Hist *h);
+
+/**
+ * Value at quantile q (0..1): the middle of the bucket holding it, 0 if
+ * nothing was recorded.
+ */
+uint64_t hist_quantile(Hist *h, double q);
+
+#endif
@@ -0,0 +1,361 @@
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dmalloc.h"
+
+#define JOURNAL_MAGIC "DSWP0001"
+#define JOURNAL_MAGIC_SZ 8
+#define JOURNAL_HEADER_SZ (JOURNAL_MAGIC_SZ + 16)
+// Batch framing: payload length and checksum
+#define JOURNAL_BATCH_HEADER_SZ 8
+// Buffered bytes written (without fsync) before the next flush
+#define JOURNAL_MAX_BUFFER (1 << 20)
+
+static uint32_t journal_checksum(const char *p, size_t len) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int journal_write_header(Journal *j, uint64_t fsize, int64_t fmtime) {
+  char header[JOURNAL_HEADER_SZ];
+  memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_SZ);
+  memcpy(header + JOURNAL_MAGIC_SZ, &fsize, 8);
+  memcpy(header + JOURNAL_MAGIC_SZ + 8, &fmtime, 8);
+
+  if (ftruncate(j->fd, 0) == -1 || lseek(j->fd, 0, SEEK_SET) == -1 ||
+      write_all(j->fd, header, sizeof(header)) == -1 || fsync(j->fd) == -1)
+    return -1;
+
+  j->size = sizeof(header);
+  return 0;
+}
+
+int journal_lock(const char *path) {
+  while (1) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+      return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+
+    // The process that held it may have removed it on exit meanwhile: the
+    // lock must be on the file still at path
+    struct stat locked, at;
+    if (fstat(fd, &locked) == 0 && stat(path, &at) == 0 &&
+        locked.st_dev == at.st_dev && locked.st_ino == at.st_ino)
+      return fd;
+    close(fd);
+  }
+}
+
+Journal *journal_open(int fd, uint64_t fsize, int64_t fmtime, off_t keep) {
+  if (fd == -1)
+    return NULL;
+
+  Journal *j = dmalloc(sizeof(Journal));
+  j->fd = fd;
+  j->buf = NULL;
+  j->len = 0;
+  j->cap = 0;
+  j->size = 0;
+  j->nrecords = 0;
+
+  if (keep >= JOURNAL_HEADER_SZ) {
+    // Drop whatever follows the last valid batch
+    if (ftruncate(fd, keep) == -1 || lseek(fd, keep, SEEK_SET) == -1) {
+      journal_close(j, NULL);
+      return NULL;
+    }
+    j->size = keep;
+  } else if (journal_write_header(j, fsize, fmtime) == -1) {
+    journal_close(j, NULL);
+    return NULL;
+  }
+
+  return j;
+}
+
+static void journal_put(Journal *j, const void *p, size_t len) {
+  if (j->len + len > j->cap) {
+    while (j->len + len > j->cap)
+      j->cap = j->cap ? j->cap * 2 : 4096;
+    j->buf = drealloc(j->buf, j->cap);
+  }
+  memcpy(j->buf + j->len, p, len);
+  j->len += len;
+}
+
+// Unsigned LEB128
+static void journal_put_varint(Journal *j, uint32_t v) {
+  unsigned char b[5];
+  size_t n = 0;
+  do {
+    b[n] = v & 0x7f;
+    v >>= 7;
+    if (v)
+      b[n] |= 0x80;
+    n++;
+  } while (v);
+  journal_put(j, b, n);
+}
+
+// Writes the buffered records as a batch, without fsync
+static int journal_write_batch(Journal *j) {
+  if (j->len == 0)
+    return 0;
+
+  uint32_t hdr[2] = {j->len, journal_checksum(j->buf, j->len)};
+  if (write_all(j->fd, (char *)hdr, sizeof(hdr)) == -1 ||
+      write_all(j->fd, j->buf, j->len) == -1)
+    return -1;
+
+  j->size += sizeof(hdr) + j->len;
+  j->len = 0;
+  return 0;
+}
+
+int journal_record(Journal *j, uint8_t op, uint32_t row, uint32_t col,
+                   const char *data, uint32_t len) {
+  journal_put(j, &op, 1);
+  journal_put_varint(j, row);
+  journal_put_varint(j, col);
+  journal_put_varint(j, len);
+  if (len)
+    journal_put(j, data, len);
+  j->nrecords++;
+
+  // Bound the memory of the buffer, durability still waits for the flush
+  if (j->len >= JOURNAL_MAX_BUFFER)
+    return journal_write_batch(j);
+  return 0;
+}
+
+int journal_flush(Journal *j) {
+  if (journal_write_batch(j) == -1)
+    return -1;
+  return fsync(j->fd);
+}
+
+int journal_reset(Journal *j, uint64_t fsize, int64_t fmtime) {
+  j->len = 0;
+  j->nrecords = 0;
+  return journal_write_header(j, fsize, fmtime);
+}
+
+void journal_close(Journal *j, const char *path) {
+  if (!j)
+    return;
+  // Removed while still locked, so that no other process locks it meanwhile
+  if (path)
+    unlink(path);
+  close(j->fd);
+  dfree(j->buf);
+  dfree(j);
+}
+
+static int journal_get_varint(const char **p, const char *end, uint32_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*p >= end)
+      return -1;
+    unsigned char b = *(*p)++;
+    *v |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+long journal_replay(const char *path, uint64_t fsize, int64_t fmtime,
+                    JournalApplyFn fn, void *ctx, off_t *valid) {
+  *valid = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  char header[JOURNAL_HEADER_SZ];
+  uint64_t size;
+  int64_t mtime;
+  if (read(fd, header, sizeof(header)) != sizeof(header) ||
+      memcmp(header, JOURNAL_MAGIC, JOURNAL_MAGIC_SZ) != 0) {
+    close(fd);
+    return -1;
+  }
+  memcpy(&size, header + JOURNAL_MAGIC_SZ, 8);
+  memcpy(&mtime, header + JOURNAL_MAGIC_SZ + 8, 8);
+  if (size != fsize || mtime != fmtime) {
+    close(fd);
+    return -1;
+  }
+
+  off_t off = sizeof(header);
+  long applied = 0;
+  char *batch = NULL;
+  uint32_t hdr[2];
+
+  while (read(fd, hdr, sizeof(hdr)) == sizeof(hdr)) {
+    batch = drealloc(batch, hdr[0] ? hdr[0] : 1);
+    if (read(fd, batch, hdr[0]) != (ssize_t)hdr[0] ||
+        journal_checksum(batch, hdr[0]) != hdr[1])
+      break;
+
+    const char *p = batch, *end = batch + hdr[0];
+    int ok = 1;
+    while (p < end && ok) {
+      JournalRecord rec;
+      rec.op = *p++;
+      if (journal_get_varint(&p, end, &rec.row) == -1 ||
+          journal_get_varint(&p, end, &rec.col) == -1 ||
+          journal_get_varint(&p, end, &rec.len) == -1 ||
+          rec.len > (size_t)(end - p)) {
+        ok = 0;
+        break;
+      }
+      rec.data = p;
+      p += rec.len;
+      if (fn(ctx, &rec) == -1)
+        ok = 0;
+      else
+        applied++;
+    }
+
+    if (!ok)
+      break;
+    off += JOURNAL_BATCH_HEADER_SZ + hdr[0];
+  }
+
+  *valid = off;
+  dfree(batch);
+  close(fd);
+  return applied;
+}
+
+#ifdef TESTS_JOURNAL
+static char test_log[256];
+
+static int test_apply(void *ctx, JournalRecord *rec) {
+  (void)ctx;
+  char s[64];
+  snprintf(s, sizeof(s), "%d:%u:%u:%.*s;", rec->op, rec->row, rec->col,
+           (int)rec->len, rec->data);
+  strcat(test_log, s);
+  return 0;
+}
+
+int main(void) {
+  const char *path = "/tmp/ditto-journal-test.dswp";
+  off_t valid;
+
+  Journal *j = journal_open(journal_lock(path), 100, 42, 0);
+  if (!j) {
+    fprintf(stderr, "Could not open the journal\n");
+    exit(1);
+  }
+
+  // --------- Lock ---------
+  // Another descriptor, as another process would have
+  if (journal_lock(path) != -1 || errno != EWOULDBLOCK) {
+    fprintf(stderr, "Journal locked twice\n");
+    exit(1);
+  }
+
+  journal_record(j, JOP_INSERT_ROW, 3, 0, "hello", 5);
+  journal_record(j, JOP_INSERT_CHAR, 3, 300, "!", 1);
+  journal_flush(j);
+  journal_record(j, JOP_DELETE_ROW, 1, 0, NULL, 0);
+  journal_flush(j);
+  // Not flushed, lost on "crash"
+  journal_record(j, JOP_DELETE_ROW, 7, 0, NULL, 0);
+  journal_close(j, NULL);
+
+  // --------- Identity mismatch ---------
+  if (journal_replay(path, 100, 43, test_apply, NULL, &valid) != -1) {
+    fprintf(stderr, "Journal of another file should not be replayed\n");
+    exit(1);
+  }
+
+  // --------- Replay ---------
+  long n = journal_replay(path, 100, 42, test_apply, NULL, &valid);
+  if (n != 3 || strcmp(test_log, "1:3:0:hello;3:3:300:!;2:1:0:;") != 0) {
+    fprintf(stderr, "Wrong replay (%ld) = %s\n", n, test_log);
+    exit(1);
+  }
+
+  // --------- Torn batch ---------
+  FILE *f = fopen(path, "a");
+  fwrite("\x10\0\0\0garbage", 1, 11, f);
+  fclose(f);
+  test_log[0] = '\0';
+  off_t valid2;
+  n = journal_replay(path, 100, 42, test_apply, NULL, &valid2);
+  if (n != 3 || valid2 != valid) {
+    fprintf(stderr, "Torn batch should be ignored (%ld)\n", n);
+    exit(1);
+  }
+
+  // --------- Append after replay ---------
+  j = journal_open(journal_lock(path), 100, 42, valid2);
+  journal_record(j, JOP_TRUNCATE_ROW, 0, 2, NULL, 0);
+  journal_flush(j);
+  journal_close(j, NULL);
+  test_log[0] = '\0';
+  n = journal_replay(path, 100, 42, test_apply, NULL, &valid);
+  if (n != 4 || strcmp(test_log, "1:3:0:hello;3:3:300:!;2:1:0:;6:0:2:;") != 0) {
+    fprintf(stderr, "Wrong replay after append (%ld) = %s\n", n, test_log);
+    exit(1);
+  }
+
+  // --------- Reset ---------
+  j = journal_open(journal_lock(path), 100, 42, valid);
+  journal_reset(j, 200, 50);
+  journal_close(j, NULL);
+  if (journal_replay(path, 200, 50, test_apply, NULL, &valid) != 0) {
+    fprintf(stderr, "Journal should be empty after reset\n");
+    exit(1);
+  }
+
+  j = journal_open(journal_lock(path), 200, 50, 0);
+  journal_close(j, path);
+  if (access(path, F_OK) == 0) {
+    fprintf(stderr, "Journal should be removed on close\n");
+    exit(1);
+  }
+
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  return 0;
+}
+#endif
@@ -0,0 +1,96 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Edit operations recorded in the journal
+enum JournalOp {
+  JOP_INSERT_ROW = 1,
+  JOP_DELETE_ROW,
+  // One or more chars inserted at col
+  JOP_INSERT_CHAR,
+  JOP_DELETE_CHAR,
+  JOP_APPEND_STRING,
+  JOP_TRUNCATE_ROW,
+  JOP_REPLACE_ROW,
+  // col rows deleted at once
+  JOP_DELETE_ROWS,
+  // The bytes deleted at col
+  JOP_DELETE_CHARS,
+};
+
+typedef struct {
+  uint8_t op;
+  uint32_t row;
+  uint32_t col;
+  uint32_t len;
+  const char *data;
+} JournalRecord;
+
+// Append-only log of edits. Records are buffered in memory and written in
+// checksummed batches, so that a batch torn by a crash is ignored on replay.
+typedef struct {
+  int fd;
+  char *buf;
+  size_t len;
+  size_t cap;
+  // Bytes written to the file (header included)
+  off_t size;
+  size_t nrecords;
+} Journal;
+
+typedef int (*JournalApplyFn)(void *ctx, JournalRecord *rec);
+
+/**
+ * Open the journal at path, creating it if needed, and lock it so that a
+ * single process replays and appends to it. Returns the descriptor to pass
+ * to journal_open, or -1 on error, with errno EWOULDBLOCK if another process
+ * holds the lock.
+ */
+int journal_lock(const char *path);
+
+/**
+ * Start the journal locked as fd of a file identified by its size and mtime.
+ * If keep is greater than 0, the first keep bytes (as returned by
+ * journal_replay) are preserved and new records appended after them,
+ * otherwise it starts empty. The journal owns fd, closing it releases the
+ * lock. Returns NULL on error.
+ */
+Journal *journal_open(int fd, uint64_t fsize, int64_t fmtime, off_t keep);
+
+/**
+ * Buffer a record. Returns -1 on error, 0 otherwise.
+ */
+int journal_record(Journal *j, uint8_t op, uint32_t row, uint32_t col,
+                   const char *data, uint32_t len);
+
+/**
+ * Write the buffered records as a batch and fsync. Returns -1 on error,
+ * 0 otherwise.
+ */
+int journal_flush(Journal *j);
+
+/**
+ * Drop every record, e.g. after the file has been saved, and rewrite the
+ * header with the new identity of the file.
+ */
+int journal_reset(Journal *j, uint64_t fsize, int64_t fmtime);
+
+/**
+ * Close the journal, removing its file if path is not NULL.
+ */
+void journal_close(Journal *j, const char *path);
+
+/**
+ * Apply every record of the journal at path, if it was written for a file
+ * with the given size and mtime. Stops at the first torn batch or at the
+ * first record refused by fn (returning -1). Stores in *valid the bytes
+ * holding the applied batches.
+ * Returns the number of applied records, -1 if there is no valid journal.
+ */
+long journal_replay(const char *path, uint64_t fsize, int64_t fmtime,
+                    JournalApplyFn fn, void *ctx, off_t *valid);
+
+#endif
@@ -0,0 +1,487 @@
+#include "lineidx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dmalloc.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+LineIndex *li_create(LineLenFn linelen, void *ctx) {
+  LineIndex *li = dmalloc(sizeof(LineIndex));
+  li->linelen = linelen;
+  li->ctx = ctx;
+  li->nblocks = 0;
+  li->cap = 0;
+  li->lines = NULL;
+  li->bytes = NULL;
+  li->flines = NULL;
+  li->fbytes = NULL;
+  li->rebuild = 0;
+  li->stale = NULL;
+  li->stale_list = NULL;
+  li->nstale = 0;
+  li->totlines = 0;
+  return li;
+}
+
+void li_destroy(LineIndex *li) {
+  if (!li)
+    return;
+  dfree(li->lines);
+  dfree(li->bytes);
+  dfree(li->flines);
+  dfree(li->fbytes);
+  dfree(li->stale);
+  dfree(li->stale_list);
+  dfree(li);
+}
+
+static void li_reserve(LineIndex *li, int nblocks) {
+  if (nblocks <= li->cap)
+    return;
+
+  int cap = li->cap ? li->cap : 16;
+  while (cap < nblocks)
+    cap *= 2;
+
+  li->lines = drealloc(li->lines, sizeof(long) * cap);
+  li->bytes = drealloc(li->bytes, sizeof(size_t) * cap);
+  li->flines = drealloc(li->flines, sizeof(long) * (cap + 1));
+  li->fbytes = drealloc(li->fbytes, sizeof(size_t) * (cap + 1));
+  li->stale = drealloc(li->stale, cap);
+  li->stale_list = drealloc(li->stale_list, sizeof(int) * cap);
+  li->cap = cap;
+}
+
+/*** fenwick trees ***/
+
+static void fen_add_lines(LineIndex *li, int b, long delta) {
+  for (int i = b + 1; i <= li->nblocks; i += i & -i)
+    li->flines[i] += delta;
+}
+
+static void fen_add_bytes(LineIndex *li, int b, size_t oldv, size_t newv) {
+  for (int i = b + 1; i <= li->nblocks; i += i & -i)
+    li->fbytes[i] = li->fbytes[i] - oldv + newv;
+}
+
+// Lines in blocks [0, b)
+static long fen_prefix_lines(LineIndex *li, int b) {
+  long sum = 0;
+  for (int i = b; i > 0; i -= i & -i)
+    sum += li->flines[i];
+  return sum;
+}
+
+// Bytes in blocks [0, b)
+static size_t fen_prefix_bytes(LineIndex *li, int b) {
+  size_t sum = 0;
+  for (int i = b; i > 0; i -= i & -i)
+    sum += li->fbytes[i];
+  return sum;
+}
+
+static int fen_highbit(int n) {
+  int step = 1;
+  while (step * 2 <= n)
+    step *= 2;
+  return step;
+}
+
+// Block containing the line, nblocks if past the end
+static int fen_find_line(LineIndex *li, long line) {
+  int pos = 0;
+  for (int step = fen_highbit(li->nblocks); step > 0; step >>= 1) {
+    if (pos + step <= li->nblocks && li->flines[pos + step] <= line) {
+      pos += step;
+      line -= li->flines[pos];
+    }
+  }
+  return pos;
+}
+
+// Block containing the offset, nblocks if past the end
+static int fen_find_offset(LineIndex *li, size_t off) {
+  int pos = 0;
+  for (int step = fen_highbit(li->nblocks); step > 0; step >>= 1) {
+    if (pos + step <= li->nblocks && li->fbytes[pos + step] <= off) {
+      pos += step;
+      off -= li->fbytes[pos];
+    }
+  }
+  return pos;
+}
+
+/*** maintenance ***/
+
+static void li_mark_stale(LineIndex *li, int b) {
+  if (li->stale[b])
+    return;
+  li->stale[b] = 1;
+  if (!li->rebuild)
+    li->stale_list[li->nstale++] = b;
+}
+
+static size_t li_block_bytes(LineIndex *li, long first, long nlines) {
+  size_t bytes = 0;
+  for (long l = first; l < first + nlines; l++)
+    bytes += li->linelen(li->ctx, l);
+  return bytes;
+}
+
+// Rebuilds the trees after blocks were split, appended or removed
+static void li_sync_structure(LineIndex *li) {
+  if (!li->rebuild)
+    return;
+
+  for (int i = 1; i <= li->nblocks; i++) {
+    li->flines[i] = li->lines[i - 1];
+    li->fbytes[i] = li->bytes[i - 1];
+  }
+  for (int i = 1; i <= li->nblocks; i++) {
+    int j = i + (i & -i);
+    if (j <= li->nblocks) {
+      li->flines[j] += li->flines[i];
+      li->fbytes[j] += li->fbytes[i];
+    }
+  }
+
+  li->nstale = 0;
+  for (int b = 0; b < li->nblocks; b++) {
+    if (li->stale[b])
+      li->stale_list[li->nstale++] = b;
+  }
+
+  li->rebuild = 0;
+}
+
+// Recomputes the bytes of the stale blocks
+static void li_sync(LineIndex *li) {
+  li_sync_structure(li);
+
+  for (int k = 0; k < li->nstale; k++) {
+    int b = li->stale_list[k];
+    size_t bytes =
+        li_block_bytes(li, fen_prefix_lines(li, b), li->lines[b]);
+    fen_add_bytes(li, b, li->bytes[b], bytes);
+    li->bytes[b] = bytes;
+    li->stale[b] = 0;
+  }
+  li->nstale = 0;
+}
+
+// Splits an oversized block in blocks of LI_BLOCK_LINES lines
+static void li_split(LineIndex *li, int b) {
+  long total = li->lines[b];
+  int pieces = (total + LI_BLOCK_LINES - 1) / LI_BLOCK_LINES;
+
+  li_reserve(li, li->nblocks + pieces - 1);
+
+  int tail = li->nblocks - b - 1;
+  memmove(&li->lines[b + pieces], &li->lines[b + 1], sizeof(long) * tail);
+  memmove(&li->bytes[b + pieces], &li->bytes[b + 1], sizeof(size_t) * tail);
+  memmove(&li->stale[b + pieces], &li->stale[b + 1], tail);
+
+  for (int k = 0; k < pieces; k++) {
+    li->lines[b + k] = MIN(total, LI_BLOCK_LINES);
+    total -= li->lines[b + k];
+    li->bytes[b + k] = 0;
+    li->stale[b + k] = 1;
+  }
+
+  li->nblocks += pieces - 1;
+  li->rebuild = 1;
+}
+
+void li_build(LineIndex *li, long nlines) {
+  int nblocks = (nlines + LI_BLOCK_LINES - 1) / LI_BLOCK_LINES;
+
+  li_reserve(li, nblocks);
+  li->nblocks = nblocks;
+  li->totlines = nlines;
+
+  for (int b = 0; b < nblocks; b++) {
+    li->lines[b] = MIN(nlines, LI_BLOCK_LINES);
+    nlines -= li->lines[b];
+    li->bytes[b] = 0;
+    li->stale[b] = 1;
+  }
+
+  li->rebuild = 1;
+  li_sync(li);
+}
+
+void li_append_block(LineIndex *li, long nlines, size_t nbytes) {
+  li_reserve(li, li->nblocks + 1);
+  li->lines[li->nblocks] = nlines;
+  li->bytes[li->nblocks] = nbytes;
+  li->stale[li->nblocks] = 0;
+  li->nblocks++;
+  li->totlines += nlines;
+  li->rebuild = 1;
+}
+
+void li_insert_lines(LineIndex *li, long at, long n) {
+  if (n <= 0 || at < 0 || at > li->totlines)
+    return;
+
+  if (li->nblocks == 0) {
+    li_reserve(li, 1);
+    li->nblocks = 1;
+    li->lines[0] = 0;
+    li->bytes[0] = 0;
+    li->stale[0] = 0;
+    li->rebuild = 1;
+  }
+
+  // Appending at the end is the common case while loading, it doesn't need
+  // the trees to be up to date
+  int b;
+  if (at == li->totlines) {
+    b = li->nblocks - 1;
+  } else {
+    li_sync_structure(li);
+    b = fen_find_line(li, at);
+  }
+
+  li->lines[b] += n;
+  li->totlines += n;
+  if (!li->rebuild)
+    fen_add_lines(li, b, n);
+  li_mark_stale(li, b);
+
+  if (li->lines[b] > 2 * LI_BLOCK_LINES)
+    li_split(li, b);
+}
+
+void li_delete_lines(LineIndex *li, long at, long n) {
+  if (at < 0 || at >= li->totlines)
+    return;
+  if (n > li->totlines - at)
+    n = li->totlines - at;
+  if (n <= 0)
+    return;
+
+  li_sync_structure(li);
+  int b = fen_find_line(li, at);
+  long from = at - fen_prefix_lines(li, b);
+  int removed = 0;
+
+  li->totlines -= n;
+
+  // Walk the blocks spanned by the range, only the first one can be
+  // partially deleted from the middle
+  for (; n > 0 && b < li->nblocks; b++, from = 0) {
+    long count = MIN(li->lines[b] - from, n);
+
+    li->lines[b] -= count;
+    fen_add_lines(li, b, -count);
+    li_mark_stale(li, b);
+    n -= count;
+    if (li->lines[b] == 0)
+      removed = 1;
+  }
+
+  if (!removed)
+    return;
+
+  // Compact out the emptied blocks
+  int w = 0;
+  for (int r = 0; r < li->nblocks; r++) {
+    if (li->lines[r] == 0)
+      continue;
+    li->lines[w] = li->lines[r];
+    li->bytes[w] = li->bytes[r];
+    li->stale[w] = li->stale[r];
+    w++;
+  }
+  li->nblocks = w;
+  li->rebuild = 1;
+}
+
+void li_touch(LineIndex *li, long line) {
+  if (line < 0 || line >= li->totlines)
+    return;
+
+  int b;
+  if (line >= li->totlines - li->lines[li->nblocks - 1]) {
+    b = li->nblocks - 1;
+  } else {
+    li_sync_structure(li);
+    b = fen_find_line(li, line);
+  }
+  li_mark_stale(li, b);
+}
+
+/*** lookups ***/
+
+void li_locate_line(LineIndex *li, long line, long *first, size_t *offset) {
+  li_sync(li);
+  int b = fen_find_line(li, line);
+  if (b >= li->nblocks)
+    b = li->nblocks - 1;
+  if (b < 0) {
+    *first = 0;
+    *offset = 0;
+    return;
+  }
+  *first = fen_prefix_lines(li, b);
+  *offset = fen_prefix_bytes(li, b);
+}
+
+void li_locate_offset(LineIndex *li, size_t off, long *first,
+                      size_t *offset) {
+  li_sync(li);
+  int b = fen_find_offset(li, off);
+  if (b >= li->nblocks)
+    b = li->nblocks - 1;
+  if (b < 0) {
+    *first = 0;
+    *offset = 0;
+    return;
+  }
+  *first = fen_prefix_lines(li, b);
+  *offset = fen_prefix_bytes(li, b);
+}
+
+size_t li_line_to_offset(LineIndex *li, long line) {
+  if (line >= li->totlines)
+    return li_total_bytes(li);
+
+  long first;
+  size_t offset;
+  li_locate_line(li, line, &first, &offset);
+  return offset + li_block_bytes(li, first, line - first);
+}
+
+long li_offset_to_line(LineIndex *li, size_t off, size_t *col) {
+  if (li->totlines == 0) {
+    if (col)
+      *col = 0;
+    return 0;
+  }
+
+  long line;
+  size_t offset;
+  li_locate_offset(li, off, &line, &offset);
+
+  size_t len;
+  while (line < li->totlines - 1 &&
+         off - offset >= (len = li->linelen(li->ctx, line))) {
+    offset += len;
+    line++;
+  }
+
+  if (col) {
+    len = li->linelen(li->ctx, line);
+    *col = off - offset < len ? off - offset : (len ? len - 1 : 0);
+  }
+  return line;
+}
+
+size_t li_total_bytes(LineIndex *li) {
+  li_sync(li);
+  return fen_prefix_bytes(li, li->nblocks);
+}
+
+#ifdef TESTS_LINEIDX
+static long test_lens[100000];
+static long test_n = 0;
+
+static size_t test_linelen(void *ctx, long line) {
+  (void)ctx;
+  return test_lens[line];
+}
+
+static void test_check(LineIndex *li, const char *step) {
+  size_t off = 0;
+  if (li->totlines != test_n) {
+    fprintf(stderr, "%s: wrong total lines %ld != %ld\n", step, li->totlines,
+            test_n);
+    exit(1);
+  }
+  for (long l = 0; l < test_n; l += 7) {
+    size_t expected = 0;
+    for (long k = 0; k < l; k++)
+      expected += test_lens[k];
+    if (li_line_to_offset(li, l) != expected) {
+      fprintf(stderr, "%s: wrong offset for line %ld\n", step, l);
+      exit(1);
+    }
+    size_t col;
+    if (test_lens[l] > 1 &&
+        (li_offset_to_line(li, expected + 1, &col) != l || col != 1)) {
+      fprintf(stderr, "%s: wrong line for offset %zu\n", step, expected + 1);
+      exit(1);
+    }
+  }
+  for (long k = 0; k < test_n; k++)
+    off += test_lens[k];
+  if (li_total_bytes(li) != off) {
+    fprintf(stderr, "%s: wrong total bytes\n", step);
+    exit(1);
+  }
+}
+
+int main(void) {
+  srand(42);
+  LineIndex *li = li_create(test_linelen, NULL);
+
+  // --------- Build ---------
+  test_n = 10000;
+  for (long l = 0; l < test_n; l++)
+    test_lens[l] = 1 + rand() % 80;
+  li_build(li, test_n);
+  test_check(li, "build");
+
+  // --------- Touch ---------
+  for (int k = 0; k < 500; k++) {
+    long l = rand() % test_n;
+    test_lens[l] = 1 + rand() % 80;
+    li_touch(li, l);
+  }
+  test_check(li, "touch");
+
+  // --------- Insert ---------
+  for (int k = 0; k < 2000; k++) {
+    long at = rand() % (test_n + 1);
+    long n = 1 + (k % 50 == 0 ? rand() % 500 : 0);
+    memmove(&test_lens[at + n], &test_lens[at],
+            sizeof(long) * (test_n - at));
+    for (long j = 0; j < n; j++)
+      test_lens[at + j] = 1 + rand() % 80;
+    test_n += n;
+    li_insert_lines(li, at, n);
+  }
+  test_check(li, "insert");
+
+  // --------- Delete ---------
+  for (int k = 0; k < 2000 && test_n > 0; k++) {
+    long at = rand() % test_n;
+    long n = 1 + (k % 50 == 0 ? rand() % 1000 : 0);
+    if (n > test_n - at)
+      n = test_n - at;
+    memmove(&test_lens[at], &test_lens[at + n],
+            sizeof(long) * (test_n - at - n));
+    test_n -= n;
+    li_delete_lines(li, at, n);
+  }
+  test_check(li, "delete");
+
+  // --------- Append ---------
+  for (long l = 0; l < 1000; l++) {
+    test_lens[test_n++] = 10;
+    li_insert_lines(li, test_n - 1, 1);
+  }
+  test_check(li, "append");
+
+  li_destroy(li);
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  printf("lineidx ok\n");
+  return 0;
+}
+#endif
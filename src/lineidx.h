@@ -0,0 +1,93 @@
+#ifndef LINEIDX_H
+#define LINEIDX_H
+
+#include <stddef.h>
+
+// Target number of lines sampled by each block of the index
+#define LI_BLOCK_LINES 64
+
+// Returns the length in bytes of a line, including its newline
+typedef size_t (*LineLenFn)(void *ctx, long line);
+
+// Sampled line <-> byte offset index.
+//
+// Lines are grouped in blocks of about LI_BLOCK_LINES lines, and only the
+// number of lines and bytes of each block are stored, in two Fenwick trees.
+// Locating a line or an offset is O(log(n / LI_BLOCK_LINES)) to find the
+// block, plus a scan of at most one block through the LineLenFn.
+//
+// Edits only mark blocks as stale, they're recomputed lazily on the next
+// lookup.
+typedef struct {
+  LineLenFn linelen;
+  void *ctx;
+
+  int nblocks;
+  int cap;
+  // Lines and bytes in each block
+  long *lines;
+  size_t *bytes;
+  // Fenwick trees (1-based) over lines and bytes
+  long *flines;
+  size_t *fbytes;
+  // Set when blocks were split or removed, so the trees must be rebuilt
+  int rebuild;
+
+  // Blocks with changed lines, whose bytes must be recomputed
+  unsigned char *stale;
+  int *stale_list;
+  int nstale;
+
+  long totlines;
+} LineIndex;
+
+LineIndex *li_create(LineLenFn linelen, void *ctx);
+void li_destroy(LineIndex *li);
+
+/**
+ * Rebuild the whole index for nlines lines.
+ */
+void li_build(LineIndex *li, long nlines);
+
+/**
+ * Append a block with known lines and bytes, e.g. while scanning a file.
+ */
+void li_append_block(LineIndex *li, long nlines, size_t nbytes);
+
+/**
+ * Keep the index in sync with the buffer: n lines inserted or deleted at
+ * line, or the content of a line changed.
+ */
+void li_insert_lines(LineIndex *li, long at, long n);
+void li_delete_lines(LineIndex *li, long at, long n);
+void li_touch(LineIndex *li, long line);
+
+/**
+ * Find the block containing the line, storing its first line and offset.
+ */
+void li_locate_line(LineIndex *li, long line, long *first, size_t *offset);
+
+/**
+ * Find the block containing the byte offset, storing its first line and
+ * offset.
+ */
+void li_locate_offset(LineIndex *li, size_t off, long *first,
+                      size_t *offset);
+
+/**
+ * Byte offset where the line starts.
+ */
+size_t li_line_to_offset(LineIndex *li, long line);
+
+/**
+ * Line containing the byte offset, storing the column in *col (if not NULL).
+ * Offsets past the end map to the last line.
+ */
+long li_offset_to_line(LineIndex *li, size_t off, size_t *col);
+
+/**
+ * Total number of bytes.
+ */
+size_t li_total_bytes(LineIndex *li);
+
+#endif
@@ -1,6 +1,10 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -9,22 +13,82 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "dlogger.h"
+#include "aio.h"
+#include "diff.h"
 #include "dmalloc.h"
 #include "fss.h"
+#include "hist.h"
+#include "journal.h"
+#include "lineidx.h"
+#include "slice.h"
+#include "syntax.h"
+#include "term.h"
+#include "trace.h"
+#include "trigram.h"
+#include "utf8.h"
 
 /*** defines ***/
 
 #define DITTO_VERSION "v0.0.0"
 #define DITTO_TAB_STOP 2
+// Spaces added by > and removed by < in visual mode
+#define DITTO_SHIFT_WIDTH 2
+// Bytes between the entries of the column index of a row
+#define DITTO_COL_BLOCK 256
 #define DITTO_LINENO_ENABLED 1
 #define DITTO_QUIT_TIMES 2
 #define DITTO_STATUSMSG_SEC 5
+// Upper bound of worker threads for parallel commands
+#define DITTO_MAX_THREADS 16
+// Minimum rows per substitute worker, smaller ranges use fewer threads
+#define DITTO_SUBST_MIN_ROWS 16384
+// Regex groups captured by substitute (whole match + \1..\9)
+#define DITTO_SUBST_GROUPS 10
+// Minimum lines per hashing thread (reload and diff)
+#define DITTO_HASH_MIN_ROWS 65536
+// Upper bound of a count typed before a command
+#define DITTO_MAX_COUNT 100000000
+// Macros replayed from within macros, bounding recursive ones
+#define DITTO_MACRO_DEPTH 100
+// Interval at which a macro replay looks for a Ctrl-C typed meanwhile
+#define DITTO_MACRO_POLL_MS 50
+// Screen of the headless terminal of --bench
+#define DITTO_BENCH_ROWS 24
+#define DITTO_BENCH_COLS 80
+// Spans kept by the frame trace (:trace, SIGUSR1), the latest ones
+#define DITTO_TRACE_SPANS 65536
+// Where SIGUSR1 writes the trace, %d being the pid
+#define DITTO_TRACE_FILE "/tmp/ditto-%d.trace.json"
+// Period over which :stats measures the frame rate, and refreshes
+#define DITTO_STATS_MS 1000
+// Bytes read at once when following a file or reading stdin
+#define DITTO_READ_CHUNK (64 * 1024)
+// Max time spent reading stdin before getting back to the keys
+#define DITTO_STREAM_BUDGET_MS 20
+// Max time to wait for a key before handling other events
+#define DITTO_EVENTS_TIMEOUT_MS 100
+// Widths of windows on a buffer whose soft wrap indexes are kept
+#define DITTO_WRAP_WIDTHS 4
+// Rows decoded around the viewport in view mode, and the max bytes kept for
+// each of them, bounding the memory of the window
+#define DITTO_VIEW_ROWS 512
+#define DITTO_VIEW_MAX_LINE (64 * 1024)
+// Max time edits stay in memory before the swap journal is synced to disk
+#define DITTO_JOURNAL_SYNC_MS 1000
+// File loads and saves are split in reads/writes of DITTO_IO_CHUNK bytes,
+// with up to DITTO_IO_DEPTH of them in flight
+#define DITTO_IO_CHUNK (1024 * 1024)
+#define DITTO_IO_DEPTH 8
 
 #define UNUSED(x) (void)(x);
 
@@ -54,9 +118,6 @@
 // Default is 1;1 (rows and cols start at 1, not 0)
 #define REPOS_CURSOR "\x1b[H"
 #define REPOS_CURSOR_SZ 3
-// Get cursor position (n command = Device Status Report, 6 is for Cursor Pos)
-#define GET_CURSOR "\x1b[6n"
-#define GET_CURSOR_SZ 4
 // SetMode (h) and ResetMode (l) set on/off term features or modes like cursor
 // visibility, the number is the feature (25 = show/hine)
 #define HIDE_CURSOR "\x1b[?25l"
@@ -76,15 +137,23 @@
 // Terminal color management
 #define COLORS_INVERT_ON "\x1b[7m"
 #define COLORS_INVERT_ON_SZ 4
+#define COLORS_INVERT_OFF "\x1b[27m"
+#define COLORS_INVERT_OFF_SZ 5
 #define COLORS_BOLD_ON "\x1b[1m"
 #define COLORS_BOLD_ON_SZ 4
 #define COLORS_BOLD_OFF "\x1b[22m"
 #define COLORS_BOLD_OFF_SZ 5
 #define COLORS_ALL_OFF "\x1b[m"
 #define COLORS_ALL_OFF_SZ 3
-
-// Position the cursor (forward: C, down: B)
-#define POS_CURSOR_AT(x, y) "\x1b[" #y "C\x1b[" #x "B"
+#define COLORS_FG_RED "\x1b[31m"
+#define COLORS_FG_GREEN "\x1b[32m"
+#define COLORS_FG_YELLOW "\x1b[33m"
+#define COLORS_FG_BLUE "\x1b[34m"
+#define COLORS_FG_MAGENTA "\x1b[35m"
+#define COLORS_FG_CYAN "\x1b[36m"
+#define COLORS_FG_SZ 5
+#define COLORS_FG_DEFAULT "\x1b[39m"
+#define COLORS_FG_DEFAULT_SZ 5
 
 // Amount of microseconds to wait when waiting for key sequences
 #define SEQUENCES_TIMEOUT_MICROSEC 100000 // 100ms
@@ -98,6 +167,28 @@
 /*** prototypes ***/
 
 char *editorPrompt(char *prompt);
+void editorRefreshScreen(void);
+int editorWaitInput(void);
+int editorProcessEvents(void);
+void editorViewPage(int at);
+void editorAppendChunk(const char *buf, size_t len);
+void editorSelectSyntax(void);
+void editorWatchStart(void);
+void editorDiffSynced(void);
+void editorDiffChanged(int from, int to);
+int editorMacroNextKey(void);
+void editorMacroRecord(int c);
+void editorMacroStart(int reg);
+void editorMacroStop(void);
+void editorMacroReplay(int regc, long times);
+void editorMacroFail(void);
+void editorSetCursorShape(void);
+void editorWindowLayout(void);
+void editorClampCursor(void);
+void editorQuit(void);
+void editorBenchFrame(size_t bytes, double lat);
+int editorDecodeKey(unsigned char c);
+int64_t editorStatMtime(struct stat *st);
 
 /*** enum ***/
 
@@ -113,6 +204,10 @@ static const char *const mode_str[] = {
 enum editorCommands {
   CMD_GO_TOP_DOC = 2000,
   CMD_GO_BOTTOM_DOC,
+  // Go to line E.count (1-based)
+  CMD_GO_LINE,
+  // Go to byte offset E.count in the file
+  CMD_GO_OFFSET,
 };
 
 enum keys {
@@ -127,8 +222,10 @@ enum keys {
   KEY_K = 'K',
   KEY_I = 'I',
   KEY_L = 'L',
+  KEY_N = 'N',
   KEY_O = 'O',
   KEY_P = 'P',
+  KEY_V = 'V',
   KEY_X = 'X',
   KEY_Y = 'Y',
   KEY_a = 'a',
@@ -141,12 +238,23 @@ enum keys {
   KEY_j = 'j',
   KEY_k = 'k',
   KEY_l = 'l',
+  KEY_n = 'n',
   KEY_o = 'o',
   KEY_p = 'p',
+  KEY_q = 'q',
+  KEY_s = 's',
   KEY_v = 'v',
   KEY_w = 'w',
   KEY_x = 'x',
   KEY_y = 'y',
+  KEY_SLASH = '/',
+  KEY_LBRACKET = '[',
+  KEY_RBRACKET = ']',
+  KEY_c = 'c',
+  KEY_DQUOTE = '"',
+  KEY_AT = '@',
+  KEY_GT = '>',
+  KEY_LT = '<',
   KEY_TAB = '\t',
   KEY_BACKSPACE = 127,
   ARROW_UP = 1000,
@@ -163,19 +271,65 @@ enum keys {
 
 /*** data ***/
 
+// Column of the character starting at a byte
+typedef struct {
+  int byte;
+  int col;
+} ColMark;
+
 typedef struct {
   // Real length of the row
   int size;
-  // Rendered length of the row
+  // Rendered length of the row, in columns. -1 if unknown, until the column
+  // index reaches the end.
   int rsize;
   // Real Characters in the row
   char *chars;
-  // Rendered characters in the row
-  char *render;
+  // Set if chars is the text of a slice shared with registers, which is
+  // copied before the row is modified
+  Slice *slice;
+  // Plain ASCII rows display a byte per column. Others, with tabs or UTF-8,
+  // index the first character starting in each block of DITTO_COL_BLOCK
+  // bytes, so that columns are found from the nearest entry. The index is
+  // built lazily as far as needed, and edits only drop the entries past
+  // them: the first ncols entries are valid.
+  int plain;
+  ColMark *cols;
+  int ncols;
+  int colcap;
+  // Highlight of the characters
+  HlRow hl;
+  // Soft wrap: where the screen lines after the first start, for a screen
+  // wrap_cols wide (0 until computed). NULL for plain rows, which break
+  // every wrap_cols bytes.
+  ColMark *wraps;
+  int nwraps;
+  int wrap_cols;
 } Row;
 
+// Lines yanked or deleted, shared with the rows they came from or were put
+// into rather than copied
+typedef struct {
+  Slice **lines;
+  long nlines;
+  // Set if the text was yanked char-wise, so that the first and last lines
+  // are put inside the cursor row rather than as rows of their own
+  int charwise;
+} Register;
+
+// The unnamed register and a-z
+#define DITTO_REGISTERS 27
+
+// Keys of a macro being replayed
+typedef struct {
+  const char *keys;
+  size_t len;
+  size_t pos;
+} MacroReplay;
+
+// A file being edited: its rows and everything derived from them, and the
+// cursor and scroll position in it
 typedef struct {
-  DLogger *logger;
   // Current cursor X-position relative to the actual chars in the file
   int cx;
   // Current cursor Y-position relative to the actual chars in the file
@@ -188,40 +342,264 @@ typedef struct {
   int rowoff;
   // Column offset in current file the cursor is on
   int coloff;
-  // Screen size
-  int screenrows, screencols;
+  // Soft wrap (:wrap): rows break at the screen width instead of scrolling
+  // horizontally. The screen starts at line rowoff_sub of row rowoff, and
+  // wrapidx sums the screen lines of the rows to map between the two, at
+  // wrap_width. It's one of wrapidxs, kept for the widths of the windows on
+  // the buffer so that going from one to the other doesn't rebuild them.
+  int wrap;
+  LineIndex *wrapidx;
+  int wrap_width;
+  LineIndex *wrapidxs[DITTO_WRAP_WIDTHS];
+  int wrap_widths[DITTO_WRAP_WIDTHS];
+  int wrap_next;
+  int rowoff_sub;
+  // Cursor position on the screen in soft wrap mode
+  int wrap_x, wrap_y;
   // Number of rows in the file
   int numrows;
-  // Editor rows
+  // Editor rows, a window of rowbuf: rows evicted from the front just move
+  // the window forward, and are compacted away once the gap gets large
   Row *row;
+  Row *rowbuf;
+  int rowcap;
+  // Line <-> byte offset index of the rows
+  LineIndex *lineidx;
   // Dirty flag indicates if buffer has changes not yet saved
   int dirty;
-  // Current mode
-  enum editorMode mode;
+  // First modified position since the buffer was loaded or saved, -1 if none
+  int dirty_row;
+  int dirty_col;
+  // The file on disk holds exactly the rows before dirty_row (no CRLF, final
+  // newline present), as of file_size and file_mtime, so it can be saved in
+  // place from there
+  int file_exact;
+  // CRs were dropped from line ends on disk, so byte offsets in the rows
+  // don't match the ones in the file
+  int crlf;
+  uint64_t file_size;
+  int64_t file_mtime;
+  // Bumped on every change to the rows
+  unsigned long edit_gen;
+  // :diff view: hunks between the lines on disk (hashed once) and the rows,
+  // recomputed when edit_gen moves past diff_gen. The hashes of the rows are
+  // kept, and only the rows from diff_lo up to the last diff_tail ones, which
+  // changed since, are hashed and diffed again.
+  int diff;
+  uint64_t *diff_disk;
+  long diff_ndisk;
+  uint64_t *diff_rows;
+  long diff_nrows;
+  int diff_lo;
+  int diff_tail;
+  DiffHunk *diff_hunks;
+  long diff_nhunks;
+  unsigned long diff_gen;
+  // Syntax of the file, NULL for plain text. Rows from hl_from on may need
+  // to be lexed again, this is done down to the last visible row on redraw.
+  const Syntax *syntax;
+  long hl_from;
   // Currently open filename
   char *filename;
+  // Trigram index of the file, built in background if enabled. It maps the
+  // rows as they are on disk, so it's only used while there are no unsaved
+  // changes
+  TrigramIndex *trigram;
+  // Index handed over by the background builder, adopted on first use
+  TrigramIndex *trigram_pending;
+  // Bumped on each (re)build, so that stale builders discard their result.
+  // The lock guards it along with trigram_pending.
+  int trigram_gen;
+  pthread_mutex_t trigram_lock;
+  int trigram_building;
+  // Follow mode: rows are appended as the file grows
+  int follow;
+  int follow_fd;
+  off_t follow_off;
+  // More was appended than read on the last tick
+  int follow_behind;
+  // inotify descriptor watching the file (or its directory, for name
+  // watch_name, when not following), -1 when polling
+  int watch_fd;
+  char *watch_name;
+  // The last row has no newline yet, appended text extends it
+  int append_open;
+  // Pipe the buffer is being read from ("ditto -"), -1 if none
+  int stream_fd;
+  size_t stream_bytes;
+  // Pager mode (--view): read-only, row is a window of view_len rows
+  // starting at row view_first, decoded from the file as the viewport moves,
+  // and view_offs the file offsets of those rows (plus the end of the last)
+  int view;
+  int view_fd;
+  int view_first;
+  int view_len;
+  off_t *view_offs;
+  // Scan of the file building the line index, in background ticks
+  int view_scanning;
+  off_t view_scan_off;
+  off_t view_block_off;
+  long view_scan_lines;
+  // Swap journal of the unsaved edits, replayed after a crash. NULL when the
+  // buffer isn't backed by a file (or is following, viewing or streaming it)
+  Journal *journal;
+  char *journal_path;
+  double journal_synced;
+  int journal_enabled;
+  // Load of the open file in progress: DITTO_IO_DEPTH reads are kept in
+  // flight, load_next is the offset of the next one to queue and load_off
+  // the bytes appended so far. The reads carry the buffer, which keeps
+  // loading when it isn't the current one.
+  int loading;
+  int load_fd;
+  off_t load_size;
+  off_t load_next;
+  off_t load_off;
+  int load_pending;
+  AioRequest *load_reqs;
+  unsigned char load_ready[DITTO_IO_DEPTH];
+  int load_exact;
+  double load_start;
+} Buffer;
+
+// --bench: latency of each command, as measured by Stats
+typedef struct {
+  int enabled;
+  const char *name;
+  double start;
+  double open_ms;
+  double *lat;
+  size_t nlat;
+  size_t latcap;
+  long frames;
+  size_t bytes;
+} Bench;
+
+// Latency of each command, from the time its first key is read to the time
+// the frame showing its result is written, and what frames cost, for :stats
+typedef struct {
+  // When the first key of the command being handled was read, 0 if none
+  double key_at;
+  // In microseconds
+  Hist *latency;
+  // Frames, bytes written and allocations since period_start, and their
+  // rates over the last period
+  double period_start;
+  long frames;
+  size_t bytes;
+  size_t allocs;
+  double fps;
+  double bytes_per_frame;
+  double allocs_per_frame;
+  // alloc_count() when the last frame was written
+  size_t last_allocs;
+  // Overlay shown (:stats), and when it was last drawn
+  int shown;
+  double drawn_at;
+} Stats;
+
+// A rectangle of the screen showing a buffer. Windows are the leaves of a
+// tree of splits, each dividing its rectangle between its two children, side
+// by side if vertical. A window closed gives its rectangle to its sibling.
+typedef struct Window {
+  struct Window *parent;
+  struct Window *kids[2];
+  int vertical;
+  // NULL for the splits
+  Buffer *buf;
+  // Cursor and scroll position, kept in buf while the window is entered
+  int cx, cy, rowoff, coloff, rowoff_sub;
+  // Rectangle on the screen, the status line included
+  int top, left, height, width;
+  // Hashes of the lines as last written to the terminal, 0 if unknown. Only
+  // the lines which changed are written again.
+  uint64_t *lines;
+  // edit_gen of buf when last drawn: other windows than the current one are
+  // drawn again only once it moves
+  unsigned long drawn_gen;
+} Window;
+
+typedef struct {
+  DLogger *logger;
+  // Buffer being edited, and the open ones in the order of :bn. Switching
+  // buffers just points buf to another one.
+  Buffer *buf;
+  Buffer **bufs;
+  int nbufs;
+  // Descriptors polled by editorWaitInput, only grown as buffers are opened
+  struct pollfd *pollfds;
+  int pollcap;
+  // Window being edited, showing buf, the root of the tree of splits and the
+  // windows in the order of the screen
+  Window *win;
+  Window *root;
+  Window **wins;
+  int nwins;
+  // Terminal size, and the size of the text area of the window entered
+  int termrows, termcols;
+  int screenrows, screencols;
+  // Count typed before a command, or argument of a motion, 0 if none
+  long count;
+  // Always save by writing a new file and renaming it over (--atomic-save)
+  int atomic_save;
+  // Current mode
+  enum editorMode mode;
   // Status messages stack
   FixedSizeStack *messages;
   // Status message
   char statusmsg[80];
   // Status message time
   time_t statusmsg_time;
-  // Terminal status
-  struct termios orig_termios;
+  // Terminal the keys come from and the screen is drawn on
+  Term *term;
   // Screen resize flag
   volatile sig_atomic_t screen_resized;
-  // NOTE: For now it's just a single register
-  char *reg;
+  // SIGUSR1 received: start tracing frames, or write the trace
+  volatile sig_atomic_t trace_signal;
+  // Registers, and the one selected with '"' for the next command
+  Register regs[DITTO_REGISTERS];
+  int reg_sel;
+  // Visual mode selection, from the anchor to the cursor, whole rows if
+  // vis_line is set
+  int vis_y, vis_x;
+  int vis_line;
+  // Register a macro is being recorded into, 0 if none. Keys are stored a
+  // byte each, or 0xFF and two bytes for the special ones (arrows...).
+  int macro_reg;
+  char *macro;
+  size_t macro_len;
+  size_t macro_cap;
+  // Where the last key recorded starts, to drop the q ending the recording
+  size_t macro_last;
+  // Macros being replayed, nested ones included. Nothing is drawn meanwhile.
+  int replay_depth;
+  MacroReplay replay;
+  // Set when a command fails or Ctrl-C is typed, stopping all the replays
+  int replay_failed;
   // Message bar input state
   int input_mode;     // 0 = normal editing, 1 = message bar input active
   char *input_prompt; // Prompt text (e.g., ":" or "Filename to save to: %s")
   char *input_buffer; // Input buffer for message bar
   size_t input_buffer_size; // Allocated size of input buffer
   size_t input_buffer_len;  // Current length of input in buffer
+  // Last searched pattern
+  char *search;
+  // Build a trigram index of the files opened (--index)
+  int trigram_enabled;
+  // Max number of rows kept while appending, 0 means unlimited
+  int retain;
+  // Asynchronous file I/O (io_uring, or a thread pool), for loads and saves
+  Aio *aio;
+  Stats stats;
+  Bench bench;
 } EditorConfig;
 
 EditorConfig E;
 
+Buffer *editorBufferBegin(Buffer *b);
+void editorBufferEnd(Buffer *cur);
+void editorWindowLeave(Window *w);
+
 typedef struct {
   char *b;
   int len;
@@ -230,8 +608,10 @@ typedef struct {
 /*** utils ***/
 
 void die(const char *s) {
-  write(STDOUT_FILENO, CLEAR_SCREEN, CLEAR_SCREEN_SZ);
-  write(STDOUT_FILENO, REPOS_CURSOR, REPOS_CURSOR_SZ);
+  if (E.term) {
+    term_write(E.term, CLEAR_SCREEN, CLEAR_SCREEN_SZ);
+    term_write(E.term, REPOS_CURSOR, REPOS_CURSOR_SZ);
+  }
 
   perror(s);
   exit(1);
@@ -242,6 +622,18 @@ void handleResize(int sig) {
   E.screen_resized = 1;
 }
 
+void handleTraceSignal(int sig) {
+  UNUSED(sig);
+  E.trace_signal = 1;
+}
+
+// Milliseconds from an arbitrary point, for timers and measurements
+double monotonicMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 int getCharFamily(char c) {
   return (isalnum((c)) || (c) == '_') ? CHAR_FAMILY_WORDS
          : (isspace((c)))             ? CHAR_FAMILY_SPACES
@@ -261,76 +653,58 @@ void editorSetStatusMessage(const char *fmt, ...) {
   fss_push(E.messages, E.statusmsg, len);
 }
 
-void disableRawMode(void) {
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
-    die("tcsetattr");
-}
-
-void enableRawMode(void) {
-  if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
-    die("tcgetattr");
-  atexit(disableRawMode);
-
-  struct termios raw = E.orig_termios;
-
-  // Disabling some Input flags:
-  // - Break condition causing sigint
-  // - Signal ctrl-m (fix specific)
-  // - Parity check (old)
-  // - 8th bit each input being stripped out
-  // - Signals flow control (ctrl-s, ctrl-q)
-  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-
-  // Disabling some Output flags:
-  // - Output processing (\n, \r\n) -> must add \r ourself now
-  raw.c_oflag &= ~(OPOST);
-
-  // Disabling some Local flags:
-  // - Echoing
-  // - Canonical (byte by byte read) mode
-  // - Signals Ctrl-v (wait input), ctrl-o fix in macos
-  // - Signals int and tstp (ctrl-c, ctrl-z)
-  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-
-  // Disabling some Control flags:
-  // - Old stuff
-  raw.c_cflag |= (CS8);
-
-  // Setting some Control Characters:
-  // read() witll return as soon as any byte is read
-  raw.c_cc[VMIN] = 0;
-  // max amount of time to wait before read() returns (tenths of a second)
-  raw.c_cc[VTIME] = 1;
-
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
-    die("tcsetattr");
-}
-
-int editorReadKey(void) {
+int editorReadTermKey(void) {
   int nread;
-  char c = '\0';
+  // Unsigned, bytes of UTF-8 sequences are keys 128-255
+  unsigned char c = '\0';
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+  while (1) {
+    // The script of a headless terminal is over
+    if (term_eof(E.term))
+      editorQuit();
+    if (editorWaitInput()) {
+      if ((nread = term_read(E.term, &c)) == 1)
+        break;
+      if (nread == -1)
+        die("read");
+    }
+    // No key yet, handle anything else in the meantime
+    if (editorProcessEvents())
+      editorRefreshScreen();
   }
+  if (E.stats.key_at == 0)
+    E.stats.key_at = monotonicMs();
+
+  int64_t t = trace_begin();
+  int key = editorDecodeKey(c);
+  trace_end("input", t);
+  return key;
+}
 
+// Key starting with the byte c, reading the rest of its escape sequence if
+// it's one
+int editorDecodeKey(unsigned char c) {
   // Escape-starting keys (e.g. arrows), need to read multiple bytes starting
   // from that
   if (c == '\x1b') {
-    char seq[3];
+    unsigned char seq[3];
 
     // By default just return the escape char, if nothing else avaible to be
     // read
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (term_read(E.term, &seq[0]) != 1)
+      return '\x1b';
+    // A key typed right after the escape, not a sequence: it's read next
+    if (seq[0] != '[' && seq[0] != 'O') {
+      term_unread(E.term, seq[0]);
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    }
+    if (term_read(E.term, &seq[1]) != 1)
       return '\x1b';
 
     // If Start Escape char '['
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
+        if (term_read(E.term, &seq[2]) != 1)
           return '\x1b';
         if (seq[2] == '~') {
           switch (seq[1]) {
@@ -391,985 +765,5102 @@ int editorReadKey(void) {
   }
 }
 
-int getCursorPosition(int *rows, int *cols) {
-  // Avoid unused rows, cols
-  UNUSED(rows);
-  UNUSED(cols);
+// Next key typed, recorded if a macro is being recorded, or the next key of
+// the macro being replayed
+int editorReadKey(void) {
+  if (E.replay_depth)
+    return editorMacroNextKey();
+  int c = editorReadTermKey();
+  if (E.macro_reg)
+    editorMacroRecord(c);
+  return c;
+}
 
-  char buf[32];
-  unsigned long i = 0;
+// Reads the second key of a sequence like dd, giving it a bit of time to
+// arrive unless it comes from a macro
+int editorReadSequenceKey(void) {
+  if (!E.replay_depth && !term_pending(E.term))
+    usleep(SEQUENCES_TIMEOUT_MICROSEC);
+  return editorReadKey();
+}
 
-  if (write(STDOUT_FILENO, GET_CURSOR, GET_CURSOR_SZ) != GET_CURSOR_SZ)
-    return -1;
+/*** line number operations ***/
 
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
-      break;
-    if (buf[i] == 'R')
-      break;
-    i++;
-  }
-  buf[i] = '\0';
+int editorGetLineNumberWidth(void) {
+  if (!DITTO_LINENO_ENABLED)
+    return 0;
+  return 5; // "9999 " format (4 digits + space)
+}
 
-  // Debug print to show the cursor position
-  // printf("\r\n&buf[1]: '%s'\r\n", &buf[1]);
+void updateScreenSize(void) {
+  if (term_size(E.term, &E.termrows, &E.termcols) == -1)
+    die("term_size");
 
-  if (buf[0] != '\x1b' || buf[1] != '[')
-    return -1;
-  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-    return -1;
+  dlog_debug(E.logger, "Screen size: %d x %d", E.termrows, E.termcols);
 
-  return 0;
+  // The windows share the screen but for the message bar, the cursor is kept
+  // on the screen by the next editorScroll
+  editorWindowLayout();
 }
 
-int getWindowSize(int *rows, int *cols) {
-  struct winsize ws;
-
-  // Get the size of the terminals on most systems
-  // (Terminal Input Output Control Get WINdow SiZe)
-  // There is a fallback in case it would fail
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    // Position the cursor to the bottom right and get rows,cols (use 999 just
-    // to be sure)
-    if (write(STDOUT_FILENO, POS_CURSOR_AT(999, 999), 12) != 12)
-      return -1;
+/*** row operations ***/
 
-    return getCursorPosition(rows, cols);
+// Called by every row operation on the (row, col) where the content starts to
+// differ: it moves the first modified position back if needed, and logs the
+// edit to the swap journal, if any. It's O(edit size): records are only
+// buffered here and synced on a timer.
+void editorRowChanged(uint8_t op, int row, int col, const char *data,
+                      size_t len) {
+  E.buf->edit_gen++;
+  editorDiffChanged(row, op == JOP_DELETE_ROWS ? row : row + 1);
+  if (E.buf->dirty_row == -1 || row < E.buf->dirty_row ||
+      (row == E.buf->dirty_row && col < E.buf->dirty_col)) {
+    E.buf->dirty_row = row;
+    E.buf->dirty_col = col;
   }
 
-  *cols = ws.ws_col;
-  *rows = ws.ws_row;
+  if (E.buf->journal &&
+      journal_record(E.buf->journal, op, row, col, data, len) == -1)
+    dlog_error(E.logger, "Could not write the swap journal");
+}
 
-  return 0;
+// Returns the row, paging it in first in view mode. The pointer is only valid
+// until the next call.
+Row *editorRowAt(int at) {
+  if (E.buf->view && (at < E.buf->view_first ||
+                      at >= E.buf->view_first + E.buf->view_len))
+    editorViewPage(at);
+  return &E.buf->row[at - E.buf->view_first];
 }
 
-/*** line number operations ***/
+// Line length callback for the line index, including the newline
+size_t editorLineLength(void *ctx, long line) {
+  UNUSED(ctx);
+  if (E.buf->view) {
+    editorRowAt(line);
+    return E.buf->view_offs[line - E.buf->view_first + 1] -
+           E.buf->view_offs[line - E.buf->view_first];
+  }
+  return E.buf->row[line].size + 1;
+}
 
-int editorGetLineNumberWidth(void) {
-  if (!DITTO_LINENO_ENABLED)
-    return 0;
-  return 5; // "9999 " format (4 digits + space)
+// Start of the character before (or after) the one at cx. A character can
+// take several bytes, along with the combining marks following it.
+int editorRowPrev(Row *row, int cx) {
+  return row->plain ? MAX(cx - 1, 0) : utf8_prev(row->chars, row->size, cx);
 }
 
-void updateScreenSize(void) {
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-    die("getWindowSize");
+int editorRowNext(Row *row, int cx) {
+  return row->plain ? MIN(cx + 1, row->size)
+                    : utf8_next(row->chars, row->size, cx);
+}
 
-  dlog_debug(E.logger, "Screen resized to: %d x %d", E.screenrows,
-             E.screencols);
+// Start of the character containing the byte at cx
+int editorRowSnap(Row *row, int cx) {
+  return row->plain ? cx : utf8_snap(row->chars, row->size, cx);
+}
 
-  // Make space for the line numbers
-  E.screencols -= editorGetLineNumberWidth();
+// Columns taken by the character at j, starting at column col
+int editorRowCharWidth(Row *row, int j, int col) {
+  unsigned char c = row->chars[j];
+  if (c == '\t')
+    return DITTO_TAB_STOP - col % DITTO_TAB_STOP;
+  if (c < 0x80)
+    return 1;
 
-  // Make space for status bar and status message
-  E.screenrows -= 2;
+  uint32_t cp;
+  utf8_decode(&row->chars[j], row->size - j, &cp);
+  return utf8_width(cp);
+}
 
-  // Validate cursor position after resize
-  if (E.cy >= E.screenrows + E.rowoff) {
-    E.rowoff = E.cy - E.screenrows + 1;
+// Extends the column index of a row which isn't plain until it goes past
+// the byte, or past the column
+void editorRowIndex(Row *row, int byte, int col) {
+  if (row->ncols == 0) {
+    if (row->colcap == 0) {
+      row->colcap = 4;
+      row->cols = drealloc(row->cols, sizeof(ColMark) * row->colcap);
+    }
+    row->cols[row->ncols++] = (ColMark){0, 0};
   }
 
-  if (E.rx >= E.screencols + E.coloff) {
-    E.coloff = E.rx - E.screencols + 1;
+  // The index reached the end once the width is known
+  while (row->rsize == -1) {
+    ColMark last = row->cols[row->ncols - 1];
+    if (last.byte > byte || last.col > col)
+      return;
+
+    int j = last.byte, c = last.col;
+    int block = (j / DITTO_COL_BLOCK + 1) * DITTO_COL_BLOCK;
+    while (j < row->size && j < block) {
+      c += editorRowCharWidth(row, j, c);
+      j = utf8_next(row->chars, row->size, j);
+    }
+
+    if (j >= row->size) {
+      row->rsize = c;
+    } else {
+      if (row->ncols == row->colcap) {
+        row->colcap *= 2;
+        row->cols = drealloc(row->cols, sizeof(ColMark) * row->colcap);
+      }
+      row->cols[row->ncols++] = (ColMark){j, c};
+    }
   }
 }
 
-/*** row operations ***/
+// Last index entry at or before the byte (by_col 0), or the column
+ColMark editorRowMark(Row *row, int at, int by_col) {
+  editorRowIndex(row, by_col ? INT_MAX : at, by_col ? at : INT_MAX);
+
+  int lo = 0, hi = row->ncols - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if ((by_col ? row->cols[mid].col : row->cols[mid].byte) <= at)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return row->cols[lo];
+}
 
 int editorRowCxToRx(Row *row, int cx) {
-  int rx = 0;
-
-  // Rendered cursor x-position needs to advance according to chosen rendered
-  // spaces for tab, for each tab in the line so far
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx += (DITTO_TAB_STOP - 1) - (rx % DITTO_TAB_STOP);
-    }
-    rx++;
+  cx = MIN(cx, row->size);
+  if (row->plain)
+    return cx;
+
+  // Walk from the nearest index entry, at most a block away
+  ColMark m = editorRowMark(row, cx, 0);
+  int j = m.byte, col = m.col;
+  while (j < cx) {
+    int next = utf8_next(row->chars, row->size, j);
+    if (next > cx)
+      break;
+    col += editorRowCharWidth(row, j, col);
+    j = next;
   }
+  return col;
+}
+
+// Rendered length of the row, indexing all of it if needed
+int editorRowWidth(Row *row) {
+  if (row->rsize == -1)
+    editorRowIndex(row, INT_MAX, INT_MAX);
+  return row->rsize;
+}
 
-  return rx;
+// Updates what's derived from the content of the row after it changed from
+// byte at on. plain tells if the row is still plain ASCII.
+void editorUpdateRowFrom(Row *row, int at, int plain) {
+  row->plain = plain;
+  if (plain) {
+    dfree(row->cols);
+    row->cols = NULL;
+    row->ncols = 0;
+    row->colcap = 0;
+    row->rsize = row->size;
+  } else {
+    // Entries before the change stay valid
+    while (row->ncols > 0 && row->cols[row->ncols - 1].byte >= at)
+      row->ncols--;
+    row->rsize = -1;
+  }
+  row->hl.valid = 0;
+  dfree(row->wraps);
+  row->wraps = NULL;
+  row->nwraps = 0;
+  row->wrap_cols = 0;
+
+  // The index of a file-backed window is never stale
+  if (!E.buf->view) {
+    li_touch(E.buf->lineidx, row - E.buf->row);
+    for (int k = 0; k < DITTO_WRAP_WIDTHS && E.buf->wrapidxs[k]; k++)
+      li_touch(E.buf->wrapidxs[k], row - E.buf->row);
+    E.buf->hl_from = MIN(E.buf->hl_from, row - E.buf->row);
+  }
 }
 
 void editorUpdateRow(Row *row) {
-  int tabs = 0;
+  editorUpdateRowFrom(row, 0, utf8_is_plain(row->chars, row->size));
+}
 
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      tabs++;
+// Makes room for n more rows at the end of the window
+void editorRowReserve(int n) {
+  int head = E.buf->row - E.buf->rowbuf;
+  if (head + E.buf->numrows + n <= E.buf->rowcap)
+    return;
+
+  // Reuse the space of evicted rows once it's at least as large as the live
+  // ones, so that compacting stays amortized O(1) per eviction
+  if (head > 0 && head >= E.buf->numrows) {
+    memmove(E.buf->rowbuf, E.buf->row, sizeof(Row) * E.buf->numrows);
+    E.buf->row = E.buf->rowbuf;
+    if (E.buf->numrows + n <= E.buf->rowcap)
+      return;
+    head = 0;
   }
 
-  dfree(row->render);
-  row->render = dmalloc(row->size + tabs * (DITTO_TAB_STOP - 1) + 1);
+  int cap = MAX(E.buf->rowcap * 2, 16);
+  while (cap < head + E.buf->numrows + n)
+    cap *= 2;
+  E.buf->rowbuf = drealloc(E.buf->rowbuf, sizeof(Row) * cap);
+  E.buf->row = E.buf->rowbuf + head;
+  E.buf->rowcap = cap;
+}
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    // Tabs rendering
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % DITTO_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
-  }
+// Makes room for n empty rows at at with a single memmove, to be filled with
+// editorFillRow
+void editorOpenRows(int at, int n) {
+  editorRowReserve(n);
+  memmove(&E.buf->row[at + n], &E.buf->row[at],
+          sizeof(Row) * (E.buf->numrows - at));
+  memset(&E.buf->row[at], 0, sizeof(Row) * n);
+
+  E.buf->numrows += n;
+  li_insert_lines(E.buf->lineidx, at, n);
+  for (int k = 0; k < DITTO_WRAP_WIDTHS && E.buf->wrapidxs[k]; k++)
+    li_insert_lines(E.buf->wrapidxs[k], at, n);
+}
 
-  row->render[idx] = '\0';
-  row->rsize = idx;
+// Sets the text of a row opened by editorOpenRows, which it takes over, or
+// which it shares with the slice if not NULL
+void editorFillRow(int at, char *s, size_t len, Slice *slice) {
+  Row *row = &E.buf->row[at];
+  row->size = len;
+  row->chars = s;
+  row->slice = slice;
+  editorUpdateRow(row);
+  editorRowChanged(JOP_INSERT_ROW, at, 0, s, len);
+}
+
+char *editorCopyText(const char *s, size_t len) {
+  char *chars = dmalloc(len + 1);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+  return chars;
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
+  if (at < 0 || at > E.buf->numrows)
     return;
+  editorOpenRows(at, 1);
+  editorFillRow(at, editorCopyText(s, len), len, NULL);
+  E.buf->dirty++;
+}
 
-  E.row = drealloc(E.row, sizeof(Row) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(Row) * (E.numrows - at));
+// Inserts the n lines times over at row at, sharing their text. Returns the
+// number of rows inserted, which is bounded by the int row count.
+long editorInsertRowsShared(int at, Slice **lines, long n, long times) {
+  if (at < 0 || at > E.buf->numrows || n <= 0)
+    return 0;
+  long total = MIN(n * MIN(times, INT_MAX / n), (long)INT_MAX - E.buf->numrows);
+  editorOpenRows(at, total);
+  for (long j = 0; j < total; j++) {
+    Slice *slice = lines[j % n];
+    editorFillRow(at + j, slice->data, slice->len, slice_ref(slice));
+  }
+  E.buf->dirty++;
+  return total;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = dmalloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+// Makes the text of the row a slice, to share it without copying
+Slice *editorRowShare(Row *row) {
+  if (!row->slice)
+    row->slice = slice_wrap(row->chars, row->size);
+  return row->slice;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+// Gives the row its own copy of shared text before it's modified
+void editorRowOwn(Row *row) {
+  if (!row->slice)
+    return;
+  row->chars = slice_take(row->slice);
+  row->slice = NULL;
+}
 
-  E.numrows++;
-  E.dirty++;
+// Frees the text of the row, or drops its reference to it
+void editorRowReleaseText(Row *row) {
+  if (row->slice)
+    slice_unref(row->slice);
+  else
+    dfree(row->chars);
+  row->slice = NULL;
+  row->chars = NULL;
 }
 
 void editorFreeRow(Row *row) {
-  dfree(row->render);
-  dfree(row->chars);
+  syntax_free(&row->hl);
+  dfree(row->wraps);
+  dfree(row->cols);
+  editorRowReleaseText(row);
 }
 
-void editorDeleteRow(int at) {
-  if (at < 0 || at >= E.numrows)
+// Deletes up to n rows from at with a single memmove
+void editorDeleteRows(int at, long n) {
+  if (at < 0 || at >= E.buf->numrows || n <= 0)
     return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(Row) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+  n = MIN(n, E.buf->numrows - at);
+  for (long j = 0; j < n; j++)
+    editorFreeRow(&E.buf->row[at + j]);
+  memmove(&E.buf->row[at], &E.buf->row[at + n],
+          sizeof(Row) * (E.buf->numrows - at - n));
+  E.buf->numrows -= n;
+  li_delete_lines(E.buf->lineidx, at, n);
+  for (int k = 0; k < DITTO_WRAP_WIDTHS && E.buf->wrapidxs[k]; k++)
+    li_delete_lines(E.buf->wrapidxs[k], at, n);
+  E.buf->hl_from = MIN(E.buf->hl_from, at);
+  editorRowChanged(JOP_DELETE_ROWS, at, n, NULL, 0);
+  E.buf->dirty++;
 }
 
-void editorRowInsertChar(Row *row, int at, int c) {
+void editorDeleteRow(int at) { editorDeleteRows(at, 1); }
+
+// Drops the first n rows in O(n), moving the window past them
+void editorEvictRows(int n) {
+  n = MIN(n, E.buf->numrows);
+  for (int j = 0; j < n; j++)
+    editorFreeRow(&E.buf->row[j]);
+
+  E.buf->row += n;
+  E.buf->numrows -= n;
+  li_delete_lines(E.buf->lineidx, 0, n);
+  for (int k = 0; k < DITTO_WRAP_WIDTHS && E.buf->wrapidxs[k]; k++)
+    li_delete_lines(E.buf->wrapidxs[k], 0, n);
+  E.buf->hl_from = MAX(E.buf->hl_from - n, 0);
+  editorDiffChanged(0, 0);
+  // The rows no longer start where the file does
+  E.buf->file_exact = 0;
+
+  E.buf->cy = MAX(E.buf->cy - n, 0);
+  E.buf->rowoff = MAX(E.buf->rowoff - n, 0);
+}
+
+void editorRowInsertChars(Row *row, int at, const char *s, int len) {
   if (at < 0 || at > row->size)
     at = row->size;
-  // Make space for 1 char + NULL terminator
-  row->chars = drealloc(row->chars, row->size + 2);
+  editorRowOwn(row);
+  // Make space for the chars + NULL terminator
+  row->chars = drealloc(row->chars, row->size + len + 1);
   // Like realloc but safe when src/dest can overlap
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  // Update render and rsize with the new row content
-  editorUpdateRow(row);
-  E.dirty++;
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  // Update rsize and the columns with the new row content
+  editorUpdateRowFrom(row, at, row->plain && utf8_is_plain(s, len));
+  editorRowChanged(JOP_INSERT_CHAR, row - E.buf->row, at, s, len);
+  E.buf->dirty++;
+}
+
+void editorRowInsertChar(Row *row, int at, int c) {
+  char ch = c;
+  editorRowInsertChars(row, at, &ch, 1);
 }
 
 void editorRowAppendString(Row *row, char *s, size_t len) {
+  editorRowOwn(row);
   row->chars = drealloc(row->chars, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
+  editorUpdateRowFrom(row, row->size - len,
+                      row->plain && utf8_is_plain(s, len));
+  editorRowChanged(JOP_APPEND_STRING, row - E.buf->row, row->size - len, s,
+                   len);
+  E.buf->dirty++;
+}
+
+void editorRowTruncate(Row *row, int at) {
+  if (at < 0 || at >= row->size)
+    return;
+  editorRowOwn(row);
+  row->size = at;
+  row->chars[row->size] = '\0';
+  editorUpdateRowFrom(row, at, row->plain);
+  editorRowChanged(JOP_TRUNCATE_ROW, row - E.buf->row, at, NULL, 0);
+  E.buf->dirty++;
+}
+
+void editorRowReplace(Row *row, const char *s, size_t len) {
+  editorRowReleaseText(row);
+  row->chars = dmalloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
   editorUpdateRow(row);
-  E.dirty++;
+  editorRowChanged(JOP_REPLACE_ROW, row - E.buf->row, 0, s, len);
+  E.buf->dirty++;
 }
 
 /*** editor operations ***/
 
+// Refuses edits in view mode. Returns 1 if the buffer can be modified.
+int editorCheckWritable(void) {
+  if (E.buf->view) {
+    editorSetStatusMessage("Read-only buffer (--view)");
+    return 0;
+  }
+  if (E.buf->loading) {
+    editorSetStatusMessage("Still loading %s", E.buf->filename);
+    return 0;
+  }
+  return 1;
+}
+
 void editorInsertChar(int c) {
   // EOF, add new row
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+  if (E.buf->cy == E.buf->numrows) {
+    editorInsertRow(E.buf->numrows, "", 0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  editorRowInsertChar(&E.buf->row[E.buf->cy], E.buf->cx, c);
+  E.buf->cx++;
 }
 
 void editorInsertNewline(void) {
-  if (E.cx == 0) {
+  if (E.buf->cx == 0) {
     // At the beginning of the line, just insert a new line above
-    editorInsertRow(E.cy, "", 0);
+    editorInsertRow(E.buf->cy, "", 0);
   } else {
     // Otherwise split the current line and insert with the second part of the
     // content of the current one below
-    Row *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    Row *row = &E.buf->row[E.buf->cy];
+    editorInsertRow(E.buf->cy + 1, &row->chars[E.buf->cx],
+                    row->size - E.buf->cx);
+    editorRowTruncate(&E.buf->row[E.buf->cy], E.buf->cx);
   }
 
   // Bring the cursor to the newline
-  E.cy++;
-  E.cx = 0;
+  E.buf->cy++;
+  E.buf->cx = 0;
 }
 
-void editorRowDeleteChar(Row *row, int at) {
-  if (at < 0 || at >= row->size)
+// Deletes up to n bytes from at with a single memmove
+void editorRowDeleteChars(Row *row, int at, int n) {
+  if (at < 0 || at >= row->size || n <= 0)
     return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+  n = MIN(n, row->size - at);
+  editorRowOwn(row);
+  editorRowChanged(JOP_DELETE_CHARS, row - E.buf->row, at, &row->chars[at], n);
+  memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+  row->size -= n;
+  editorUpdateRowFrom(row, at, row->plain);
+  E.buf->dirty++;
 }
 
+void editorRowDeleteChar(Row *row, int at) { editorRowDeleteChars(row, at, 1); }
+
 void editorDeleteChar(void) {
-  if (E.cy == E.numrows)
+  if (E.buf->cy == E.buf->numrows)
     return;
 
   // At the beginning of the first line, there's nothing to do
-  if (E.cx == 0 && E.cy == 0)
+  if (E.buf->cx == 0 && E.buf->cy == 0)
     return;
 
-  Row *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    // If there's a character at the left of the cursor, we delete it and move
-    // the cursor to the left
-    editorRowDeleteChar(row, E.cx - 1);
-    E.cx--;
+  Row *row = &E.buf->row[E.buf->cy];
+  if (E.buf->cx > 0) {
+    // If there's a character at the left of the cursor, we delete all of its
+    // bytes and move the cursor to the left
+    int from = editorRowPrev(row, E.buf->cx);
+    editorRowDeleteChars(row, from, E.buf->cx - from);
+    E.buf->cx = from;
   } else {
     // Backspacing at the beginning of the line means we need to merge current
     // line and previous one, so we append the current line to that and delete
     // it
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDeleteRow(E.cy);
-    E.cy--;
+    E.buf->cx = E.buf->row[E.buf->cy - 1].size;
+    editorRowAppendString(&E.buf->row[E.buf->cy - 1], row->chars, row->size);
+    editorDeleteRow(E.buf->cy);
+    E.buf->cy--;
   }
 }
 
-/*** file i/o ***/
+// Deletes n characters from the cursor on (x), or before it (X), as a single
+// edit of the row
+void editorDeleteCharsAtCursor(long n, int before) {
+  if (E.buf->cy >= E.buf->numrows)
+    return;
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1;
+  Row *row = &E.buf->row[E.buf->cy];
+  if (before) {
+    // Like backspace, X at the beginning of the line joins it to the previous
+    if (E.buf->cx == 0) {
+      editorDeleteChar();
+      return;
+    }
+    int from = E.buf->cx;
+    for (; n > 0 && from > 0; n--)
+      from = editorRowPrev(row, from);
+    editorRowDeleteChars(row, from, E.buf->cx - from);
+    E.buf->cx = from;
+  } else {
+    if (row->size == 0)
+      return;
+    // Past the end of the line, x deletes the last character
+    if (E.buf->cx >= row->size)
+      E.buf->cx = editorRowPrev(row, row->size);
+    int to = E.buf->cx;
+    for (; n > 0 && to < row->size; n--)
+      to = editorRowNext(row, to);
+    editorRowDeleteChars(row, E.buf->cx, to - E.buf->cx);
   }
-  *buflen = totlen;
+}
 
-  char *buf = dmalloc(totlen);
-  char *p = buf;
-  for (int j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
-  }
+/*** registers ***/
 
-  return buf;
+// Register named c: '"' for the unnamed one or a-z. NULL if there's none.
+Register *editorRegister(int c) {
+  if (c == KEY_DQUOTE)
+    return &E.regs[0];
+  if (c >= 'a' && c <= 'z')
+    return &E.regs[c - 'a' + 1];
+  return NULL;
 }
 
-void editorOpen(const char *filename) {
-  dfree(E.filename);
-  E.filename = dstrdup(filename);
+void editorRegisterClear(Register *reg) {
+  for (long j = 0; j < reg->nlines; j++)
+    slice_unref(reg->lines[j]);
+  dfree(reg->lines);
+  reg->lines = NULL;
+  reg->nlines = 0;
+}
 
-  FILE *f = fopen(filename, "a+");
-  if (!f)
-    die("fopen");
-  fseek(f, 0, SEEK_SET);
+// Fills the register with the text from (sy, sx) to (ey, ex), the end
+// excluded. The rows taken whole share their text, only the cut ones are
+// copied.
+void editorRegisterSet(Register *reg, int sy, int sx, int ey, int ex,
+                       int charwise) {
+  editorRegisterClear(reg);
+  long n = ey - sy + 1;
+  reg->lines = dmalloc(sizeof(Slice *) * n);
+  for (long j = 0; j < n; j++) {
+    Row *row = &E.buf->row[sy + j];
+    int a = j == 0 ? sx : 0;
+    int b = sy + j == ey ? ex : row->size;
+    if (a == 0 && b == row->size)
+      reg->lines[j] = slice_ref(editorRowShare(row));
+    else
+      reg->lines[j] = slice_new(&row->chars[a], b - a);
+  }
+  reg->nlines = n;
+  reg->charwise = charwise;
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// Yanks the text from (sy, sx) to (ey, ex) into the selected register, and
+// into the unnamed one too as in vim
+void editorYankRange(int sy, int sx, int ey, int ex, int charwise) {
+  Register *reg = editorRegister(E.reg_sel);
+  editorRegisterSet(reg, sy, sx, ey, ex, charwise);
+  if (reg != &E.regs[0])
+    editorRegisterSet(&E.regs[0], sy, sx, ey, ex, charwise);
+}
 
-  while ((linelen = getline(&line, &linecap, f)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
+// Yanks up to n rows from at. Returns the number of rows yanked.
+long editorYank(int at, long n) {
+  n = MIN(n, (long)E.buf->numrows - at);
+  if (n <= 0)
+    return 0;
+  editorYankRange(at, 0, at + n - 1, E.buf->row[at + n - 1].size, 0);
+  return n;
+}
 
-    editorInsertRow(E.numrows, line, linelen);
+// Puts the lines of a char-wise register at byte at of the cursor row: the
+// first one goes inside the row, the others below it, and the rest of the
+// row after the last one
+void editorPutChars(Register *reg, int at) {
+  if (E.buf->numrows == 0)
+    editorInsertRow(0, "", 0);
+  E.buf->cy = MIN(E.buf->cy, E.buf->numrows - 1);
+  Row *row = &E.buf->row[E.buf->cy];
+  Slice *first = reg->lines[0];
+
+  if (reg->nlines == 1) {
+    editorRowInsertChars(row, at, first->data, first->len);
+    E.buf->cx = at + MAX((int)first->len - 1, 0);
+    return;
   }
 
-  free(line); // Not used dmalloc here
-  fclose(f);
-  E.dirty = 0;
+  char *tail = editorCopyText(&row->chars[at], row->size - at);
+  int taillen = row->size - at;
+  editorRowTruncate(row, at);
+  editorRowAppendString(row, first->data, first->len);
+  editorInsertRowsShared(E.buf->cy + 1, reg->lines + 1, reg->nlines - 1, 1);
+  editorRowAppendString(&E.buf->row[E.buf->cy + reg->nlines - 1], tail,
+                        taillen);
+  dfree(tail);
+  E.buf->cx = at;
 }
 
-int editorSave(void) {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Filename to save to: %s");
-    if (E.filename == NULL)
-      return 1;
+// Puts the selected register times over after the cursor (p) or before it
+// (P): as rows below or above the cursor row, or inside it if the register
+// was yanked char-wise, in which case the count is ignored
+void editorPutAtCursor(int after, long times) {
+  Register *reg = editorRegister(E.reg_sel);
+  if (reg->nlines == 0) {
+    editorSetStatusMessage("Nothing in register %c", E.reg_sel);
+    editorMacroFail();
+    return;
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd == -1) {
-    dlog_debug(E.logger, "Could not save file %s", E.filename);
-    editorSetStatusMessage("Could not save file %s", E.filename);
-    dfree(buf);
-    return 1;
+  if (reg->charwise) {
+    int at = 0;
+    if (E.buf->cy < E.buf->numrows) {
+      Row *row = &E.buf->row[E.buf->cy];
+      at = MIN(E.buf->cx, row->size);
+      if (after && at < row->size)
+        at = editorRowNext(row, at);
+    }
+    editorPutChars(reg, at);
+    return;
   }
 
-  int err = ftruncate(fd, len);
-  if (!err)
-    err = (write(fd, buf, len) != len);
+  // The cursor goes to the first row put
+  int at = MIN(after ? E.buf->cy + 1 : E.buf->cy, E.buf->numrows);
+  if (editorInsertRowsShared(at, reg->lines, reg->nlines, times) > 0)
+    E.buf->cy = at;
+  E.buf->cx = 0;
+}
 
-  if (!err)
-    editorSetStatusMessage("%d bytes written to %s", len, E.filename);
+/*** trigram index ***/
 
-  close(fd);
-  dfree(buf);
-  E.dirty = 0;
-  return err;
+typedef struct {
+  Buffer *buf;
+  char *filename;
+  int gen;
+} TrigramJob;
+
+// Hidden file next to the edited one, e.g. "dir/.file.txt.<ext>"
+char *editorSidecarPath(const char *filename, const char *ext) {
+  const char *base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+
+  size_t len = dirlen + strlen(base) + strlen(ext) + 3;
+  char *path = dmalloc(len);
+  snprintf(path, len, "%.*s.%s.%s", dirlen, filename, base, ext);
+  return path;
 }
 
-/*** append buffer ***/
+// Runs in a background thread: it only touches the file on disk and the job,
+// then hands the index over through the trigram_pending of its buffer
+void *editorTrigramWorker(void *arg) {
+  TrigramJob *job = arg;
+  char *cache = editorSidecarPath(job->filename, "dtri");
+  TrigramIndex *t = NULL;
+
+  // Stamped with the same identity the journal and saves compare, taken
+  // before reading so that changes while building make it stale
+  struct stat st;
+  if (stat(job->filename, &st) == 0) {
+    int64_t mtime = editorStatMtime(&st);
+    t = tri_load(cache, st.st_size, mtime);
+    if (!t) {
+      t = tri_build_file(job->filename, st.st_size, mtime);
+      // Not being able to persist it just means rebuilding next time
+      if (t)
+        tri_save(t, cache);
+    }
+  }
 
-void abAppend(AppendBuffer *ab, const char *s, int len) {
-  char *new = drealloc(ab->b, ab->len + len);
+  // Only handed over if no newer builder was started meanwhile, which the
+  // lock guarantees until it's published
+  Buffer *b = job->buf;
+  pthread_mutex_lock(&b->trigram_lock);
+  if (t && b->trigram_gen == job->gen && b->trigram_pending == NULL) {
+    b->trigram_pending = t;
+    t = NULL;
+  }
+  pthread_mutex_unlock(&b->trigram_lock);
+  tri_destroy(t);
 
-  if (new == NULL)
-    die("drealloc");
+  dfree(cache);
+  dfree(job->filename);
+  dfree(job);
+  return NULL;
+}
 
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+// Takes the index handed over by the builder, if any
+TrigramIndex *editorTrigramTake(void) {
+  pthread_mutex_lock(&E.buf->trigram_lock);
+  TrigramIndex *pending = E.buf->trigram_pending;
+  E.buf->trigram_pending = NULL;
+  pthread_mutex_unlock(&E.buf->trigram_lock);
+  return pending;
 }
 
-void abFree(AppendBuffer *ab) { dfree(ab->b); }
+void editorTrigramDiscard(void) {
+  tri_destroy(editorTrigramTake());
+  tri_destroy(E.buf->trigram);
+  E.buf->trigram = NULL;
+}
 
-/*** output ***/
+void editorTrigramStart(void) {
+  if (!E.trigram_enabled || !E.buf->filename || E.buf->view)
+    return;
 
-void editorScroll(void) {
-  E.rx = 0;
+  // Invalidate any builder still running on older contents
+  pthread_mutex_lock(&E.buf->trigram_lock);
+  int gen = ++E.buf->trigram_gen;
+  pthread_mutex_unlock(&E.buf->trigram_lock);
+  editorTrigramDiscard();
+
+  TrigramJob *job = dmalloc(sizeof(TrigramJob));
+  job->buf = E.buf;
+  job->filename = dstrdup(E.buf->filename);
+  job->gen = gen;
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, editorTrigramWorker, job) != 0) {
+    dlog_error(E.logger, "Could not start the trigram index builder");
+    dfree(job->filename);
+    dfree(job);
+    return;
+  }
+  pthread_detach(tid);
+  E.buf->trigram_building = 1;
+}
 
-  // Horizontal scroll based on rendered chars
-  if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+// Returns the index if it's ready, adopting it from the builder if needed
+TrigramIndex *editorTrigramIndex(void) {
+  TrigramIndex *pending = editorTrigramTake();
+  if (pending) {
+    tri_destroy(E.buf->trigram);
+    E.buf->trigram = pending;
+    E.buf->trigram_building = 0;
+    dlog_info(E.logger,
+              "Trigram index %s in %.1f ms: %zu terms, %zu postings, %zu bytes",
+              pending->from_cache ? "loaded" : "built", pending->build_ms,
+              pending->nterms, pending->npostings, tri_memory(pending));
   }
+  return E.buf->trigram;
+}
 
-  // Cursor is above visible window
-  if (E.cy < E.rowoff) {
-    // Align file offset to the cursor
-    E.rowoff = E.cy;
+void editorTrigramStats(void) {
+  TrigramIndex *t = editorTrigramIndex();
+
+  if (!E.trigram_enabled) {
+    editorSetStatusMessage("Trigram index disabled (start with --index)");
+  } else if (E.buf->view) {
+    editorSetStatusMessage("Trigram index: not built in view mode, to keep "
+                           "memory bounded");
+  } else if (!t) {
+    editorSetStatusMessage(E.buf->trigram_building
+                               ? "Trigram index: building..."
+                               : "Trigram index: not available");
+  } else {
+    editorSetStatusMessage(
+        "Trigram index: %zu terms, %zu postings, %.1f MB, %s in %.0f ms%s",
+        t->nterms, t->npostings, tri_memory(t) / (1024.0 * 1024.0),
+        t->from_cache ? "loaded" : "built", t->build_ms,
+        E.buf->dirty ? " (unused until saved)" : "");
   }
+}
 
-  // Cursor is below visible window
-  if (E.cy >= E.rowoff + E.screenrows) {
-    // Align file offset to the cursor + the y-size of the screen
-    E.rowoff = E.cy - E.screenrows + 1;
+/*** swap journal ***/
+
+// Replays a journal record through the same row operations that logged it
+int editorJournalApply(void *ctx, JournalRecord *rec) {
+  UNUSED(ctx);
+  int at = rec->row;
+
+  if (rec->op == JOP_INSERT_ROW) {
+    if (at > E.buf->numrows)
+      return -1;
+    editorInsertRow(at, (char *)rec->data, rec->len);
+    return 0;
   }
 
-  // Handle rendered difference of x position of the cursor
-  if (E.rx < E.coloff) {
-    E.coloff = E.rx;
+  if (at >= E.buf->numrows)
+    return -1;
+  Row *row = &E.buf->row[at];
+
+  switch (rec->op) {
+  case JOP_DELETE_ROW:
+    editorDeleteRow(at);
+    break;
+  case JOP_DELETE_ROWS:
+    editorDeleteRows(at, rec->col);
+    break;
+  case JOP_INSERT_CHAR:
+    if (rec->len == 0 || (int)rec->col > row->size)
+      return -1;
+    editorRowInsertChars(row, rec->col, rec->data, rec->len);
+    break;
+  case JOP_DELETE_CHAR:
+    if ((int)rec->col >= row->size)
+      return -1;
+    editorRowDeleteChar(row, rec->col);
+    break;
+  case JOP_DELETE_CHARS:
+    if ((int)rec->col >= row->size)
+      return -1;
+    editorRowDeleteChars(row, rec->col, rec->len);
+    break;
+  case JOP_APPEND_STRING:
+    editorRowAppendString(row, (char *)rec->data, rec->len);
+    break;
+  case JOP_TRUNCATE_ROW:
+    editorRowTruncate(row, rec->col);
+    break;
+  case JOP_REPLACE_ROW:
+    editorRowReplace(row, rec->data, rec->len);
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+// Modification time, in nanoseconds where available, so that rewrites within
+// the same second are told apart
+int64_t editorStatMtime(struct stat *st) {
+#ifdef __linux__
+  return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+  return st->st_mtime;
+#endif
+}
+
+// Identity of the file on disk (size and mtime), zero if it doesn't exist yet
+void editorFileIdentity(uint64_t *size, int64_t *mtime) {
+  struct stat st;
+  *size = 0;
+  *mtime = 0;
+  if (E.buf->filename && stat(E.buf->filename, &st) == 0) {
+    *size = st.st_size;
+    *mtime = editorStatMtime(&st);
   }
-  if (E.rx >= E.coloff + E.screencols) {
-    E.coloff = E.rx - E.screencols + 1;
+}
+
+// Recovers the edits of a previous session that didn't exit cleanly, then
+// keeps journaling on top of them
+void editorJournalStart(void) {
+  if (!E.buf->filename)
+    return;
+
+  uint64_t size;
+  int64_t mtime;
+  editorFileIdentity(&size, &mtime);
+  E.buf->journal_path = editorSidecarPath(E.buf->filename, "dswp");
+
+  // The journal of a session still running isn't recovered, nor written to
+  int fd = journal_lock(E.buf->journal_path);
+  if (fd == -1 && errno == EWOULDBLOCK) {
+    editorSetStatusMessage("%s is being edited by another ditto, edits are "
+                           "not journaled",
+                           E.buf->filename);
+    dfree(E.buf->journal_path);
+    E.buf->journal_path = NULL;
+    return;
   }
 
-  // Cursor is to the left of visible window
-  if (E.cx < E.coloff) {
-    E.coloff = E.cx;
+  off_t valid;
+  long n = -1;
+  if (fd != -1)
+    n = journal_replay(E.buf->journal_path, size, mtime, editorJournalApply,
+                       NULL, &valid);
+  if (n > 0) {
+    dlog_info(E.logger, "Recovered %ld edits from %s", n, E.buf->journal_path);
+    E.buf->dirty = n;
   }
-  // Cursor is to the right of visible window
-  if (E.cx >= E.coloff + E.screencols) {
-    E.coloff = E.cx - E.screencols + 1;
+
+  E.buf->journal = journal_open(fd, size, mtime, n >= 0 ? valid : 0);
+  if (!E.buf->journal) {
+    dlog_error(E.logger, "Could not open the swap journal %s",
+               E.buf->journal_path);
+    dfree(E.buf->journal_path);
+    E.buf->journal_path = NULL;
+    return;
   }
+  E.buf->journal_synced = monotonicMs();
+
+  if (n > 0)
+    editorSetStatusMessage("Recovered %ld unsaved edits (:w to keep them)", n);
 }
 
-void editorDrawRows(AppendBuffer *ab) {
-  for (int y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+// Writes the buffered edits once the sync interval has elapsed, or right away
+// if forced
+void editorJournalSync(int force) {
+  if (!E.buf->journal)
+    return;
 
-    // Print the line number
-    if (DITTO_LINENO_ENABLED && filerow < E.numrows) {
-      char line[16];
-      snprintf(line, sizeof(line), "%4d ", filerow + 1);
-      abAppend(ab, line, strlen(line));
-    }
+  double now = monotonicMs();
+  if (!force && now - E.buf->journal_synced < DITTO_JOURNAL_SYNC_MS)
+    return;
+  E.buf->journal_synced = now;
 
-    // If we are at the end of the file
-    if (filerow >= (int)E.numrows) {
-      abAppend(ab, "~", 1);
+  if (E.buf->journal->len > 0 && journal_flush(E.buf->journal) == -1)
+    dlog_error(E.logger, "Could not sync the swap journal");
+}
 
-      // Welcome message if no content or no file loaded
-      if (E.numrows == 0 && y == E.screenrows / 2) {
-        char wlc[20];
-        int l = snprintf(wlc, sizeof(wlc), "Ditto -- %s", DITTO_VERSION);
-        int pad = (E.screencols - l) / 2;
-        char line[E.screencols + 1];
-        memset(line, ' ', pad);
-        memcpy(line + pad, wlc, l);
-        abAppend(ab, line, pad + l);
-      }
-    } else {
-      // Print the row otherwise, considering the column offset
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
-    }
+// The edits are on disk now: restart the journal from the saved file,
+// following it if it was saved under another name
+void editorJournalSaved(void) {
+  if (!E.buf->journal)
+    return;
 
-    // Clear the rest of the line and go newline in the terminal
-    abAppend(ab, ERASE_LINE_RIGHT, ERASE_LINE_RIGHT_SZ);
-    abAppend(ab, "\r\n", 2);
+  char *path = editorSidecarPath(E.buf->filename, "dswp");
+  if (strcmp(path, E.buf->journal_path) != 0) {
+    journal_close(E.buf->journal, E.buf->journal_path);
+    dfree(E.buf->journal_path);
+    E.buf->journal = NULL;
+    E.buf->journal_path = NULL;
+    dfree(path);
+    editorJournalStart();
+    return;
   }
-}
-
-void editorDrawStatusBar(AppendBuffer *ab) {
-  abAppend(ab, COLORS_INVERT_ON, COLORS_INVERT_ON_SZ);
-  char status[80];
-  char rstatus[80];
+  dfree(path);
 
-  int len = snprintf(status, sizeof(status), " %s%s%s %.20s %s", COLORS_BOLD_ON,
-                     mode_str[E.mode], COLORS_BOLD_OFF,
-                     E.filename ? E.filename : "[No Name]",
-                     E.dirty ? "(edited)" : "");
-
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d ", E.cy + 1, E.rx + 1);
+  uint64_t size;
+  int64_t mtime;
+  editorFileIdentity(&size, &mtime);
+  if (journal_reset(E.buf->journal, size, mtime) == -1)
+    dlog_error(E.logger, "Could not reset the swap journal");
+}
 
-  // Remove not visible chars from count
-  int nonprintable = 0;
-  nonprintable += COLORS_BOLD_ON_SZ + COLORS_BOLD_OFF_SZ;
+// Clean exit, the journal is only left behind by crashes
+void editorJournalClose(void) {
+  journal_close(E.buf->journal, E.buf->journal_path);
+  dfree(E.buf->journal_path);
+  E.buf->journal = NULL;
+  E.buf->journal_path = NULL;
+}
 
-  // Visible chars counting
-  int vizlen = len - nonprintable;
+/*** file i/o ***/
 
-  // Use full terminal width for statusbar (add back line number width)
-  int fullwidth = E.screencols + editorGetLineNumberWidth();
+char *editorRowsToString(size_t *buflen) {
+  size_t totlen = 0;
+  for (int j = 0; j < E.buf->numrows; j++) {
+    totlen += E.buf->row[j].size + 1;
+  }
+  *buflen = totlen;
 
-  // Handle overflow of the statusbar content
-  if (vizlen > fullwidth)
-    vizlen = fullwidth;
+  char *buf = dmalloc(totlen);
+  char *p = buf;
+  for (int j = 0; j < E.buf->numrows; j++) {
+    memcpy(p, E.buf->row[j].chars, E.buf->row[j].size);
+    p += E.buf->row[j].size;
+    *p = '\n';
+    p++;
+  }
 
-  // Assumption: I append the statusbar, but if too long, truncate it,
-  // remembering to add the nonprintable chars of the mode, which we assume
-  // are always there
-  abAppend(ab, status, vizlen + nonprintable);
+  return buf;
+}
 
-  // Fill the rest of the statusbar with spaces
-  while (vizlen + rlen < fullwidth) {
-    abAppend(ab, " ", 1);
-    vizlen++;
+// The I/O backend, created on first use
+Aio *editorAio(void) {
+  if (!E.aio) {
+    E.aio = aio_create(DITTO_IO_DEPTH, AIO_BACKEND_AUTO);
+    if (!E.aio)
+      die("aio_create");
+    dlog_info(E.logger, "File I/O backend: %s", aio_backend_name(E.aio));
   }
+  return E.aio;
+}
 
-  abAppend(ab, rstatus, rlen);
-
-  abAppend(ab, COLORS_ALL_OFF, COLORS_ALL_OFF_SZ);
-  abAppend(ab, "\r\n", 2);
+// Runs the handlers of the finished I/O requests, blocking until at least one
+// finishes if wait is set. Returns the number of requests handled.
+int editorAioDispatch(int wait) {
+  AioRequest *done[DITTO_IO_DEPTH];
+  int n = wait ? aio_wait(E.aio, done, DITTO_IO_DEPTH)
+               : aio_reap(E.aio, done, DITTO_IO_DEPTH);
+  for (int k = 0; k < n; k++)
+    done[k]->complete(done[k]);
+  return n;
 }
 
-void editorDrawMessageBar(AppendBuffer *ab) {
-  abAppend(ab, ERASE_LINE_RIGHT, ERASE_LINE_RIGHT_SZ);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
-    msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < DITTO_STATUSMSG_SEC) {
-    abAppend(ab, E.statusmsg, msglen);
-  }
+double editorThroughput(size_t bytes, double ms) {
+  return ms > 0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
 }
 
-void editorRefreshScreen(void) {
-  AppendBuffer ab = ABUF_INIT;
+// The whole file is in: settle the buffer as freshly opened
+void editorLoadFinish(void) {
+  double ms = monotonicMs() - E.buf->load_start;
 
-  // Handle screen resize
-  if (E.screen_resized) {
-    updateScreenSize();
-    E.screen_resized = 0;
+  if (E.buf->load_fd != -1)
+    close(E.buf->load_fd);
+  if (E.buf->load_reqs) {
+    for (int j = 0; j < DITTO_IO_DEPTH; j++)
+      dfree(E.buf->load_reqs[j].buf);
+    dfree(E.buf->load_reqs);
+  }
+  E.buf->load_fd = -1;
+  E.buf->load_reqs = NULL;
+  E.buf->loading = 0;
+
+  // Saving writes back exactly "row\n", anything else needs a full rewrite
+  E.buf->file_exact = E.buf->load_exact && !E.buf->append_open;
+  E.buf->append_open = 0;
+  E.buf->dirty = 0;
+  E.buf->dirty_row = -1;
+  editorFileIdentity(&E.buf->file_size, &E.buf->file_mtime);
+
+  // Start from evenly sampled blocks rather than the ones grown while loading
+  li_build(E.buf->lineidx, E.buf->numrows);
+
+  if (E.buf->load_off > 0)
+    dlog_info(E.logger, "Loaded %s: %lld bytes, %d lines in %.1f ms "
+              "(%.1f MB/s, %s)", E.buf->filename, (long long)E.buf->load_off,
+              E.buf->numrows, ms, editorThroughput(E.buf->load_off, ms),
+              aio_backend_name(E.aio));
+
+  editorTrigramStart();
+  if (E.buf->journal_enabled) {
+    editorJournalStart();
+    editorWatchStart();
   }
+}
 
-  editorScroll();
+// Queues the read of the next chunk of the file in the slot
+void editorLoadQueue(AioRequest *req) {
+  req->off = E.buf->load_next;
+  req->len = MIN(DITTO_IO_CHUNK, E.buf->load_size - E.buf->load_next);
+  req->data = E.buf;
+  E.buf->load_ready[req - E.buf->load_reqs] = 0;
+  E.buf->load_next += req->len;
+  E.buf->load_pending++;
+  aio_submit(E.aio, req);
+}
 
-  // To avoid cursor flickering, hide the cursor before clearing the screen
-  // and showing it later again
-  abAppend(&ab, HIDE_CURSOR, HIDE_CURSOR_SZ);
-  abAppend(&ab, REPOS_CURSOR, REPOS_CURSOR_SZ);
+// Completion of a chunk read, on the buffer it was queued for. Reads finish
+// in any order, so chunks are appended in file order as soon as the next one
+// is in.
+void editorLoadComplete(AioRequest *req) {
+  Buffer *cur = editorBufferBegin(req->data);
+  E.buf->load_ready[req - E.buf->load_reqs] = 1;
+  E.buf->load_pending--;
+
+  while (E.buf->loading) {
+    if (E.buf->load_off >= E.buf->load_size) {
+      // Reads past an early EOF may still be in flight
+      if (E.buf->load_pending == 0)
+        editorLoadFinish();
+      break;
+    }
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+    int slot = (E.buf->load_off / DITTO_IO_CHUNK) % DITTO_IO_DEPTH;
+    AioRequest *next = &E.buf->load_reqs[slot];
+    if (!E.buf->load_ready[slot])
+      break;
 
-  char buf[32];
+    if (next->error) {
+      editorSetStatusMessage("Error reading %s: %s", E.buf->filename,
+                             strerror(next->error));
+      E.buf->load_exact = 0;
+      E.buf->load_size = E.buf->load_off;
+    } else {
+      if (memchr(next->buf, '\r', next->done))
+        E.buf->load_exact = 0;
+      editorAppendChunk(next->buf, next->done);
+      E.buf->load_off += next->done;
+      // Shrunk while loading
+      if (next->done < next->len)
+        E.buf->load_size = E.buf->load_off;
+    }
 
-  // Position cursor based on input mode
-  if (E.input_mode) {
-    // Cursor in message bar (last line of terminal)
-    int row = E.screenrows + 2; // +1 for status bar, +1 for message bar
-    // Calculate column: prompt length + buffer length + 1
-    // For prompt format like "Filename to save to: %s", we need to find where
-    // %s is
-    int col = 1; // Start at column 1
+    E.buf->load_ready[slot] = 0;
+    if (E.buf->load_next < E.buf->load_size)
+      editorLoadQueue(next);
+  }
+  editorBufferEnd(cur);
+}
 
-    if (E.input_prompt) {
-      // Calculate visible prompt length
-      char prompt_formatted[256];
-      snprintf(prompt_formatted, sizeof(prompt_formatted), E.input_prompt, "");
-      col = strlen(prompt_formatted) + 1;
-    }
+// Blocks until the file is loaded
+void editorLoadWait(void) {
+  while (E.buf->loading && editorAioDispatch(1) > 0)
+    ;
+}
 
-    // Add buffer length for cursor position
-    col += E.input_buffer_len;
+// Opens the file to edit with editorOpen. Returns its descriptor, -1 if it
+// doesn't exist yet, or -2 if it can't be opened, telling why in the status
+// bar.
+int editorOpenFile(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return -1;
+    editorSetStatusMessage("Can't open \"%s\": %s", filename,
+                           strerror(errno));
+    return -2;
+  }
 
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row, col);
-  } else {
-    // Cursor in editor at normal position
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + editorGetLineNumberWidth() + 1);
+  struct stat st;
+  const char *err = NULL;
+  if (fstat(fd, &st) == -1)
+    err = strerror(errno);
+  else if (S_ISDIR(st.st_mode))
+    err = "Is a directory";
+  if (err) {
+    editorSetStatusMessage("Can't open \"%s\": %s", filename, err);
+    close(fd);
+    return -2;
   }
+  return fd;
+}
 
-  abAppend(&ab, buf, strlen(buf));
+// Starts loading the file opened by editorOpenFile (fd -1 for a new file)
+// into the current buffer: rows appear as the reads complete, delivered
+// through the event loop, and the buffer is read-only until it's done
+void editorOpen(const char *filename, int fd) {
+  dfree(E.buf->filename);
+  E.buf->filename = dstrdup(filename);
+  editorSelectSyntax();
+
+  E.buf->load_fd = fd;
+  E.buf->crlf = 0;
+  E.buf->load_off = 0;
+  E.buf->load_exact = 0;
+  E.buf->load_start = monotonicMs();
+
+  // Not there yet, it will be created on save
+  if (E.buf->load_fd == -1) {
+    editorSetStatusMessage("\"%s\" [New File]", filename);
+    editorLoadFinish();
+    return;
+  }
 
-  abAppend(&ab, SHOW_CURSOR, SHOW_CURSOR_SZ);
+  struct stat st;
+  if (fstat(E.buf->load_fd, &st) == -1)
+    die("fstat");
+  E.buf->load_size = st.st_size;
+  E.buf->load_next = 0;
+  E.buf->load_exact = 1;
+  E.buf->loading = 1;
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
-}
+  if (E.buf->load_size == 0) {
+    editorLoadFinish();
+    return;
+  }
 
-/*** input ***/
+  Aio *aio = editorAio();
+  E.buf->load_reqs = dmalloc(sizeof(AioRequest) * DITTO_IO_DEPTH);
+  for (int j = 0; j < DITTO_IO_DEPTH; j++) {
+    AioRequest *req = &E.buf->load_reqs[j];
+    req->op = AIO_READ;
+    req->fd = E.buf->load_fd;
+    req->buf = dmalloc(DITTO_IO_CHUNK);
+    req->complete = editorLoadComplete;
+    req->data = E.buf;
+    E.buf->load_ready[j] = 0;
+    if (E.buf->load_next < E.buf->load_size)
+      editorLoadQueue(req);
+  }
+  dlog_debug(E.logger, "Loading %s (%lld bytes) with %s", filename,
+             (long long)E.buf->load_size, aio_backend_name(aio));
+}
 
-char *editorPrompt(char *prompt) {
-  // Enter input mode and use the global input buffer
-  E.input_mode = 1;
-  E.input_prompt = prompt;
-  E.input_buffer_len = 0;
-  E.input_buffer[0] = '\0';
-  write(STDOUT_FILENO, CURSOR_BAR_BLINK, CURSOR_BAR_BLINK_SZ);
+typedef struct {
+  int pending;
+  int error;
+} IoJob;
+
+void editorIoComplete(AioRequest *req) {
+  IoJob *job = req->data;
+  job->pending--;
+  if (req->error && !job->error)
+    job->error = req->error;
+}
 
-  while (1) {
-    editorSetStatusMessage(prompt, E.input_buffer);
-    editorRefreshScreen();
+// Reads or writes len bytes at off through the I/O backend, queued in chunks
+// which the backend runs concurrently, and waits for all of them. Stores in
+// *done the bytes transferred before the first short chunk (EOF).
+int editorTransfer(enum AioOp op, int fd, char *buf, size_t len, off_t off,
+                   size_t *done) {
+  *done = 0;
+  if (len == 0)
+    return 0;
 
-    int c = editorReadKey();
+  Aio *aio = editorAio();
+  double start = monotonicMs();
+  int nreqs = (len + DITTO_IO_CHUNK - 1) / DITTO_IO_CHUNK;
+  AioRequest *reqs = dmalloc(sizeof(AioRequest) * nreqs);
+  IoJob job = {nreqs, 0};
+
+  for (int j = 0; j < nreqs; j++) {
+    size_t at = (size_t)j * DITTO_IO_CHUNK;
+    reqs[j].op = op;
+    reqs[j].fd = fd;
+    reqs[j].buf = buf + at;
+    reqs[j].len = MIN(DITTO_IO_CHUNK, len - at);
+    reqs[j].off = off + at;
+    reqs[j].complete = editorIoComplete;
+    reqs[j].data = &job;
+    aio_submit(aio, &reqs[j]);
+  }
 
-    if (c == CTRL_KEY('c') || c == KEY_ESC) {
-      editorSetStatusMessage("");
-      E.input_mode = 0;
-      E.input_prompt = NULL;
-      E.input_buffer_len = 0;
-      return NULL;
-    }
+  // Load completions arriving meanwhile are handled as well
+  while (job.pending > 0 && editorAioDispatch(1) > 0)
+    ;
 
-    if (c == KEY_BACKSPACE) {
-      if (E.input_buffer_len > 0) {
-        E.input_buffer[--E.input_buffer_len] = '\0';
-      }
-      continue;
-    }
+  for (int j = 0; j < nreqs; j++) {
+    *done += reqs[j].done;
+    if (reqs[j].done < reqs[j].len)
+      break;
+  }
+  dfree(reqs);
 
-    if (c == '\r') {
-      if (E.input_buffer_len > 0) {
-        editorSetStatusMessage("");
-        E.input_mode = 0;
-        E.input_prompt = NULL;
-        E.input_buffer_len = 0;
-        // Return a copy of the buffer
-        return strdup(E.input_buffer);
-      }
-    }
+  double ms = monotonicMs() - start;
+  dlog_debug(E.logger, "%s %zu bytes in %.1f ms (%.1f MB/s, %s)",
+             op == AIO_READ ? "Read" : "Wrote", *done, ms,
+             editorThroughput(*done, ms), aio_backend_name(aio));
 
-    if (!iscntrl(c) && c < 128) { // Is printable character
-      // Expand buffer if needed
-      if (E.input_buffer_len >= E.input_buffer_size - 1) {
-        E.input_buffer_size *= 2;
-        E.input_buffer = drealloc(E.input_buffer, E.input_buffer_size);
-      }
-      E.input_buffer[E.input_buffer_len++] = c;
-      E.input_buffer[E.input_buffer_len] = '\0';
-    }
+  if (job.error) {
+    errno = job.error;
+    return -1;
   }
+  return 0;
 }
 
-void editorChangeMode(enum editorMode mode) {
-  enum editorMode old_mode = E.mode;
-  E.mode = mode;
+int editorWriteAt(int fd, const char *buf, size_t len, off_t off) {
+  size_t done;
+  return editorTransfer(AIO_WRITE, fd, (char *)buf, len, off, &done);
+}
 
-  // Clean up message bar if exiting command mode
-  if (old_mode == COMMAND_MODE && mode != COMMAND_MODE) {
-    E.input_mode = 0;
-    E.input_prompt = NULL;
-    E.input_buffer_len = 0;
+// Reads the whole file. Returns NULL on error, the contents (to be freed with
+// dfree) otherwise, storing their length in *len.
+char *editorReadFile(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fd, &st) == 0) {
+    buf = dmalloc(st.st_size + 1);
+    if (editorTransfer(AIO_READ, fd, buf, st.st_size, 0, len) == -1) {
+      dfree(buf);
+      buf = NULL;
+    }
   }
 
-  // Change cursor style based on mode
-  if (mode == INSERT_MODE) {
-    write(STDOUT_FILENO, CURSOR_BAR_BLINK, CURSOR_BAR_BLINK_SZ);
-  } else if (mode == COMMAND_MODE) {
-    // Entering command mode - set up input state
-    E.input_mode = 1;
-    E.input_prompt = ":";
-    E.input_buffer_len = 0;
-    E.input_buffer[0] = '\0';
-    write(STDOUT_FILENO, CURSOR_BAR_BLINK, CURSOR_BAR_BLINK_SZ);
-    editorSetStatusMessage(":%s", E.input_buffer);
-  } else {
-    write(STDOUT_FILENO, CURSOR_BLOCK, CURSOR_BLOCK_SZ);
-  }
+  close(fd);
+  return buf;
 }
 
-void editorMoveCursor(int key) {
-  // Current row can be a valid one or the first "empty" line at the end
-  Row *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+// Rewrites the file only from the first modified byte, as everything before
+// it is still on disk as it was loaded (or last saved). Returns the bytes
+// written, or -1 if that's not safe and the file must be rewritten in full.
+long editorSaveInPlace(size_t *total) {
+  if (E.atomic_save || !E.buf->file_exact || E.buf->follow ||
+      E.buf->stream_fd != -1)
+    return -1;
 
-  switch (key) {
-  case KEY_0:
-    E.cx = 0;
-    break;
+  // Changed on disk (or gone) since, the prefix can't be trusted
+  struct stat st;
+  if (stat(E.buf->filename, &st) == -1 || !S_ISREG(st.st_mode) ||
+      (uint64_t)st.st_size != E.buf->file_size ||
+      editorStatMtime(&st) != E.buf->file_mtime)
+    return -1;
 
-  case ARROW_DOWN:
-  case KEY_j:
-    if (E.cy < E.numrows - 1) {
-      E.cy++;
-    }
-    break;
+  int row = E.buf->dirty_row == -1 ? E.buf->numrows
+                                   : MIN(E.buf->dirty_row, E.buf->numrows);
+  int col = row < E.buf->numrows
+                ? MIN(E.buf->dirty_col, E.buf->row[row].size)
+                : 0;
+  size_t off = li_line_to_offset(E.buf->lineidx, row) + col;
+  *total = li_total_bytes(E.buf->lineidx);
 
-  case ARROW_UP:
-  case KEY_k:
-    if (E.cy > 0) {
-      E.cy--;
-    }
-    break;
+  size_t len = *total - off;
+  char *buf = dmalloc(len + 1);
+  char *p = buf;
+  for (int j = row; j < E.buf->numrows; j++) {
+    int from = j == row ? col : 0;
+    memcpy(p, E.buf->row[j].chars + from, E.buf->row[j].size - from);
+    p += E.buf->row[j].size - from;
+    *p++ = '\n';
+  }
 
-  case ARROW_LEFT:
-  case KEY_h:
-    if (E.cx > 0) {
-      E.cx--;
-    }
-    break;
+  int fd = open(E.buf->filename, O_WRONLY);
+  int err = fd == -1;
+  if (!err) {
+    err = editorWriteAt(fd, buf, len, off) == -1 ||
+          ftruncate(fd, *total) == -1 || fsync(fd) == -1;
+    close(fd);
+  }
+  dfree(buf);
 
-  case ARROW_RIGHT:
-  case KEY_l:
-    // Limit right scrolling
-    if (row && E.cx < row->size) {
-      E.cx++;
-    }
-    break;
+  if (err) {
+    dlog_error(E.logger, "In-place save of %s failed: %s", E.buf->filename,
+               strerror(errno));
+    return -1;
+  }
+  dlog_debug(E.logger, "Saved %s in place: %zu bytes from offset %zu",
+             E.buf->filename, len, off);
+  return len;
+}
 
-  // Go to first printable character in the current line
-  case KEY_I: {
-    int p;
-    for (p = 0; p < row->size && isspace(row->chars[p]); p++)
-      ;
-    E.cx = p;
-    break;
+// Safe mode: writes the whole buffer to a temporary file next to the target,
+// then renames it over, so the file is never left half written
+int editorSaveAtomic(size_t *total) {
+  size_t len;
+  char *buf = editorRowsToString(&len);
+  *total = len;
+
+  // Replace the target of a symlink, not the link itself
+  char *target = realpath(E.buf->filename, NULL);
+  const char *path = target ? target : E.buf->filename;
+  char *tmp = editorSidecarPath(path, "dtmp");
+
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int err = fd == -1;
+  if (!err) {
+    if (exists)
+      err = fchmod(fd, st.st_mode & 07777) == -1;
+    if (!err)
+      err = editorWriteAt(fd, buf, len, 0) == -1 || fsync(fd) == -1;
+    err |= close(fd) == -1;
+    if (!err)
+      err = rename(tmp, path) == -1;
+    if (err)
+      unlink(tmp);
   }
 
-  // Move to the end of next word
-  case KEY_e: {
-    // NULL or empty row check
-    if (!row || row->size == 0)
-      break;
+  free(target); // Allocated by realpath
+  dfree(tmp);
+  dfree(buf);
+  return err;
+}
 
-    // Already at or past end of line
-    if (E.cx >= row->size - 1)
-      break;
+int editorSave(void) {
+  if (!editorCheckWritable())
+    return 1;
 
-    // 1. Skip spaces to find start of next word/token
-    while (E.cx < row->size - 1 &&
-           getCharFamily(row->chars[E.cx]) == CHAR_FAMILY_SPACES) {
-      E.cx++;
-    }
+  if (E.buf->filename == NULL) {
+    E.buf->filename = editorPrompt("Filename to save to: %s");
+    if (E.buf->filename == NULL)
+      return 1;
+    editorSelectSyntax();
+  }
 
-    // Reached end of line while skipping spaces
-    if (E.cx >= row->size - 1)
-      break;
+  size_t total;
+  long written = editorSaveInPlace(&total);
+  if (written >= 0) {
+    editorSetStatusMessage("%zu bytes written to %s (%ld in place)", total,
+                           E.buf->filename, written);
+  } else if (editorSaveAtomic(&total) == 0) {
+    editorSetStatusMessage("%zu bytes written to %s", total, E.buf->filename);
+  } else {
+    dlog_debug(E.logger, "Could not save file %s", E.buf->filename);
+    editorSetStatusMessage("Could not save file %s: %s", E.buf->filename,
+                           strerror(errno));
+    return 1;
+  }
 
-    // 2. Check if we're at the end of a word (current char != next char family)
-    int family = getCharFamily(row->chars[E.cx]);
-    int nextfamily = getCharFamily(row->chars[E.cx + 1]);
+  // The file now holds exactly the rows
+  E.buf->file_exact = 1;
+  E.buf->crlf = 0;
+  E.buf->dirty_row = -1;
+  editorFileIdentity(&E.buf->file_size, &E.buf->file_mtime);
 
-    if (nextfamily != family) {
-      // Move to next character (start of next word/token)
-      E.cx++;
-      if (E.cx >= row->size - 1)
-        break;
+  editorJournalSaved();
+  editorDiffSynced();
+  // It may have been saved under another name
+  if (!E.buf->follow)
+    editorWatchStart();
 
-      // Skip spaces if that's what we landed on
-      if (nextfamily == CHAR_FAMILY_SPACES) {
-        while (E.cx < row->size - 1 &&
-               getCharFamily(row->chars[E.cx]) == CHAR_FAMILY_SPACES) {
-          E.cx++;
-        }
-        if (E.cx >= row->size - 1)
-          break;
-        nextfamily = getCharFamily(row->chars[E.cx]);
-      }
+  // The index maps the rows on disk, which have just changed
+  if (E.buf->dirty)
+    editorTrigramStart();
 
-      // Move to end of current word
-      while (E.cx < row->size - 1 &&
-             getCharFamily(row->chars[E.cx + 1]) == nextfamily) {
-        E.cx++;
-      }
-    } else {
-      // 3. We're inside a word, move to its end
-      while (E.cx < row->size - 1 &&
-             getCharFamily(row->chars[E.cx + 1]) == family) {
-        E.cx++;
+  E.buf->dirty = 0;
+  return 0;
+}
+
+/*** follow ***/
+
+// Appends a chunk of text at the end of the buffer, as new rows. The last
+// row stays open while its newline hasn't arrived yet, and further chunks
+// extend it. Appending isn't an edit, so the dirty flag is preserved.
+void editorAppendChunk(const char *buf, size_t len) {
+  int dirty = E.buf->dirty;
+  // Keep following the end if the cursor was on the last row
+  int at_bottom = E.buf->follow && E.buf->cy >= E.buf->numrows - 1;
+
+  while (len > 0) {
+    const char *nl = memchr(buf, '\n', len);
+    size_t seg = nl ? (size_t)(nl - buf) : len;
+
+    if (E.buf->append_open && E.buf->numrows > 0)
+      editorRowAppendString(&E.buf->row[E.buf->numrows - 1], (char *)buf, seg);
+    else
+      editorInsertRow(E.buf->numrows, (char *)buf, seg);
+
+    if (nl) {
+      // Strip CR of CRLF line endings, also when split across chunks
+      Row *row = &E.buf->row[E.buf->numrows - 1];
+      if (row->size > 0 && row->chars[row->size - 1] == '\r') {
+        E.buf->crlf = 1;
+        editorRowOwn(row);
+        row->chars[--row->size] = '\0';
+        editorUpdateRow(row);
       }
     }
 
-    break;
+    E.buf->append_open = nl == NULL;
+    buf += nl ? seg + 1 : seg;
+    len -= nl ? seg + 1 : seg;
   }
 
-  // Move to the beginning of the previous word
-  case KEY_b: {
-    break;
+  if (E.retain > 0 && E.buf->numrows > E.retain && !E.buf->loading)
+    editorEvictRows(E.buf->numrows - E.retain);
+
+  if (at_bottom && E.buf->numrows > 0) {
+    E.buf->cy = E.buf->numrows - 1;
+    E.buf->cx = 0;
   }
 
-  // Move to the start of next word
-  case KEY_w: {
-    int p;
-    int old = getCharFamily(row->chars[E.cx]);
+  E.buf->dirty = dirty;
+}
 
-    for (p = E.cx + 1; p < row->size; p++) {
-      char c = (row->chars[p]);
-      int new = getCharFamily(c);
-      if (old != new && new != CHAR_FAMILY_SPACES) {
-        E.cx = p;
+void editorFollowStart(void) {
+  E.buf->follow_fd = open(E.buf->filename, O_RDONLY);
+  if (E.buf->follow_fd == -1) {
+    editorSetStatusMessage("Cannot follow %s: %s", E.buf->filename,
+                           strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  if (fstat(E.buf->follow_fd, &st) == -1) {
+    close(E.buf->follow_fd);
+    E.buf->follow_fd = -1;
+    return;
+  }
+  E.buf->follow_off = st.st_size;
+
+  // A last line without newline is still being written
+  char last = '\n';
+  if (E.buf->follow_off > 0)
+    pread(E.buf->follow_fd, &last, 1, E.buf->follow_off - 1);
+  E.buf->append_open = last != '\n';
+
+#ifdef __linux__
+  E.buf->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.buf->watch_fd != -1 &&
+      inotify_add_watch(E.buf->watch_fd, E.buf->filename, IN_MODIFY) == -1) {
+    close(E.buf->watch_fd);
+    E.buf->watch_fd = -1;
+  }
+#endif
+  // Without inotify, the size is polled on every idle tick instead
+  if (E.buf->watch_fd == -1)
+    dlog_info(E.logger, "Following %s by polling", E.buf->filename);
+
+  E.buf->follow = 1;
+  E.buf->cy = MAX(E.buf->numrows - 1, 0);
+}
+
+// Reads what has been appended to the followed file since the last time, for
+// at most DITTO_STREAM_BUDGET_MS as editorStreamPoll does. The rest is read
+// on the next ticks, without waiting for a change.
+// Returns 1 if the buffer changed.
+int editorFollowPoll(void) {
+  if (E.buf->follow_fd == -1)
+    return 0;
+
+#ifdef __linux__
+  if (E.buf->watch_fd != -1 && !E.buf->follow_behind) {
+    char events[4096];
+    ssize_t n = read(E.buf->watch_fd, events, sizeof(events));
+    if (n <= 0)
+      return 0;
+    // Drain the whole queue, a single read to EOF covers all of them
+    while (read(E.buf->watch_fd, events, sizeof(events)) > 0)
+      ;
+  }
+#endif
+
+  struct stat st;
+  if (fstat(E.buf->follow_fd, &st) == -1 || st.st_size == E.buf->follow_off)
+    return 0;
+
+  if (st.st_size < E.buf->follow_off) {
+    editorSetStatusMessage("%s truncated, following from the start",
+                           E.buf->filename);
+    E.buf->follow_off = 0;
+    E.buf->append_open = 0;
+  }
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char buf[DITTO_READ_CHUNK];
+  ssize_t n;
+  E.buf->follow_behind = 0;
+  while ((n = pread(E.buf->follow_fd, buf, sizeof(buf), E.buf->follow_off)) >
+         0) {
+    editorAppendChunk(buf, n);
+    E.buf->follow_off += n;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000 >=
+        DITTO_STREAM_BUDGET_MS) {
+      E.buf->follow_behind = 1;
+      break;
+    }
+  }
+
+  return 1;
+}
+
+/*** reload ***/
+
+typedef struct {
+  const char *s;
+  size_t len;
+} TextLine;
+
+typedef struct {
+  const TextLine *lines;
+  long from, to;
+  uint64_t *out;
+} HashJob;
+
+// Runs in a worker thread, only reading the lines (or the rows)
+void *editorHashWorker(void *arg) {
+  HashJob *job = arg;
+  for (long j = job->from; j < job->to; j++)
+    job->out[j] = job->lines
+                      ? diff_hash(job->lines[j].s, job->lines[j].len)
+                      : diff_hash(E.buf->row[j].chars, E.buf->row[j].size);
+  return NULL;
+}
+
+// Hashes the lines (or the rows if lines is NULL) from from to to, split
+// across threads
+void editorHashLines(uint64_t *out, const TextLine *lines, long from,
+                     long to) {
+  long n = to - from;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = MIN(MAX(ncpu, 1), DITTO_MAX_THREADS);
+  nthreads = MIN(nthreads, MAX(n / DITTO_HASH_MIN_ROWS, 1));
+
+  HashJob jobs[DITTO_MAX_THREADS];
+  pthread_t tids[DITTO_MAX_THREADS];
+  int started = 0;
+
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].lines = lines;
+    jobs[t].from = from + n * t / nthreads;
+    jobs[t].to = from + n * (t + 1) / nthreads;
+    jobs[t].out = out;
+    // The last share runs here, as do the ones of threads failing to start
+    if (t == nthreads - 1 ||
+        pthread_create(&tids[started], NULL, editorHashWorker, &jobs[t]) != 0)
+      editorHashWorker(&jobs[t]);
+    else
+      started++;
+  }
+  for (int t = 0; t < started; t++)
+    pthread_join(tids[t], NULL);
+}
+
+// Splits text in lines the way loading does, dropping the CR of CRLF. Stores
+// in *exact whether saving the lines would give back the same bytes.
+long editorSplitLines(const char *buf, size_t len, TextLine **lines,
+                      int *exact) {
+  long n = 0, cap = 0;
+  *lines = NULL;
+  *exact = len == 0 || buf[len - 1] == '\n';
+
+  const char *p = buf, *end = buf + len;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t seg = nl ? (size_t)(nl - p) : (size_t)(end - p);
+    if (nl && seg > 0 && p[seg - 1] == '\r') {
+      seg--;
+      *exact = 0;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      *lines = drealloc(*lines, sizeof(TextLine) * cap);
+    }
+    (*lines)[n++] = (TextLine){p, seg};
+    p = nl ? nl + 1 : end;
+  }
+  return n;
+}
+
+// Where a row ends up once the hunks are applied: rows inside a changed hunk
+// stay at the same distance from its start, as far as it goes
+long editorMapRow(DiffHunk *hunks, long n, long row) {
+  long delta = 0;
+  for (long k = 0; k < n && hunks[k].a <= row; k++) {
+    DiffHunk *h = &hunks[k];
+    if (row < h->a + h->alen)
+      return h->b + MIN(row - h->a, MAX(h->blen - 1, 0));
+    delta += h->blen - h->alen;
+  }
+  return row + delta;
+}
+
+// Brings the buffer in sync with the file on disk, replacing only the rows of
+// the hunks which differ, so the cost follows the size of the diff rather
+// than of the file (apart from hashing). Cursor and viewport stay on the
+// same lines.
+void editorReload(void) {
+  double start = monotonicMs();
+
+  size_t len;
+  char *buf = editorReadFile(E.buf->filename, &len);
+  if (!buf) {
+    editorSetStatusMessage("Cannot reload %s: %s", E.buf->filename,
+                           strerror(errno));
+    return;
+  }
+
+  TextLine *lines;
+  int exact;
+  long nlines = editorSplitLines(buf, len, &lines, &exact);
+
+  uint64_t *old = dmalloc(sizeof(uint64_t) * (E.buf->numrows + 1));
+  uint64_t *new = dmalloc(sizeof(uint64_t) * (nlines + 1));
+  editorHashLines(old, NULL, 0, E.buf->numrows);
+  editorHashLines(new, lines, 0, nlines);
+
+  DiffHunk *hunks;
+  long nhunks = diff_lines(old, E.buf->numrows, new, nlines, &hunks);
+
+  long cy = editorMapRow(hunks, nhunks, E.buf->cy);
+  long rowoff = editorMapRow(hunks, nhunks, E.buf->rowoff);
+
+  // The result is what's on disk already, nothing to journal. Hunks are
+  // applied from the last one so that the rows of the others don't move.
+  Journal *journal = E.buf->journal;
+  E.buf->journal = NULL;
+  long changed = 0;
+  for (long k = nhunks - 1; k >= 0; k--) {
+    DiffHunk *h = &hunks[k];
+    long common = MIN(h->alen, h->blen);
+    for (long i = 0; i < common; i++)
+      editorRowReplace(&E.buf->row[h->a + i], lines[h->b + i].s,
+                       lines[h->b + i].len);
+    editorDeleteRows(h->a + common, h->alen - common);
+    if (h->blen > common)
+      editorOpenRows(h->a + common, h->blen - common);
+    for (long i = common; i < h->blen; i++)
+      editorFillRow(h->a + i,
+                    editorCopyText(lines[h->b + i].s, lines[h->b + i].len),
+                    lines[h->b + i].len, NULL);
+    changed += MAX(h->alen, h->blen);
+  }
+  E.buf->journal = journal;
+
+  E.buf->cy = MIN(cy, E.buf->numrows);
+  E.buf->rowoff = MIN(rowoff, MAX(E.buf->numrows - 1, 0));
+  if (E.buf->cy < E.buf->numrows)
+    E.buf->cx = MIN(E.buf->cx, E.buf->row[E.buf->cy].size);
+  else
+    E.buf->cx = 0;
+
+  // The buffer is the file on disk again
+  E.buf->dirty = 0;
+  E.buf->dirty_row = -1;
+  E.buf->file_exact = exact;
+  E.buf->crlf = memchr(buf, '\r', len) != NULL;
+  editorFileIdentity(&E.buf->file_size, &E.buf->file_mtime);
+  editorJournalSaved();
+  editorTrigramStart();
+  editorDiffSynced();
+
+  dlog_info(E.logger, "Reloaded %s: %ld hunks, %ld rows changed in %.1f ms",
+            E.buf->filename, nhunks, changed, monotonicMs() - start);
+  editorSetStatusMessage("\"%s\" changed on disk, reloaded %ld lines",
+                         E.buf->filename, changed);
+
+  dfree(hunks);
+  dfree(old);
+  dfree(new);
+  dfree(lines);
+  dfree(buf);
+}
+
+// Watches the directory of the file, as editors and tools often replace it
+// with a new one (rename) rather than writing it in place
+void editorWatchStart(void) {
+#ifdef __linux__
+  if (E.buf->watch_fd != -1)
+    close(E.buf->watch_fd);
+  dfree(E.buf->watch_name);
+  E.buf->watch_fd = -1;
+  E.buf->watch_name = NULL;
+
+  const char *base = strrchr(E.buf->filename, '/');
+  char *dir = base ? dstrdup(E.buf->filename) : dstrdup(".");
+  if (base)
+    dir[base - E.buf->filename + 1] = '\0';
+  E.buf->watch_name = dstrdup(base ? base + 1 : E.buf->filename);
+
+  E.buf->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.buf->watch_fd != -1 &&
+      inotify_add_watch(E.buf->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) ==
+          -1) {
+    close(E.buf->watch_fd);
+    E.buf->watch_fd = -1;
+  }
+  dfree(dir);
+#endif
+}
+
+// Handles the changes to the file made by someone else.
+// Returns 1 if the screen needs to be redrawn.
+int editorWatchPoll(void) {
+  int touched = 0;
+#ifdef __linux__
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(E.buf->watch_fd, events, sizeof(events))) > 0) {
+    for (char *p = events; p < events + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len && strcmp(ev->name, E.buf->watch_name) == 0)
+        touched = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+#endif
+  if (!touched || E.buf->loading)
+    return 0;
+
+  // Our own saves look just like what was last loaded or saved
+  uint64_t size;
+  int64_t mtime;
+  editorFileIdentity(&size, &mtime);
+  if (size == E.buf->file_size && mtime == E.buf->file_mtime)
+    return 0;
+
+  if (E.buf->dirty) {
+    editorSetStatusMessage("\"%s\" changed on disk (:reload! to discard "
+                           "your changes)", E.buf->filename);
+    return 1;
+  }
+
+  editorReload();
+  return 1;
+}
+
+/*** diff ***/
+
+// Rows from from on changed, and the rows from to on (as numbered now) only
+// moved
+void editorDiffChanged(int from, int to) {
+  if (!E.buf->diff)
+    return;
+  if (E.buf->diff_lo == -1 || from < E.buf->diff_lo)
+    E.buf->diff_lo = from;
+  E.buf->diff_tail = MIN(E.buf->diff_tail, E.buf->numrows - to);
+}
+
+// Diffs the rows against the lines on disk hashed by editorDiffStart, on
+// first draw after every edit. Only the rows changed since the last diff are
+// hashed, and only the part of the diff around them is redone: the hunks
+// before and after are kept, so an edit costs O(hunks) rather than O(rows).
+void editorDiffUpdate(void) {
+  if (!E.buf->diff || E.buf->diff_gen == E.buf->edit_gen)
+    return;
+
+  double start = monotonicMs();
+  long nold = E.buf->diff_nrows, nrows = E.buf->numrows;
+  long lo = E.buf->diff_lo == -1 ? nold : E.buf->diff_lo;
+  lo = MIN(lo, MIN(nold, nrows));
+  long tail = MAX(MIN(E.buf->diff_tail, MIN(nold, nrows) - lo), 0);
+
+  // The hashes of the unchanged rows at the end move with them
+  uint64_t *rows = E.buf->diff_rows;
+  if (rows == NULL || nrows > nold)
+    rows = drealloc(rows, sizeof(uint64_t) * (nrows + 1));
+  memmove(&rows[nrows - tail], &rows[nold - tail], sizeof(uint64_t) * tail);
+  editorHashLines(rows, NULL, lo, nrows - tail);
+  E.buf->diff_rows = rows;
+
+  // Hunks touching the changed rows (in the old numbering) are redone, along
+  // with the rows they span
+  DiffHunk *old = E.buf->diff_hunks;
+  long nhunks = E.buf->diff_nhunks;
+  long hi = nold - tail;
+  long first = 0, last = nhunks;
+  long before = 0, after = 0;
+  while (first < nhunks && old[first].b + old[first].blen < lo) {
+    before += old[first].alen - old[first].blen;
+    first++;
+  }
+  while (last > first && old[last - 1].b > hi) {
+    after += old[last - 1].alen - old[last - 1].blen;
+    last--;
+  }
+  if (first < last) {
+    lo = MIN(lo, old[first].b);
+    hi = MAX(hi, old[last - 1].b + old[last - 1].blen);
+  }
+  long alo = lo + before;
+  long ahi = E.buf->diff_ndisk - (nold - hi) - after;
+  long shift = nrows - nold;
+
+  DiffHunk *mid;
+  long nmid = diff_lines(E.buf->diff_disk + alo, ahi - alo, rows + lo,
+                         hi + shift - lo, &mid);
+  long n = first + nmid + (nhunks - last);
+  DiffHunk *hunks = dmalloc(sizeof(DiffHunk) * (n + 1));
+  memcpy(hunks, old, sizeof(DiffHunk) * first);
+  for (long k = 0; k < nmid; k++) {
+    hunks[first + k] = mid[k];
+    hunks[first + k].a += alo;
+    hunks[first + k].b += lo;
+  }
+  for (long k = last; k < nhunks; k++) {
+    hunks[first + nmid + k - last] = old[k];
+    hunks[first + nmid + k - last].b += shift;
+  }
+  dfree(mid);
+  dfree(old);
+
+  E.buf->diff_hunks = hunks;
+  E.buf->diff_nhunks = n;
+  E.buf->diff_nrows = nrows;
+  E.buf->diff_lo = -1;
+  E.buf->diff_tail = nrows;
+  E.buf->diff_gen = E.buf->edit_gen;
+
+  dlog_debug(E.logger, "Diff of rows %ld to %ld: %ld hunks in %.1f ms", lo,
+             hi + shift, n, monotonicMs() - start);
+}
+
+// Hashes all the rows again, for editorDiffUpdate to diff them all
+void editorDiffRehash(void) {
+  dfree(E.buf->diff_rows);
+  dfree(E.buf->diff_hunks);
+  E.buf->diff_rows = NULL;
+  E.buf->diff_hunks = NULL;
+  E.buf->diff_nrows = 0;
+  E.buf->diff_nhunks = 0;
+  E.buf->diff_lo = 0;
+  E.buf->diff_tail = 0;
+  E.buf->diff_gen = E.buf->edit_gen - 1;
+}
+
+// The rows have just been saved or reloaded, so they're what's on disk
+void editorDiffSynced(void) {
+  if (!E.buf->diff)
+    return;
+
+  dfree(E.buf->diff_disk);
+  E.buf->diff_disk = dmalloc(sizeof(uint64_t) * (E.buf->numrows + 1));
+  E.buf->diff_ndisk = E.buf->numrows;
+  editorHashLines(E.buf->diff_disk, NULL, 0, E.buf->numrows);
+
+  // No hunks, and the rows hash the same
+  editorDiffRehash();
+  E.buf->diff_rows = dmalloc(sizeof(uint64_t) * (E.buf->numrows + 1));
+  memcpy(E.buf->diff_rows, E.buf->diff_disk,
+         sizeof(uint64_t) * E.buf->numrows);
+  E.buf->diff_nrows = E.buf->numrows;
+  E.buf->diff_lo = -1;
+  E.buf->diff_tail = E.buf->numrows;
+  E.buf->diff_gen = E.buf->edit_gen;
+}
+
+void editorDiffStop(void) {
+  E.buf->diff = 0;
+  dfree(E.buf->diff_disk);
+  E.buf->diff_disk = NULL;
+  E.buf->diff_ndisk = 0;
+  editorDiffRehash();
+}
+
+void editorDiffStart(void) {
+  double start = monotonicMs();
+
+  size_t len;
+  char *buf = editorReadFile(E.buf->filename, &len);
+  if (!buf) {
+    editorSetStatusMessage("Cannot diff against %s: %s", E.buf->filename,
+                           strerror(errno));
+    return;
+  }
+
+  TextLine *lines;
+  int exact;
+  E.buf->diff_ndisk = editorSplitLines(buf, len, &lines, &exact);
+  E.buf->diff_disk = dmalloc(sizeof(uint64_t) * (E.buf->diff_ndisk + 1));
+  editorHashLines(E.buf->diff_disk, lines, 0, E.buf->diff_ndisk);
+  dfree(lines);
+  dfree(buf);
+
+  E.buf->diff = 1;
+  editorDiffRehash();
+  editorDiffUpdate();
+
+  long added = 0, deleted = 0;
+  for (long k = 0; k < E.buf->diff_nhunks; k++) {
+    added += E.buf->diff_hunks[k].blen;
+    deleted += E.buf->diff_hunks[k].alen;
+  }
+  editorSetStatusMessage("%ld hunks, +%ld -%ld lines against %s (%.0f ms)",
+                         E.buf->diff_nhunks, added, deleted, E.buf->filename,
+                         monotonicMs() - start);
+}
+
+// First row of a hunk, where a deletion shows too
+int editorDiffHunkRow(DiffHunk *h) {
+  return h->blen == 0 && h->b == E.buf->numrows ? MAX(h->b - 1, 0) : h->b;
+}
+
+// Gutter mark of a row: '+' added, '~' changed, '-' lines deleted before it
+// (or after it, at the end), ' ' if unchanged
+char editorDiffMark(int row) {
+  // Last hunk starting at or before the row
+  long lo = 0, hi = E.buf->diff_nhunks;
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    if (editorDiffHunkRow(&E.buf->diff_hunks[mid]) <= row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return ' ';
+
+  DiffHunk *h = &E.buf->diff_hunks[lo - 1];
+  if (h->blen == 0)
+    return editorDiffHunkRow(h) == row ? '-' : ' ';
+  if (row >= h->b + h->blen)
+    return ' ';
+  return h->alen == 0 ? '+' : '~';
+}
+
+// Moves the cursor E.count (at least 1) hunks forward or backward
+void editorDiffJump(int direction) {
+  if (!E.buf->diff) {
+    editorSetStatusMessage("Not in diff mode (:diff)");
+    return;
+  }
+  editorDiffUpdate();
+
+  int cy = E.buf->cy;
+  for (long n = MAX(E.count, 1); n > 0; n--) {
+    int found = -1;
+    if (direction > 0) {
+      for (long k = 0; k < E.buf->diff_nhunks && found == -1; k++)
+        if (editorDiffHunkRow(&E.buf->diff_hunks[k]) > cy)
+          found = editorDiffHunkRow(&E.buf->diff_hunks[k]);
+    } else {
+      for (long k = E.buf->diff_nhunks - 1; k >= 0 && found == -1; k--)
+        if (editorDiffHunkRow(&E.buf->diff_hunks[k]) < cy)
+          found = editorDiffHunkRow(&E.buf->diff_hunks[k]);
+    }
+    if (found == -1)
+      break;
+    cy = found;
+  }
+
+  if (cy == E.buf->cy) {
+    editorSetStatusMessage(direction > 0 ? "No more hunks below"
+                                         : "No more hunks above");
+    return;
+  }
+  E.buf->cy = cy;
+  E.buf->cx = 0;
+}
+
+/*** syntax ***/
+
+HlRow *editorHlLine(void *ctx, long i, const char **text, int *len) {
+  UNUSED(ctx);
+  *text = E.buf->row[i].chars;
+  *len = E.buf->row[i].size;
+  return &E.buf->row[i].hl;
+}
+
+// Picks the syntax from the file name, dropping the highlight if it changed
+void editorSelectSyntax(void) {
+  const Syntax *syn = E.buf->view ? NULL : syntax_for_file(E.buf->filename);
+  if (syn == E.buf->syntax)
+    return;
+
+  E.buf->syntax = syn;
+  for (int j = 0; j < E.buf->numrows; j++)
+    syntax_free(&E.buf->row[j].hl);
+  E.buf->hl_from = 0;
+}
+
+// Lexes the rows which need it down to the last visible one. An edit only
+// costs the rows until the lexer state matches the cached one again, rows
+// below the screen are lexed once scrolled to.
+void editorSyntaxUpdate(void) {
+  long to = MIN(E.buf->rowoff + E.screenrows, E.buf->numrows);
+  if (!E.buf->syntax)
+    return;
+
+  if (E.buf->hl_from < to) {
+    long lexed =
+        syntax_update(E.buf->syntax, editorHlLine, NULL, E.buf->hl_from, to);
+    dlog_debug(E.logger, "Highlighted rows %ld-%ld, %ld lexed",
+               E.buf->hl_from, to, lexed);
+    E.buf->hl_from = to;
+  }
+
+  // Spans dropped while the buffer was in the background are lexed again from
+  // their cached states as they're shown
+  for (long j = E.buf->rowoff; j < to; j++) {
+    Row *row = &E.buf->row[j];
+    if (row->hl.dropped)
+      syntax_lex(E.buf->syntax, row->chars, row->size, row->hl.start,
+                 &row->hl);
+  }
+}
+
+/*** stdin stream ***/
+
+// Moves the piped stdin to a new descriptor and reopens stdin on the
+// terminal, so that raw mode and key reading keep working. Returns the
+// descriptor of the pipe.
+int editorStdinToTty(void) {
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+  if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    die("/dev/tty");
+  close(tty);
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+void editorStreamStart(int fd) {
+  E.buf->stream_fd = fd;
+  E.buf->stream_bytes = 0;
+  dlog_info(E.logger, "Reading buffer from stdin");
+}
+
+// Appends what's available on the stream, for at most
+// DITTO_STREAM_BUDGET_MS so that keys are still handled while a fast
+// producer keeps the pipe full. Whatever isn't read stays in the pipe,
+// blocking the producer until the next tick.
+// Returns 1 if the buffer changed.
+int editorStreamPoll(void) {
+  if (E.buf->stream_fd == -1)
+    return 0;
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char buf[DITTO_READ_CHUNK];
+  int changed = 0;
+
+  while (1) {
+    ssize_t n = read(E.buf->stream_fd, buf, sizeof(buf));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      break;
+
+    if (n <= 0) {
+      // EOF (or a broken pipe), the buffer is complete
+      close(E.buf->stream_fd);
+      E.buf->stream_fd = -1;
+      E.buf->append_open = 0;
+      editorSetStatusMessage("%d lines (%zu bytes) read from stdin",
+                             E.buf->numrows, E.buf->stream_bytes);
+      return 1;
+    }
+
+    editorAppendChunk(buf, n);
+    E.buf->stream_bytes += n;
+    changed = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000 >=
+        DITTO_STREAM_BUDGET_MS)
+      break;
+  }
+
+  return changed;
+}
+
+/*** pager ***/
+
+// Scans the file from where the last tick stopped, sampling the line index
+// with a block every LI_BLOCK_LINES lines. Runs for at most
+// DITTO_STREAM_BUDGET_MS, so the first screen shows up right away.
+// Returns 1 if more lines are known.
+int editorViewScanPoll(void) {
+  if (!E.buf->view_scanning)
+    return 0;
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char buf[DITTO_READ_CHUNK];
+
+  while (1) {
+    ssize_t n = pread(E.buf->view_fd, buf, sizeof(buf), E.buf->view_scan_off);
+
+    if (n <= 0) {
+      // A last line without newline is a line too
+      if (E.buf->view_scan_off > E.buf->view_block_off)
+        E.buf->view_scan_lines++;
+      if (E.buf->view_scan_lines > 0)
+        li_append_block(E.buf->lineidx, E.buf->view_scan_lines,
+                        E.buf->view_scan_off - E.buf->view_block_off);
+      E.buf->view_block_off = E.buf->view_scan_off;
+      E.buf->view_scan_lines = 0;
+      E.buf->view_scanning = 0;
+      E.buf->numrows = E.buf->lineidx->totlines;
+      editorSetStatusMessage("\"%s\" %d lines, %lld bytes [view]",
+                             E.buf->filename, E.buf->numrows,
+                             (long long)E.buf->view_scan_off);
+      return 1;
+    }
+
+    for (char *p = buf, *end = buf + n;
+         (p = memchr(p, '\n', end - p)) != NULL; p++) {
+      if (++E.buf->view_scan_lines == LI_BLOCK_LINES) {
+        off_t next = E.buf->view_scan_off + (p - buf) + 1;
+        li_append_block(E.buf->lineidx, E.buf->view_scan_lines,
+                        next - E.buf->view_block_off);
+        E.buf->view_block_off = next;
+        E.buf->view_scan_lines = 0;
+      }
+    }
+    E.buf->view_scan_off += n;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000 >=
+        DITTO_STREAM_BUDGET_MS)
+      break;
+  }
+
+  E.buf->numrows = E.buf->lineidx->totlines + E.buf->view_scan_lines;
+  return 1;
+}
+
+// Finds a line at or before the given one with a known offset: the start of
+// its block, or of the block still being scanned
+void editorViewLocate(int at, long *line, off_t *off) {
+  if (at >= E.buf->lineidx->totlines) {
+    *line = E.buf->lineidx->totlines;
+    *off = E.buf->view_block_off;
+    return;
+  }
+
+  size_t offset;
+  li_locate_line(E.buf->lineidx, at, line, &offset);
+  *off = offset;
+}
+
+// Decodes rows [a, b) into the window being built (starting at row first),
+// reading sequentially from the file. The start offset of row a is used if
+// known (>= 0), otherwise it's found through the line index.
+void editorViewDecode(Row *rows, off_t *offs, int first, int a, int b,
+                      off_t start) {
+  long line = a;
+  off_t off = start;
+  if (off < 0)
+    editorViewLocate(a, &line, &off);
+
+  char buf[DITTO_READ_CHUNK];
+  ssize_t n = 0, pos = 0;
+  char *linebuf = dmalloc(DITTO_VIEW_MAX_LINE);
+  size_t linelen = 0;
+  off_t linestart = off;
+
+  while (line < b) {
+    if (pos == n) {
+      n = pread(E.buf->view_fd, buf, sizeof(buf), off);
+      pos = 0;
+      if (n <= 0)
+        n = 0;
+    }
+
+    // Length of what's left of the line in the buffer
+    char *nl = n ? memchr(buf + pos, '\n', n - pos) : NULL;
+    ssize_t seg = nl ? nl - (buf + pos) : n - pos;
+
+    if (line >= a) {
+      // Lines are truncated to keep the memory of the window bounded
+      size_t take = MIN((size_t)seg, DITTO_VIEW_MAX_LINE - linelen);
+      memcpy(linebuf + linelen, buf + pos, take);
+      linelen += take;
+    }
+    pos += seg;
+    off += seg;
+
+    // The line ends at a newline, or at EOF
+    if (nl || n == 0) {
+      if (nl) {
+        pos++;
+        off++;
+      }
+      if (line >= a) {
+        while (linelen > 0 && linebuf[linelen - 1] == '\r')
+          linelen--;
+        Row *row = &rows[line - first];
+        row->size = linelen;
+        row->chars = dmalloc(linelen + 1);
+        row->slice = NULL;
+        memcpy(row->chars, linebuf, linelen);
+        row->chars[linelen] = '\0';
+        row->rsize = 0;
+        row->cols = NULL;
+        row->ncols = 0;
+        row->colcap = 0;
+        row->hl = (HlRow){NULL, 0, 0, 0, 0, 0};
+        row->wraps = NULL;
+        editorUpdateRow(row);
+        offs[line - first] = linestart;
+      }
+      line++;
+      linelen = 0;
+      linestart = off;
+    }
+  }
+
+  offs[b - first] = off;
+  dfree(linebuf);
+}
+
+// Moves the window of decoded rows so that it's centered around the row.
+// Rows shared with the previous window are kept, the others are freed.
+void editorViewPage(int at) {
+  int len = MIN(DITTO_VIEW_ROWS, E.buf->numrows);
+  int first = MAX(MIN(at - len / 2, E.buf->numrows - len), 0);
+
+  Row *rows = dmalloc(sizeof(Row) * MAX(len, 1));
+  off_t *offs = dmalloc(sizeof(off_t) * (len + 1));
+
+  int keep_from = MAX(first, E.buf->view_first);
+  int keep_to = MIN(first + len, E.buf->view_first + E.buf->view_len);
+
+  for (int j = 0; j < E.buf->view_len; j++) {
+    int r = E.buf->view_first + j;
+    if (r >= keep_from && r < keep_to)
+      rows[r - first] = E.buf->row[j];
+    else
+      editorFreeRow(&E.buf->row[j]);
+  }
+
+  if (keep_from < keep_to) {
+    for (int r = keep_from; r <= keep_to; r++)
+      offs[r - first] = E.buf->view_offs[r - E.buf->view_first];
+    editorViewDecode(rows, offs, first, first, keep_from, -1);
+    editorViewDecode(rows, offs, first, keep_to, first + len,
+                     offs[keep_to - first]);
+  } else {
+    editorViewDecode(rows, offs, first, first, first + len, -1);
+  }
+
+  dfree(E.buf->row);
+  dfree(E.buf->view_offs);
+  E.buf->row = E.buf->rowbuf = rows;
+  E.buf->rowcap = len;
+  E.buf->view_offs = offs;
+  E.buf->view_first = first;
+  E.buf->view_len = len;
+}
+
+// Opens the file read-only as a pager: only the line index and a window of
+// DITTO_VIEW_ROWS rows around the viewport are kept in memory
+void editorViewOpen(const char *filename) {
+  E.buf->view_fd = open(filename, O_RDONLY);
+  if (E.buf->view_fd == -1)
+    die("open");
+
+  dfree(E.buf->filename);
+  E.buf->filename = dstrdup(filename);
+  E.buf->view = 1;
+  E.buf->view_scanning = 1;
+
+  // No trigram index: its postings grow with the file, which would break the
+  // memory bound
+  editorViewScanPoll();
+}
+
+/*** trace ***/
+
+// Writes the spans recorded to path, or to DITTO_TRACE_FILE if NULL
+void editorTraceWrite(const char *path) {
+  char def[64];
+  if (path == NULL) {
+    snprintf(def, sizeof(def), DITTO_TRACE_FILE, (int)getpid());
+    path = def;
+  }
+  if (trace_write(path) == -1) {
+    editorSetStatusMessage("Can't write the trace to %s: %s", path,
+                           strerror(errno));
+    return;
+  }
+  editorSetStatusMessage("Trace of %zu spans written to %s", trace_count(),
+                         path);
+}
+
+void editorTraceStart(void) {
+  trace_start(DITTO_TRACE_SPANS);
+  editorSetStatusMessage("Tracing frames");
+}
+
+// SIGUSR1 starts tracing, and once started writes the trace
+void editorTraceSignal(void) {
+  E.trace_signal = 0;
+  if (trace_enabled)
+    editorTraceWrite(NULL);
+  else
+    editorTraceStart();
+}
+
+/*** events ***/
+
+// Waits up to the key timeout for the terminal, or any other event source,
+// to be readable. Returns 1 if a key can be read.
+int editorWaitInput(void) {
+  // Keys pushed back, or typed by a script
+  if (term_pending(E.term))
+    return 1;
+
+  // The terminal, the I/O backend, and the stream and watch of every buffer
+  if (E.pollcap < 2 + 2 * E.nbufs) {
+    E.pollcap = 2 + 2 * E.nbufs;
+    E.pollfds = drealloc(E.pollfds, sizeof(struct pollfd) * E.pollcap);
+  }
+  struct pollfd *fds = E.pollfds;
+  int nfds = 0;
+  int timeout = DITTO_EVENTS_TIMEOUT_MS;
+
+  // A headless terminal has no descriptor, which poll skips
+  fds[nfds].fd = term_fd(E.term);
+  fds[nfds++].events = POLLIN;
+  for (int j = 0; j < E.nbufs; j++) {
+    Buffer *b = E.bufs[j];
+    if (b->stream_fd != -1) {
+      fds[nfds].fd = b->stream_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    if (b->watch_fd != -1) {
+      fds[nfds].fd = b->watch_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    // Scanning, or catching up with a followed file, isn't waiting on
+    // anything, just keep it going
+    if (b->view_scanning || b->follow_behind)
+      timeout = 0;
+  }
+  if (E.aio && aio_inflight(E.aio) > 0) {
+    fds[nfds].fd = aio_fd(E.aio);
+    fds[nfds++].events = POLLIN;
+  }
+
+  return poll(fds, nfds, timeout) > 0 && (fds[0].revents & POLLIN);
+}
+
+// Handles the events of the buffer, which may not be the current one.
+// Returns 1 if it changed.
+int editorBufferEvents(Buffer *b) {
+  Buffer *cur = editorBufferBegin(b);
+  int changed = 0;
+  if (E.buf->follow)
+    changed |= editorFollowPoll();
+  else if (E.buf->watch_fd != -1)
+    changed |= editorWatchPoll();
+  if (E.buf->stream_fd != -1)
+    changed |= editorStreamPoll();
+  if (E.buf->view_scanning)
+    changed |= editorViewScanPoll();
+  editorBufferEnd(cur);
+  return changed;
+}
+
+// Handles everything that isn't a key press while waiting for one.
+// Returns 1 if the screen needs to be redrawn.
+int editorProcessEvents(void) {
+  int redraw = E.screen_resized;
+
+  if (E.trace_signal) {
+    editorTraceSignal();
+    redraw = 1;
+  }
+  // The :stats overlay is kept live
+  if (E.stats.shown && monotonicMs() - E.stats.drawn_at >= DITTO_STATS_MS)
+    redraw = 1;
+  // Buffers in the background keep following, reading and loading
+  for (int j = 0; j < E.nbufs; j++)
+    redraw |= editorBufferEvents(E.bufs[j]);
+  if (E.aio && aio_inflight(E.aio) > 0)
+    redraw |= editorAioDispatch(0) > 0;
+  editorJournalSync(0);
+
+  return redraw;
+}
+
+/*** search ***/
+
+// Finds the pattern in the row, considering only matches starting in
+// [from, to], the first one going forward or the last one going backward.
+// Returns the match position or -1.
+int editorFindInRow(Row *row, const char *pat, int from, int to,
+                    int direction) {
+  int found = -1;
+  if (from < 0)
+    from = 0;
+
+  for (char *p = row->chars + MIN(from, row->size);
+       (p = strstr(p, pat)) != NULL && p - row->chars <= to; p++) {
+    found = p - row->chars;
+    if (direction > 0)
+      break;
+  }
+
+  return found;
+}
+
+// Moves the cursor to the next (direction > 0) or previous match of the last
+// searched pattern, wrapping around the file.
+// If the trigram index is ready and the buffer matches the file on disk, only
+// the candidate rows are verified instead of scanning every row.
+void editorFind(int direction) {
+  if (!E.search || E.buf->numrows == 0) {
+    editorMacroFail();
+    return;
+  }
+
+  const char *pat = E.search;
+  int cy = MIN(E.buf->cy, E.buf->numrows - 1);
+  int col;
+
+  // Rest of the current row first
+  Row *row = editorRowAt(cy);
+  col = direction > 0 ? editorFindInRow(row, pat, E.buf->cx + 1, row->size, 1)
+                      : editorFindInRow(row, pat, 0, E.buf->cx - 1, -1);
+  if (col != -1) {
+    E.buf->cx = col;
+    return;
+  }
+
+  uint32_t *cand = NULL;
+  long ncand = -1;
+  TrigramIndex *t = editorTrigramIndex();
+  if (t && !E.buf->dirty && !E.buf->view_scanning &&
+      t->nrows == (uint32_t)E.buf->numrows)
+    ncand = tri_candidates(t, pat, strlen(pat), &cand);
+
+  // Rows to visit, the current one is the last (wrapping around)
+  long count = ncand >= 0 ? ncand : E.buf->numrows;
+  long start;
+  if (ncand >= 0) {
+    // First candidate after the current row (lower bound)
+    long lo = 0, hi = ncand;
+    while (lo < hi) {
+      long mid = (lo + hi) / 2;
+      if (cand[mid] < (uint32_t)cy)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (direction > 0)
+      start = (lo < ncand && cand[lo] == (uint32_t)cy) ? lo + 1 : lo;
+    else
+      start = lo - 1;
+  } else {
+    start = cy + direction;
+  }
+
+  for (long k = 0; k < count; k++) {
+    long idx = ((start + direction * k) % count + count) % count;
+    int r = ncand >= 0 ? (int)cand[idx] : (int)idx;
+    if (r >= E.buf->numrows)
+      continue;
+
+    row = editorRowAt(r);
+    col = editorFindInRow(row, pat, 0, row->size, direction);
+    if (col != -1) {
+      E.buf->cy = r;
+      E.buf->cx = col;
+      dfree(cand);
+      return;
+    }
+  }
+
+  dfree(cand);
+  editorSetStatusMessage("Pattern not found: %s", pat);
+  editorMacroFail();
+}
+
+void editorSearch(void) {
+  char *pat = editorPrompt("/%s");
+  if (pat == NULL)
+    return;
+
+  dfree(E.search);
+  E.search = pat;
+  editorFind(1);
+}
+
+/*** soft wrap ***/
+
+// Screen lines of the row at the current width: exact once its wrap points
+// are computed, estimated from its width otherwise, which is exact unless
+// wide characters or tabs straddle a break. Rows off the screen are never
+// wrapped.
+size_t editorWrapLines(void *ctx, long line) {
+  UNUSED(ctx);
+  Row *row = &E.buf->row[line];
+  if (row->wrap_cols == E.screencols)
+    return row->nwraps + 1;
+  int width = row->rsize == -1 ? row->size : row->rsize;
+  return width <= E.screencols ? 1
+                               : (width + E.screencols - 1) / E.screencols;
+}
+
+// Computes the wrap points of the row for the current width, unless cached
+void editorWrapRow(long at) {
+  Row *row = &E.buf->row[at];
+  int width = MAX(E.screencols, 1);
+  if (row->wrap_cols == width)
+    return;
+
+  size_t lines = editorWrapLines(NULL, at);
+  dfree(row->wraps);
+  row->wraps = NULL;
+  row->nwraps = 0;
+
+  if (row->plain) {
+    row->nwraps = row->size > 0 ? (row->size - 1) / width : 0;
+  } else {
+    // A character which doesn't fit goes to the next line whole
+    int cap = 0, start = 0, col = 0;
+    for (int j = 0; j < row->size;) {
+      int w = editorRowCharWidth(row, j, col);
+      if (col + w - start > width && col > start) {
+        if (row->nwraps == cap) {
+          cap = cap ? cap * 2 : 4;
+          row->wraps = drealloc(row->wraps, sizeof(ColMark) * cap);
+        }
+        row->wraps[row->nwraps++] = (ColMark){j, col};
+        start = col;
+      }
+      col += w;
+      j = utf8_next(row->chars, row->size, j);
+    }
+  }
+
+  row->wrap_cols = width;
+  if ((size_t)row->nwraps + 1 != lines)
+    li_touch(E.buf->wrapidx, at);
+}
+
+// Rows break at the width of the window: the screen lines of every row change
+// if it's not the one wrapidx was built for. The index of a width seen
+// before is kept up to date by the edits, otherwise the oldest one is
+// rebuilt for it.
+void editorWrapFit(void) {
+  if (!E.buf->wrapidx || E.buf->wrap_width == E.screencols)
+    return;
+
+  int k = 0;
+  while (k < DITTO_WRAP_WIDTHS && E.buf->wrapidxs[k] &&
+         E.buf->wrap_widths[k] != E.screencols)
+    k++;
+  if (k == DITTO_WRAP_WIDTHS) {
+    k = E.buf->wrap_next;
+    E.buf->wrap_next = (k + 1) % DITTO_WRAP_WIDTHS;
+    li_build(E.buf->wrapidxs[k], E.buf->numrows);
+  } else if (!E.buf->wrapidxs[k]) {
+    E.buf->wrapidxs[k] = li_create(editorWrapLines, NULL);
+    li_build(E.buf->wrapidxs[k], E.buf->numrows);
+  }
+  E.buf->wrap_widths[k] = E.screencols;
+  E.buf->wrapidx = E.buf->wrapidxs[k];
+  E.buf->wrap_width = E.screencols;
+}
+
+// First and last columns of screen line k of the row
+void editorWrapSegment(Row *row, int k, int *from, int *to) {
+  if (row->plain) {
+    *from = k * row->wrap_cols;
+    *to = k == row->nwraps ? row->rsize : *from + row->wrap_cols;
+    return;
+  }
+  *from = k == 0 ? 0 : row->wraps[k - 1].col;
+  *to = k == row->nwraps ? editorRowWidth(row) : row->wraps[k].col;
+}
+
+// Screen line of the row with the byte at cx
+int editorWrapIndex(Row *row, int cx) {
+  if (row->plain)
+    return MIN(cx / row->wrap_cols, row->nwraps);
+
+  int lo = 0, hi = row->nwraps;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->wraps[mid].byte <= cx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Keeps the cursor on the screen counting screen lines, with the prefix sums
+// of wrapidx to go from rows to screen lines and back in O(log n)
+void editorScrollWrapped(void) {
+  E.buf->coloff = 0;
+  E.buf->rowoff = MIN(E.buf->rowoff, E.buf->numrows);
+
+  int sub = 0, from = 0, to;
+  if (E.buf->cy < E.buf->numrows) {
+    editorWrapRow(E.buf->cy);
+    sub = editorWrapIndex(&E.buf->row[E.buf->cy], E.buf->cx);
+    editorWrapSegment(&E.buf->row[E.buf->cy], sub, &from, &to);
+  }
+
+  long cursor = li_line_to_offset(E.buf->wrapidx, E.buf->cy) + sub;
+  long top =
+      li_line_to_offset(E.buf->wrapidx, E.buf->rowoff) + E.buf->rowoff_sub;
+  if (cursor < top)
+    top = cursor;
+  if (cursor >= top + E.screenrows)
+    top = cursor - E.screenrows + 1;
+
+  size_t rowoff_sub = 0;
+  if (E.buf->cy >= E.buf->numrows && cursor == top) {
+    // The empty line past the end is the first on the screen
+    E.buf->rowoff = E.buf->numrows;
+  } else {
+    E.buf->rowoff = li_offset_to_line(E.buf->wrapidx, top, &rowoff_sub);
+  }
+  E.buf->rowoff_sub = rowoff_sub;
+
+  E.buf->wrap_y = cursor - top;
+  E.buf->wrap_x = E.buf->rx - from;
+}
+
+/*** append buffer ***/
+
+void abAppend(AppendBuffer *ab, const char *s, int len) {
+  char *new = drealloc(ab->b, ab->len + len);
+
+  if (new == NULL)
+    die("drealloc");
+
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+void abFree(AppendBuffer *ab) { dfree(ab->b); }
+
+/*** visual ***/
+
+// Ordered bounds of the selection, the end excluded. Returns 0 if there's
+// nothing to select.
+int editorVisualRange(int *sy, int *sx, int *ey, int *ex) {
+  if (E.buf->numrows == 0)
+    return 0;
+  int ay = MIN(E.vis_y, E.buf->numrows - 1), ax = E.vis_x;
+  int by = MIN(E.buf->cy, E.buf->numrows - 1), bx = E.buf->cx;
+  if (ay > by || (ay == by && ax > bx)) {
+    int t = ay;
+    ay = by;
+    by = t;
+    t = ax;
+    ax = bx;
+    bx = t;
+  }
+
+  *sy = ay;
+  *ey = by;
+  if (E.vis_line) {
+    *sx = 0;
+    *ex = E.buf->row[by].size;
+  } else {
+    // The character under the end is selected too
+    Row *row = &E.buf->row[by];
+    *sx = MIN(ax, E.buf->row[ay].size);
+    *ex = bx < row->size ? editorRowNext(row, bx) : row->size;
+  }
+  return 1;
+}
+
+// Selected columns of a row, the end excluded. Returns 0 if the row isn't
+// selected. Only the rows drawn are asked for, so the cost doesn't depend on
+// the size of the selection.
+int editorVisualColumns(int filerow, Row *row, int *from, int *to) {
+  int sy, sx, ey, ex;
+  if (E.mode != VISUAL_MODE || !editorVisualRange(&sy, &sx, &ey, &ex) ||
+      filerow < sy || filerow > ey)
+    return 0;
+  *from = filerow == sy ? editorRowCxToRx(row, sx) : 0;
+  *to = filerow == ey ? editorRowCxToRx(row, ex) : INT_MAX;
+  return 1;
+}
+
+// Deletes the text from (sy, sx) to (ey, ex), the rows in between at once
+void editorDeleteRange(int sy, int sx, int ey, int ex) {
+  Row *row = &E.buf->row[sy];
+  if (sy == ey) {
+    editorRowDeleteChars(row, sx, ex - sx);
+    return;
+  }
+  editorRowTruncate(row, sx);
+  editorRowAppendString(row, &E.buf->row[ey].chars[ex],
+                        E.buf->row[ey].size - ex);
+  editorDeleteRows(sy + 1, ey - sy);
+}
+
+// Shifts the rows [sy, ey] right by width spaces, or left by as much of
+// their leading spaces, or a tab
+void editorShiftRows(int sy, int ey, int width) {
+  char spaces[DITTO_SHIFT_WIDTH * 8];
+  memset(spaces, ' ', sizeof(spaces));
+  for (int y = sy; y <= ey; y++) {
+    Row *row = &E.buf->row[y];
+    if (width > 0) {
+      if (row->size > 0)
+        for (int w = width; w > 0; w -= sizeof(spaces))
+          editorRowInsertChars(row, 0, spaces, MIN(w, (int)sizeof(spaces)));
+    } else {
+      int n = 0;
+      while (n < row->size && n < -width && row->chars[n] == ' ')
+        n++;
+      if (n == 0 && row->size > 0 && row->chars[0] == '\t')
+        n = 1;
+      editorRowDeleteChars(row, 0, n);
+    }
+  }
+}
+
+// Joins the rows [sy, ey] into sy as J does in vim: the leading whitespace
+// of each joined row is replaced by a single space. The joined text is
+// appended at once.
+void editorJoinRows(int sy, int ey) {
+  if (ey == sy)
+    ey = sy + 1;
+  if (ey >= E.buf->numrows)
+    return;
+
+  AppendBuffer ab = ABUF_INIT;
+  Row *row = &E.buf->row[sy];
+  int trailing =
+      row->size > 0 && isspace((unsigned char)row->chars[row->size - 1]);
+  int cx = row->size;
+  for (int y = sy + 1; y <= ey; y++) {
+    Row *r = &E.buf->row[y];
+    int a = 0;
+    while (a < r->size && isspace((unsigned char)r->chars[a]))
+      a++;
+    if (a == r->size)
+      continue;
+    cx = row->size + ab.len;
+    if (!trailing && (row->size > 0 || ab.len > 0)) {
+      abAppend(&ab, " ", 1);
+      cx++;
+    }
+    abAppend(&ab, &r->chars[a], r->size - a);
+    trailing = isspace((unsigned char)r->chars[r->size - 1]);
+  }
+
+  editorRowAppendString(row, ab.b, ab.len);
+  abFree(&ab);
+  editorDeleteRows(sy + 1, ey - sy);
+  E.buf->cy = sy;
+  E.buf->cx = editorRowSnap(row, MIN(cx, MAX(row->size - 1, 0)));
+}
+
+// Runs an operator (y, d, >, < or J) on the selection
+void editorVisualApply(int op) {
+  int sy, sx, ey, ex;
+  if (!editorVisualRange(&sy, &sx, &ey, &ex))
+    return;
+
+  long lines = ey - sy + 1;
+  switch (op) {
+  case KEY_y:
+    editorYankRange(sy, sx, ey, ex, !E.vis_line);
+    E.buf->cy = sy;
+    E.buf->cx = sx;
+    editorSetStatusMessage("Yanked %ld lines", lines);
+    break;
+  case KEY_d:
+    editorYankRange(sy, sx, ey, ex, !E.vis_line);
+    if (E.vis_line) {
+      editorDeleteRows(sy, lines);
+      E.buf->cy = MIN(sy, MAX(E.buf->numrows - 1, 0));
+      E.buf->cx = 0;
+    } else {
+      editorDeleteRange(sy, sx, ey, ex);
+      E.buf->cy = sy;
+      E.buf->cx = sx;
+    }
+    if (lines > 1)
+      editorSetStatusMessage("Deleted %ld lines", lines);
+    break;
+  case KEY_GT:
+  case KEY_LT: {
+    long width = MIN(MAX(E.count, 1), 100) * DITTO_SHIFT_WIDTH;
+    editorShiftRows(sy, ey, op == KEY_GT ? width : -width);
+    E.buf->cy = sy;
+    E.buf->cx = 0;
+    break;
+  }
+  case KEY_J:
+    editorJoinRows(sy, ey);
+    break;
+  }
+}
+
+/*** buffers ***/
+
+// Adds an empty buffer to the list
+Buffer *editorBufferNew(void) {
+  Buffer *b = dmalloc(sizeof(Buffer));
+  b->cx = 0;
+  b->rx = 0;
+  b->cy = 0;
+  b->ry = 0;
+  b->rowoff = 0;
+  b->coloff = 0;
+  b->numrows = 0;
+  b->row = NULL;
+  b->rowbuf = NULL;
+  b->rowcap = 0;
+  b->lineidx = li_create(editorLineLength, NULL);
+  b->dirty = 0;
+  b->dirty_row = -1;
+  b->dirty_col = 0;
+  b->file_exact = 0;
+  b->crlf = 0;
+  b->file_size = 0;
+  b->file_mtime = 0;
+  b->edit_gen = 0;
+  b->diff = 0;
+  b->diff_disk = NULL;
+  b->diff_ndisk = 0;
+  b->diff_rows = NULL;
+  b->diff_nrows = 0;
+  b->diff_lo = -1;
+  b->diff_tail = 0;
+  b->diff_hunks = NULL;
+  b->diff_nhunks = 0;
+  b->diff_gen = 0;
+  b->syntax = NULL;
+  b->hl_from = 0;
+  b->wrap = 0;
+  b->wrapidx = NULL;
+  b->wrap_width = 0;
+  memset(b->wrapidxs, 0, sizeof(b->wrapidxs));
+  b->wrap_next = 0;
+  b->rowoff_sub = 0;
+  b->wrap_x = 0;
+  b->wrap_y = 0;
+  b->filename = NULL;
+  b->trigram = NULL;
+  b->trigram_pending = NULL;
+  b->trigram_gen = 0;
+  pthread_mutex_init(&b->trigram_lock, NULL);
+  b->trigram_building = 0;
+  b->follow = 0;
+  b->follow_fd = -1;
+  b->follow_off = 0;
+  b->follow_behind = 0;
+  b->watch_fd = -1;
+  b->watch_name = NULL;
+  b->append_open = 0;
+  b->stream_fd = -1;
+  b->stream_bytes = 0;
+  b->view = 0;
+  b->view_fd = -1;
+  b->view_first = 0;
+  b->view_len = 0;
+  b->view_offs = NULL;
+  b->view_scanning = 0;
+  b->view_scan_off = 0;
+  b->view_block_off = 0;
+  b->view_scan_lines = 0;
+  b->journal = NULL;
+  b->journal_path = NULL;
+  b->journal_synced = 0;
+  b->journal_enabled = 1;
+  b->loading = 0;
+  b->load_fd = -1;
+  b->load_size = 0;
+  b->load_next = 0;
+  b->load_off = 0;
+  b->load_pending = 0;
+  b->load_reqs = NULL;
+  b->load_exact = 0;
+  b->load_start = 0;
+
+  E.bufs = drealloc(E.bufs, sizeof(Buffer *) * (E.nbufs + 1));
+  E.bufs[E.nbufs++] = b;
+  return b;
+}
+
+// Frees what's only needed to draw the rows of a buffer in the background:
+// column indexes and highlight spans. The highlight states are kept, so only
+// the rows drawn are lexed again.
+void editorBufferDropCaches(Buffer *b) {
+  for (int j = 0; j < b->numrows; j++) {
+    Row *row = &b->row[j];
+    syntax_drop(&row->hl);
+    dfree(row->cols);
+    row->cols = NULL;
+    row->ncols = 0;
+    row->colcap = 0;
+    if (!row->plain)
+      row->rsize = -1;
+  }
+}
+
+// Settles the current buffer before another one is made current: its journal
+// is synced, as only the current buffer is edited. Its load and other events
+// go on in the background.
+void editorBufferSettle(void) { editorJournalSync(1); }
+
+// Window showing b other than the current one, NULL if none
+Window *editorBufferWindow(Buffer *b) {
+  for (int j = 0; j < E.nwins; j++)
+    if (E.wins[j]->buf == b && E.wins[j] != E.win)
+      return E.wins[j];
+  return NULL;
+}
+
+// Makes b the buffer worked on, to handle its events while it isn't the
+// current one, at the position of a window showing it if any. Returns the
+// buffer to give back to editorBufferEnd.
+Buffer *editorBufferBegin(Buffer *b) {
+  Buffer *cur = E.buf;
+  if (b == cur)
+    return cur;
+
+  E.buf = b;
+  Window *w = E.win && b != E.win->buf ? editorBufferWindow(b) : NULL;
+  if (w) {
+    b->cx = w->cx;
+    b->cy = w->cy;
+    b->rowoff = w->rowoff;
+    b->coloff = w->coloff;
+    b->rowoff_sub = w->rowoff_sub;
+  }
+  return cur;
+}
+
+// Goes back to the buffer worked on before editorBufferBegin, keeping the
+// position in the window showing the buffer left
+void editorBufferEnd(Buffer *cur) {
+  if (E.buf == cur)
+    return;
+
+  Window *w =
+      E.win && E.buf != E.win->buf ? editorBufferWindow(E.buf) : NULL;
+  if (w)
+    editorWindowLeave(w);
+  E.buf = cur;
+}
+
+int editorBufferShown(Buffer *b) {
+  for (int j = 0; j < E.nwins; j++)
+    if (E.wins[j]->buf == b)
+      return 1;
+  return 0;
+}
+
+// Buffer n (cyclically) after the current one
+Buffer *editorBufferNext(int n) {
+  int cur = 0;
+  while (E.bufs[cur] != E.buf)
+    cur++;
+  return E.bufs[((cur + n) % E.nbufs + E.nbufs) % E.nbufs];
+}
+
+// First buffer with unsaved changes, NULL if there's none
+Buffer *editorBufferDirty(void) {
+  for (int j = 0; j < E.nbufs; j++)
+    if (E.bufs[j]->dirty)
+      return E.bufs[j];
+  return NULL;
+}
+
+/*** windows ***/
+
+// A window on the buffer, at its cursor and scroll position. Splits are
+// created without a buffer.
+Window *editorWindowNew(Buffer *b) {
+  Window *w = dmalloc(sizeof(Window));
+  w->parent = NULL;
+  w->kids[0] = NULL;
+  w->kids[1] = NULL;
+  w->vertical = 0;
+  w->buf = b;
+  w->cx = b ? b->cx : 0;
+  w->cy = b ? b->cy : 0;
+  w->rowoff = b ? b->rowoff : 0;
+  w->coloff = b ? b->coloff : 0;
+  w->rowoff_sub = b ? b->rowoff_sub : 0;
+  w->top = 0;
+  w->left = 0;
+  w->height = 0;
+  w->width = 0;
+  w->lines = NULL;
+  w->drawn_gen = 0;
+  return w;
+}
+
+// Makes the buffer of the window the one edited and drawn, at the cursor and
+// scroll position of the window, and the screen that of its text area
+void editorWindowEnter(Window *w) {
+  E.buf = w->buf;
+  E.buf->cx = w->cx;
+  E.buf->cy = w->cy;
+  E.buf->rowoff = w->rowoff;
+  E.buf->coloff = w->coloff;
+  E.buf->rowoff_sub = w->rowoff_sub;
+  E.screenrows = MAX(w->height - 1, 1);
+  E.screencols = MAX(w->width - editorGetLineNumberWidth(), 1);
+
+  // Rows may have been deleted from another window on the buffer
+  E.buf->cy = MIN(E.buf->cy, E.buf->numrows);
+  editorClampCursor();
+  editorWrapFit();
+}
+
+// Keeps the cursor and scroll position of the buffer in the window
+void editorWindowLeave(Window *w) {
+  w->cx = w->buf->cx;
+  w->cy = w->buf->cy;
+  w->rowoff = w->buf->rowoff;
+  w->coloff = w->buf->coloff;
+  w->rowoff_sub = w->buf->rowoff_sub;
+}
+
+void editorWindowPlace(Window *w, int top, int left, int height, int width) {
+  w->top = top;
+  w->left = left;
+  w->height = height;
+  w->width = width;
+
+  if (w->kids[0] == NULL) {
+    // Nothing is known of what's on the screen there
+    w->lines = drealloc(w->lines, sizeof(uint64_t) * MAX(height, 1));
+    memset(w->lines, 0, sizeof(uint64_t) * MAX(height, 1));
+    w->drawn_gen = w->buf->edit_gen - 1;
+    E.wins = drealloc(E.wins, sizeof(Window *) * (E.nwins + 1));
+    E.wins[E.nwins++] = w;
+    return;
+  }
+
+  // A vertical split leaves a column for the separator
+  if (w->vertical) {
+    int a = (width - 1) / 2;
+    editorWindowPlace(w->kids[0], top, left, height, a);
+    editorWindowPlace(w->kids[1], top, left + a + 1, height, width - a - 1);
+  } else {
+    int a = height / 2;
+    editorWindowPlace(w->kids[0], top, left, a, width);
+    editorWindowPlace(w->kids[1], top + a, left, height - a, width);
+  }
+}
+
+// Divides the screen between the windows, all of which are drawn again. The
+// message bar takes the last line.
+void editorWindowLayout(void) {
+  editorWindowLeave(E.win);
+  E.nwins = 0;
+  editorWindowPlace(E.root, 0, 0, E.termrows - 1, E.termcols);
+  editorWindowEnter(E.win);
+}
+
+// Makes b the buffer of the current window, at the position it was last
+// left. The buffer left keeps only what's needed to be drawn again if no
+// other window shows it.
+void editorBufferSwitch(Buffer *b) {
+  if (b == E.buf)
+    return;
+
+  editorBufferSettle();
+  Buffer *left = E.buf;
+  E.win->buf = b;
+  editorWindowLeave(E.win);
+  editorWindowEnter(E.win);
+  if (!editorBufferShown(left))
+    editorBufferDropCaches(left);
+}
+
+void editorBufferInfo(void) {
+  editorSetStatusMessage("\"%s\" %d lines%s",
+                         E.buf->filename ? E.buf->filename : "[No Name]",
+                         E.buf->numrows, E.buf->dirty ? " [Modified]" : "");
+}
+
+void editorWindowFocus(Window *w) {
+  if (w == E.win)
+    return;
+
+  editorWindowLeave(E.win);
+  if (w->buf != E.buf)
+    editorBufferSettle();
+  // The status line of the window left no longer shows the mode
+  E.win->drawn_gen = E.buf->edit_gen - 1;
+  E.win = w;
+  editorWindowEnter(w);
+}
+
+// Splits the current window in two on its buffer, the new one above it (or
+// on its left) taking the cursor
+void editorWindowSplit(int vertical) {
+  Window *w = E.win;
+  int room = vertical ? (w->width - 1) / 2 - editorGetLineNumberWidth()
+                      : w->height / 2 - 1;
+  if (room < 1) {
+    editorSetStatusMessage("Not enough room");
+    return;
+  }
+
+  editorWindowLeave(w);
+  Window *split = editorWindowNew(NULL);
+  split->vertical = vertical;
+  split->parent = w->parent;
+  if (w->parent)
+    w->parent->kids[w->parent->kids[0] == w ? 0 : 1] = split;
+  else
+    E.root = split;
+
+  E.win = editorWindowNew(w->buf);
+  split->kids[0] = E.win;
+  split->kids[1] = w;
+  E.win->parent = split;
+  w->parent = split;
+  editorWindowLayout();
+}
+
+// Closes the current window, its sibling taking its place, and moves to the
+// window next to it. Returns 0 if it's the last one.
+int editorWindowClose(void) {
+  Window *w = E.win, *split = w->parent;
+  if (split == NULL)
+    return 0;
+
+  int first = split->kids[0] == w;
+  Window *sibling = split->kids[first ? 1 : 0];
+  sibling->parent = split->parent;
+  if (split->parent)
+    split->parent->kids[split->parent->kids[0] == split ? 0 : 1] = sibling;
+  else
+    E.root = sibling;
+
+  Window *next = sibling;
+  while (next->kids[0])
+    next = next->kids[first ? 0 : 1];
+  if (next->buf != E.buf)
+    editorBufferSettle();
+
+  Buffer *left = E.buf;
+  dfree(w->lines);
+  dfree(w);
+  dfree(split);
+  E.win = next;
+  editorWindowEnter(next);
+  editorWindowLayout();
+  if (!editorBufferShown(left))
+    editorBufferDropCaches(left);
+  return 1;
+}
+
+// Window next to the current one in the direction of the arrow, NULL if
+// there's none
+Window *editorWindowNear(int key) {
+  Window *c = E.win;
+  for (int j = 0; j < E.nwins; j++) {
+    Window *w = E.wins[j];
+    int rows = w->top <= c->top && c->top < w->top + w->height;
+    int cols = w->left <= c->left && c->left <= w->left + w->width;
+    if ((key == ARROW_LEFT && rows && w->left + w->width + 1 == c->left) ||
+        (key == ARROW_RIGHT && rows && c->left + c->width + 1 == w->left) ||
+        (key == ARROW_UP && cols && w->top + w->height == c->top) ||
+        (key == ARROW_DOWN && cols && c->top + c->height == w->top))
+      return w;
+  }
+  return NULL;
+}
+
+// Ctrl-W commands: w moves to the next window, h/j/k/l (or the arrows) to the
+// one in that direction, s and v split the window and c closes it
+void editorWindowCommand(int c) {
+  switch (c) {
+  case KEY_w:
+  case CTRL_KEY('w'): {
+    int cur = 0;
+    while (E.wins[cur] != E.win)
+      cur++;
+    editorWindowFocus(E.wins[(cur + 1) % E.nwins]);
+    break;
+  }
+  case KEY_h:
+  case KEY_j:
+  case KEY_k:
+  case KEY_l:
+  case ARROW_LEFT:
+  case ARROW_DOWN:
+  case ARROW_UP:
+  case ARROW_RIGHT: {
+    int key = c == KEY_h   ? ARROW_LEFT
+              : c == KEY_j ? ARROW_DOWN
+              : c == KEY_k ? ARROW_UP
+              : c == KEY_l ? ARROW_RIGHT
+                           : c;
+    Window *w = editorWindowNear(key);
+    if (w)
+      editorWindowFocus(w);
+    break;
+  }
+  case KEY_s:
+  case KEY_v:
+    editorWindowSplit(c == KEY_v);
+    break;
+  case KEY_c:
+    if (!editorWindowClose())
+      editorSetStatusMessage("Cannot close last window");
+    break;
+  }
+}
+
+/*** stats ***/
+
+// Records a frame written, and the latency of the command it shows
+void editorStatsFrame(size_t bytes) {
+  Stats *s = &E.stats;
+  double now = monotonicMs();
+  double lat = s->key_at ? now - s->key_at : -1;
+  if (lat >= 0)
+    hist_record(s->latency, (uint64_t)(lat * 1000));
+  s->key_at = 0;
+
+  size_t allocs = alloc_count();
+  s->frames++;
+  s->bytes += bytes;
+  s->allocs += allocs - s->last_allocs;
+  s->last_allocs = allocs;
+  if (now - s->period_start >= DITTO_STATS_MS) {
+    s->fps = s->frames * 1000 / (now - s->period_start);
+    s->bytes_per_frame = (double)s->bytes / s->frames;
+    s->allocs_per_frame = (double)s->allocs / s->frames;
+    s->period_start = now;
+    s->frames = 0;
+    s->bytes = 0;
+    s->allocs = 0;
+  }
+
+  if (E.bench.enabled)
+    editorBenchFrame(bytes, lat);
+}
+
+// Draws the :stats overlay in the top right corner, over the windows
+void editorDrawStats(AppendBuffer *ab) {
+  Stats *s = &E.stats;
+  char lines[8][32];
+  int n = 0;
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %12llu ", "keys",
+           (unsigned long long)hist_count(s->latency));
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %9.3f ms ", "latency p50",
+           hist_quantile(s->latency, 0.5) / 1000.0);
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %9.3f ms ", "latency p99",
+           hist_quantile(s->latency, 0.99) / 1000.0);
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %9.3f ms ", "latency max",
+           hist_max(s->latency) / 1000.0);
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %12.1f ", "fps", s->fps);
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %12.0f ", "bytes/frame",
+           s->bytes_per_frame);
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %12.1f ", "allocs/frame",
+           s->allocs_per_frame);
+  snprintf(lines[n++], sizeof(lines[0]), " %-12s %9.1f MB ", "memory",
+           used_memory() / (1024.0 * 1024.0));
+
+  int width = strlen(lines[0]);
+  if (E.termcols < width || E.termrows < n + 2)
+    return;
+  for (int y = 0; y < n; y++) {
+    char pos[32];
+    abAppend(ab, pos,
+             snprintf(pos, sizeof(pos), "\x1b[%d;%dH", y + 1,
+                      E.termcols - width + 1));
+    abAppend(ab, COLORS_INVERT_ON, COLORS_INVERT_ON_SZ);
+    abAppend(ab, lines[y], width);
+    abAppend(ab, COLORS_INVERT_OFF, COLORS_INVERT_OFF_SZ);
+  }
+  s->drawn_at = monotonicMs();
+}
+
+/*** output ***/
+
+void editorScroll(void) {
+  E.buf->rx = 0;
+
+  // Horizontal scroll based on rendered chars
+  if (E.buf->cy < E.buf->numrows) {
+    E.buf->rx = editorRowCxToRx(editorRowAt(E.buf->cy), E.buf->cx);
+  }
+
+  if (E.buf->wrap) {
+    editorScrollWrapped();
+    return;
+  }
+
+  // Cursor is above visible window
+  if (E.buf->cy < E.buf->rowoff) {
+    // Align file offset to the cursor
+    E.buf->rowoff = E.buf->cy;
+  }
+
+  // Cursor is below visible window
+  if (E.buf->cy >= E.buf->rowoff + E.screenrows) {
+    // Align file offset to the cursor + the y-size of the screen
+    E.buf->rowoff = E.buf->cy - E.screenrows + 1;
+  }
+
+  // Handle rendered difference of x position of the cursor
+  if (E.buf->rx < E.buf->coloff) {
+    E.buf->coloff = E.buf->rx;
+  }
+  if (E.buf->rx >= E.buf->coloff + E.screencols) {
+    E.buf->coloff = E.buf->rx - E.screencols + 1;
+  }
+}
+
+static const char *const hl_colors[] = {
+    [HL_NORMAL] = COLORS_FG_DEFAULT, [HL_COMMENT] = COLORS_FG_CYAN,
+    [HL_STRING] = COLORS_FG_MAGENTA, [HL_NUMBER] = COLORS_FG_RED,
+    [HL_KEYWORD] = COLORS_FG_YELLOW, [HL_TYPE] = COLORS_FG_GREEN,
+    [HL_PREPROC] = COLORS_FG_BLUE,
+};
+
+// Appends the columns [from, from + len) of a plain ASCII row, where they're
+// the bytes, coloring the spans which intersect them
+void editorDrawPlain(AppendBuffer *ab, Row *row, int from, int len) {
+  if (!E.buf->syntax || row->hl.nspans == 0) {
+    abAppend(ab, &row->chars[from], len);
+    return;
+  }
+
+  HlSpan *spans = row->hl.spans;
+  int end = from + len, pos = from;
+
+  // First span ending past the start of the window
+  int lo = 0, hi = row->hl.nspans;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((int)(spans[mid].start + spans[mid].len) <= from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (int s = lo; s < row->hl.nspans && (int)spans[s].start < end; s++) {
+    int a = MAX((int)spans[s].start, from);
+    int b = MIN((int)(spans[s].start + spans[s].len), end);
+    if (a > pos)
+      abAppend(ab, &row->chars[pos], a - pos);
+    abAppend(ab, hl_colors[spans[s].cls], COLORS_FG_SZ);
+    abAppend(ab, &row->chars[a], b - a);
+    abAppend(ab, COLORS_FG_DEFAULT, COLORS_FG_DEFAULT_SZ);
+    pos = b;
+  }
+  if (end > pos)
+    abAppend(ab, &row->chars[pos], end - pos);
+}
+
+// Appends the columns [from, from + len) of a row with tabs or UTF-8, a
+// character at a time, walking from the nearest entry of the column index:
+// the cost doesn't depend on the length of the row. Tabs, and wide
+// characters cut by the edges of the window, are drawn as blanks, invalid
+// bytes as '?'. Returns the number of columns drawn.
+int editorDrawColumns(AppendBuffer *ab, Row *row, int from, int len) {
+  int end = from + len;
+
+  // First character ending past the start of the window
+  ColMark m = editorRowMark(row, from, 1);
+  int j = m.byte, col = m.col;
+  while (j < row->size) {
+    int w = editorRowCharWidth(row, j, col);
+    if (col >= from || col + w > from)
+      break;
+    col += w;
+    j = utf8_next(row->chars, row->size, j);
+  }
+
+  HlSpan *spans = row->hl.spans;
+  int nspans = E.buf->syntax ? row->hl.nspans : 0;
+  int lo = 0, hi = nspans;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((int)(spans[mid].start + spans[mid].len) <= j)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int s = lo, cls = HL_NORMAL;
+
+  int x = from;
+  while (j < row->size && x < end) {
+    int w = editorRowCharWidth(row, j, col);
+    int next = utf8_next(row->chars, row->size, j);
+
+    while (s < nspans && (int)(spans[s].start + spans[s].len) <= j)
+      s++;
+    int c = s < nspans && (int)spans[s].start <= j ? (int)spans[s].cls
+                                                   : HL_NORMAL;
+    if (c != cls) {
+      abAppend(ab, hl_colors[c], COLORS_FG_SZ);
+      cls = c;
+    }
+
+    uint32_t cp;
+    int n = utf8_decode(&row->chars[j], row->size - j, &cp);
+    if (row->chars[j] == '\t' || col < from || col + w > end) {
+      for (; x < MIN(col + w, end); x++)
+        abAppend(ab, " ", 1);
+    } else if (cp == 0xFFFD && n == 1 && (unsigned char)row->chars[j] >= 0x80) {
+      abAppend(ab, "?", 1);
+      abAppend(ab, &row->chars[j + 1], next - j - 1);
+      x += w;
+    } else {
+      abAppend(ab, &row->chars[j], next - j);
+      x += w;
+    }
+    col += w;
+    j = next;
+  }
+
+  if (cls != HL_NORMAL)
+    abAppend(ab, COLORS_FG_DEFAULT, COLORS_FG_DEFAULT_SZ);
+  return x - from;
+}
+
+// Appends the columns [from, from + len) of a row, returning how many there
+// were
+int editorDrawRange(AppendBuffer *ab, Row *row, int from, int len) {
+  if (len > 0 && !row->plain)
+    return editorDrawColumns(ab, row, from, len);
+  if (len > 0)
+    editorDrawPlain(ab, row, from, len);
+  return MAX(len, 0);
+}
+
+// Appends line y of the window to the frame, unless it's the one already on
+// the terminal. The line is padded to the width of the window, and followed
+// by the separator from the window on its right if there's one.
+void editorDrawLine(AppendBuffer *ab, Window *w, int y, AppendBuffer *line,
+                    int cols) {
+  if (w->left + w->width >= E.termcols) {
+    abAppend(line, ERASE_LINE_RIGHT, ERASE_LINE_RIGHT_SZ);
+  } else {
+    for (; cols < w->width; cols++)
+      abAppend(line, " ", 1);
+    abAppend(line, "|", 1);
+  }
+
+  uint64_t hash = diff_hash(line->b, line->len) | 1;
+  if (w->lines[y] != hash) {
+    char pos[32];
+    int len = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", w->top + y + 1,
+                       w->left + 1);
+    abAppend(ab, pos, len);
+    abAppend(ab, line->b, line->len);
+    w->lines[y] = hash;
+  }
+  line->len = 0;
+}
+
+// Draws the text area of the window entered
+void editorDrawRows(AppendBuffer *ab, Window *w) {
+  AppendBuffer line = ABUF_INIT;
+  // Row on the screen line, and which of its screen lines in soft wrap mode
+  int filerow = E.buf->rowoff;
+  int sub = E.buf->wrap ? E.buf->rowoff_sub : 0;
+
+  for (int y = 0; y < E.screenrows; y++) {
+    int cols = 0;
+
+    // Print the line number, blank on the lines of a wrapped row
+    if (DITTO_LINENO_ENABLED && filerow < E.buf->numrows && sub > 0) {
+      abAppend(&line, "     ", editorGetLineNumberWidth());
+      cols = editorGetLineNumberWidth();
+    } else if (DITTO_LINENO_ENABLED && filerow < E.buf->numrows) {
+      char num[16];
+      snprintf(num, sizeof(num), "%4d", filerow + 1);
+      abAppend(&line, num, strlen(num));
+
+      // In diff mode the separator marks the changed rows
+      char mark = E.buf->diff ? editorDiffMark(filerow) : ' ';
+      if (mark != ' ') {
+        abAppend(&line,
+                 mark == '+'   ? COLORS_FG_GREEN
+                 : mark == '-' ? COLORS_FG_RED
+                               : COLORS_FG_YELLOW,
+                 COLORS_FG_SZ);
+        abAppend(&line, &mark, 1);
+        abAppend(&line, COLORS_FG_DEFAULT, COLORS_FG_DEFAULT_SZ);
+      } else {
+        abAppend(&line, " ", 1);
+      }
+      cols = editorGetLineNumberWidth();
+    }
+
+    // If we are at the end of the file
+    if (filerow >= (int)E.buf->numrows) {
+      abAppend(&line, "~", 1);
+      cols++;
+
+      // Welcome message if no content or no file loaded
+      if (E.buf->numrows == 0 && y == E.screenrows / 2) {
+        char wlc[20];
+        int l = snprintf(wlc, sizeof(wlc), "Ditto -- %s", DITTO_VERSION);
+        // Cut in narrow windows
+        int pad = MAX((E.screencols - l) / 2, 0);
+        l = MAX(MIN(l, E.screencols - pad - 1), 0);
+        char msg[E.screencols + 1];
+        memset(msg, ' ', pad);
+        memcpy(msg + pad, wlc, l);
+        abAppend(&line, msg, pad + l);
+        cols += pad + l;
+      }
+    } else {
+      // Print the row otherwise, considering the column offset
+      Row *row = editorRowAt(filerow);
+      // The width of rows which aren't plain isn't needed, they're only
+      // walked for the visible columns
+      int from = E.buf->coloff, to = row->plain ? row->size : INT_MAX;
+      if (E.buf->wrap) {
+        editorWrapRow(filerow);
+        editorWrapSegment(row, sub, &from, &to);
+      }
+      int len = to - from;
+      if (len < 0)
+        len = 0;
+      if (len > E.screencols)
+        len = E.screencols;
+
+      // Inverts the part of the visual selection on the screen, which only
+      // the current window shows
+      int a, b;
+      if (len > 0 && w == E.win && editorVisualColumns(filerow, row, &a, &b)) {
+        a = MIN(MAX(a, from), from + len);
+        b = MIN(MAX(b, a), from + len);
+        cols += editorDrawRange(&line, row, from, a - from);
+        abAppend(&line, COLORS_INVERT_ON, COLORS_INVERT_ON_SZ);
+        cols += editorDrawRange(&line, row, a, b - a);
+        abAppend(&line, COLORS_INVERT_OFF, COLORS_INVERT_OFF_SZ);
+        cols += editorDrawRange(&line, row, b, from + len - b);
+      } else {
+        cols += editorDrawRange(&line, row, from, len);
+      }
+    }
+
+    editorDrawLine(ab, w, y, &line, cols);
+
+    if (E.buf->wrap && filerow < E.buf->numrows &&
+        sub < E.buf->row[filerow].nwraps) {
+      sub++;
+    } else {
+      filerow++;
+      sub = 0;
+    }
+  }
+  abFree(&line);
+}
+
+// Draws the status line of the window entered, the mode only shown in the
+// current one
+void editorDrawStatusBar(AppendBuffer *ab, Window *w) {
+  AppendBuffer line = ABUF_INIT;
+  abAppend(&line, COLORS_INVERT_ON, COLORS_INVERT_ON_SZ);
+  char status[80];
+  char rstatus[80];
+
+  char recording[16] = "";
+  if (E.macro_reg && w == E.win)
+    snprintf(recording, sizeof(recording), " recording @%c", E.macro_reg);
+
+  const char *mode = w != E.win ? ""
+                     : E.mode == VISUAL_MODE && E.vis_line ? "V-LINE"
+                                                           : mode_str[E.mode];
+  int len = snprintf(status, sizeof(status), " %s%s%s %.20s %s%s",
+                     COLORS_BOLD_ON, mode, COLORS_BOLD_OFF,
+                     E.buf->filename ? E.buf->filename : "[No Name]",
+                     E.buf->dirty ? "(edited)" : "", recording);
+
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d ", E.buf->cy + 1,
+                      E.buf->rx + 1);
+
+  // Remove not visible chars from count
+  int nonprintable = 0;
+  nonprintable += COLORS_BOLD_ON_SZ + COLORS_BOLD_OFF_SZ;
+
+  // Visible chars counting
+  int vizlen = len - nonprintable;
+
+  // Use the full width of the window (add back line number width)
+  int fullwidth = E.screencols + editorGetLineNumberWidth();
+
+  // Handle overflow of the statusbar content, the position is kept
+  rlen = MIN(rlen, fullwidth);
+  if (vizlen > fullwidth - rlen)
+    vizlen = fullwidth - rlen;
+
+  // Assumption: I append the statusbar, but if too long, truncate it,
+  // remembering to add the nonprintable chars of the mode, which we assume
+  // are always there
+  abAppend(&line, status, vizlen + nonprintable);
+
+  // Fill the rest of the statusbar with spaces
+  while (vizlen + rlen < fullwidth) {
+    abAppend(&line, " ", 1);
+    vizlen++;
+  }
+
+  abAppend(&line, rstatus, rlen);
+
+  abAppend(&line, COLORS_ALL_OFF, COLORS_ALL_OFF_SZ);
+  editorDrawLine(ab, w, E.screenrows, &line, fullwidth);
+  abFree(&line);
+}
+
+void editorDrawMessageBar(AppendBuffer *ab) {
+  char pos[32];
+  abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;1H", E.termrows));
+  abAppend(ab, ERASE_LINE_RIGHT, ERASE_LINE_RIGHT_SZ);
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.termcols)
+    msglen = E.termcols;
+  if (msglen && time(NULL) - E.statusmsg_time < DITTO_STATUSMSG_SEC) {
+    abAppend(ab, E.statusmsg, msglen);
+  }
+}
+
+void editorRefreshScreen(void) {
+  // Macros are replayed without drawing, the result is drawn once at the end
+  if (E.replay_depth)
+    return;
+
+  int64_t frame = trace_begin(), t;
+  AppendBuffer ab = ABUF_INIT;
+
+  // Handle screen resize
+  if (E.screen_resized) {
+    updateScreenSize();
+    E.screen_resized = 0;
+  }
+
+  // To avoid cursor flickering, hide the cursor before drawing and show it
+  // later again
+  abAppend(&ab, HIDE_CURSOR, HIDE_CURSOR_SZ);
+
+  // A window other than the current one is only drawn again if its buffer
+  // changed, and of any window only the lines which changed are written
+  editorWindowLeave(E.win);
+  for (int j = 0; j < E.nwins; j++) {
+    Window *w = E.wins[j];
+    if (w != E.win && w->drawn_gen == w->buf->edit_gen)
+      continue;
+
+    editorWindowEnter(w);
+    t = trace_begin();
+    editorScroll();
+    trace_end("scroll", t);
+    t = trace_begin();
+    editorDiffUpdate();
+    editorSyntaxUpdate();
+    trace_end("syntax", t);
+    t = trace_begin();
+    editorDrawRows(&ab, w);
+    editorDrawStatusBar(&ab, w);
+    trace_end("draw", t);
+    w->drawn_gen = E.buf->edit_gen;
+    editorWindowLeave(w);
+  }
+  editorWindowEnter(E.win);
+  // Other windows on the buffer moved its screen position of the cursor
+  t = trace_begin();
+  editorScroll();
+  trace_end("scroll", t);
+
+  editorDrawMessageBar(&ab);
+  if (E.stats.shown)
+    editorDrawStats(&ab);
+
+  char buf[32];
+
+  // Position cursor based on input mode
+  if (E.input_mode) {
+    // Cursor in message bar (last line of terminal)
+    int row = E.termrows;
+    // Calculate column: prompt length + buffer length + 1
+    // For prompt format like "Filename to save to: %s", we need to find where
+    // %s is
+    int col = 1; // Start at column 1
+
+    if (E.input_prompt) {
+      // Calculate visible prompt length
+      char prompt_formatted[256];
+      snprintf(prompt_formatted, sizeof(prompt_formatted), E.input_prompt, "");
+      col = strlen(prompt_formatted) + 1;
+    }
+
+    // Add buffer length for cursor position
+    col += E.input_buffer_len;
+
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row, col);
+  } else {
+    // Cursor in editor at normal position
+    int y = E.buf->wrap ? E.buf->wrap_y : E.buf->cy - E.buf->rowoff;
+    int x = E.buf->wrap ? E.buf->wrap_x : E.buf->rx - E.buf->coloff;
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.win->top + y + 1,
+             E.win->left + x + editorGetLineNumberWidth() + 1);
+  }
+
+  abAppend(&ab, buf, strlen(buf));
+
+  abAppend(&ab, SHOW_CURSOR, SHOW_CURSOR_SZ);
+
+  t = trace_begin();
+  term_write(E.term, ab.b, ab.len);
+  trace_end("write", t);
+  editorStatsFrame(ab.len);
+  abFree(&ab);
+  trace_end("frame", frame);
+}
+
+/*** input ***/
+
+char *editorPrompt(char *prompt) {
+  // Enter input mode and use the global input buffer
+  E.input_mode = 1;
+  E.input_prompt = prompt;
+  E.input_buffer_len = 0;
+  E.input_buffer[0] = '\0';
+  term_write(E.term, CURSOR_BAR_BLINK, CURSOR_BAR_BLINK_SZ);
+
+  while (1) {
+    editorSetStatusMessage(prompt, E.input_buffer);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+
+    if (c == CTRL_KEY('c') || c == KEY_ESC) {
+      editorSetStatusMessage("");
+      E.input_mode = 0;
+      E.input_prompt = NULL;
+      E.input_buffer_len = 0;
+      return NULL;
+    }
+
+    if (c == KEY_BACKSPACE) {
+      if (E.input_buffer_len > 0) {
+        E.input_buffer[--E.input_buffer_len] = '\0';
+      }
+      continue;
+    }
+
+    if (c == '\r') {
+      if (E.input_buffer_len > 0) {
+        editorSetStatusMessage("");
+        E.input_mode = 0;
+        E.input_prompt = NULL;
+        E.input_buffer_len = 0;
+        // Return a copy of the buffer
+        return dstrdup(E.input_buffer);
+      }
+    }
+
+    if (!iscntrl(c) && c < 256) { // Is printable character or UTF-8
+      // Expand buffer if needed
+      if (E.input_buffer_len >= E.input_buffer_size - 1) {
+        E.input_buffer_size *= 2;
+        E.input_buffer = drealloc(E.input_buffer, E.input_buffer_size);
+      }
+      E.input_buffer[E.input_buffer_len++] = c;
+      E.input_buffer[E.input_buffer_len] = '\0';
+    }
+  }
+}
+
+void editorChangeMode(enum editorMode mode) {
+  enum editorMode old_mode = E.mode;
+  E.mode = mode;
+
+  // Clean up message bar if exiting command mode
+  if (old_mode == COMMAND_MODE && mode != COMMAND_MODE) {
+    E.input_mode = 0;
+    E.input_prompt = NULL;
+    E.input_buffer_len = 0;
+  }
+
+  if (mode == COMMAND_MODE) {
+    // Entering command mode - set up input state
+    E.input_mode = 1;
+    E.input_prompt = ":";
+    E.input_buffer_len = 0;
+    E.input_buffer[0] = '\0';
+    editorSetStatusMessage(":%s", E.input_buffer);
+  }
+  editorSetCursorShape();
+}
+
+// Changes cursor style based on mode, once a macro replay is over
+void editorSetCursorShape(void) {
+  if (E.replay_depth)
+    return;
+  if (E.mode == INSERT_MODE || E.mode == COMMAND_MODE)
+    term_write(E.term, CURSOR_BAR_BLINK, CURSOR_BAR_BLINK_SZ);
+  else
+    term_write(E.term, CURSOR_BLOCK, CURSOR_BLOCK_SZ);
+}
+
+// Avoid ending up in an invalid x-position through vertical movements across
+// lines with different size, or in the middle of a character
+void editorClampCursor(void) {
+  Row *row = (E.buf->cy >= E.buf->numrows) ? NULL : editorRowAt(E.buf->cy);
+  int rowlen = row ? row->size : 0;
+  if (E.buf->cx > rowlen)
+    E.buf->cx = rowlen;
+  if (row)
+    E.buf->cx = editorRowSnap(row, E.buf->cx);
+}
+
+void editorMoveCursor(int key) {
+  // Current row can be a valid one or the first "empty" line at the end
+  Row *row = (E.buf->cy >= E.buf->numrows) ? NULL : editorRowAt(E.buf->cy);
+
+  switch (key) {
+  case KEY_0:
+    E.buf->cx = 0;
+    break;
+
+  case ARROW_DOWN:
+  case KEY_j:
+    if (E.buf->cy < E.buf->numrows - 1) {
+      E.buf->cy++;
+    }
+    break;
+
+  case ARROW_UP:
+  case KEY_k:
+    if (E.buf->cy > 0) {
+      E.buf->cy--;
+    }
+    break;
+
+  case ARROW_LEFT:
+  case KEY_h:
+    if (row && E.buf->cx > 0) {
+      E.buf->cx = editorRowPrev(row, E.buf->cx);
+    }
+    break;
+
+  case ARROW_RIGHT:
+  case KEY_l:
+    // Limit right scrolling
+    if (row && E.buf->cx < row->size) {
+      E.buf->cx = editorRowNext(row, E.buf->cx);
+    }
+    break;
+
+  // Go to first printable character in the current line
+  case KEY_I: {
+    int p;
+    for (p = 0; p < row->size && isspace(row->chars[p]); p++)
+      ;
+    E.buf->cx = p;
+    break;
+  }
+
+  // Move to the end of next word
+  case KEY_e: {
+    // NULL or empty row check
+    if (!row || row->size == 0)
+      break;
+
+    // Already at or past end of line
+    if (E.buf->cx >= row->size - 1)
+      break;
+
+    // 1. Skip spaces to find start of next word/token
+    while (E.buf->cx < row->size - 1 &&
+           getCharFamily(row->chars[E.buf->cx]) == CHAR_FAMILY_SPACES) {
+      E.buf->cx++;
+    }
+
+    // Reached end of line while skipping spaces
+    if (E.buf->cx >= row->size - 1)
+      break;
+
+    // 2. Check if we're at the end of a word (current char != next char family)
+    int family = getCharFamily(row->chars[E.buf->cx]);
+    int nextfamily = getCharFamily(row->chars[E.buf->cx + 1]);
+
+    if (nextfamily != family) {
+      // Move to next character (start of next word/token)
+      E.buf->cx++;
+      if (E.buf->cx >= row->size - 1)
+        break;
+
+      // Skip spaces if that's what we landed on
+      if (nextfamily == CHAR_FAMILY_SPACES) {
+        while (E.buf->cx < row->size - 1 &&
+               getCharFamily(row->chars[E.buf->cx]) == CHAR_FAMILY_SPACES) {
+          E.buf->cx++;
+        }
+        if (E.buf->cx >= row->size - 1)
+          break;
+        nextfamily = getCharFamily(row->chars[E.buf->cx]);
+      }
+
+      // Move to end of current word
+      while (E.buf->cx < row->size - 1 &&
+             getCharFamily(row->chars[E.buf->cx + 1]) == nextfamily) {
+        E.buf->cx++;
+      }
+    } else {
+      // 3. We're inside a word, move to its end
+      while (E.buf->cx < row->size - 1 &&
+             getCharFamily(row->chars[E.buf->cx + 1]) == family) {
+        E.buf->cx++;
+      }
+    }
+
+    break;
+  }
+
+  // Move to the beginning of the previous word
+  case KEY_b: {
+    break;
+  }
+
+  // Move to the start of next word
+  case KEY_w: {
+    int p;
+    int old = getCharFamily(row->chars[E.buf->cx]);
+
+    for (p = E.buf->cx + 1; p < row->size; p++) {
+      char c = (row->chars[p]);
+      int new = getCharFamily(c);
+      if (old != new && new != CHAR_FAMILY_SPACES) {
+        E.buf->cx = p;
+        break;
+      }
+      old = new;
+    }
+    break;
+  }
+
+  // Full right
+  case KEY_L:
+    // TODO: Will need to move to the file line end, not the editor line end
+    E.buf->cx = MAX(0, row->size - 1);
+    break;
+  // Full left
+  case KEY_H:
+    E.buf->cx = 0;
+    break;
+  // Fast down
+  case KEY_J:
+    E.buf->cy = MIN(E.buf->cy + 5, E.buf->numrows - 1);
+    break;
+  // Fast up
+  case KEY_K:
+    E.buf->cy = MAX(E.buf->cy - 5, 0);
+    break;
+
+  // TODO: Need to move to top document, not just first editor row
+  // Go top of doc
+  case CMD_GO_TOP_DOC:
+    E.buf->cy = 0;
+    break;
+  // Go bottom of doc
+  case CMD_GO_BOTTOM_DOC:
+    E.buf->cy = E.buf->numrows - 1;
+    break;
+  // Go to line, clamped to the document
+  case CMD_GO_LINE:
+    E.buf->cy = MAX(MIN(E.count, E.buf->numrows) - 1, 0);
+    break;
+  // Go to the line and column of a byte offset, found through the line index
+  case CMD_GO_OFFSET: {
+    size_t col;
+    E.buf->cy = li_offset_to_line(E.buf->lineidx, E.count, &col);
+    E.buf->cx = col;
+    break;
+  }
+  }
+
+  editorClampCursor();
+}
+
+// Moves the cursor as key does n times, as far as possible. Vertical moves
+// jump there at once, the others stop as soon as the cursor doesn't move. A
+// motion which can't move at all fails.
+void editorMoveCursorCount(int key, long n) {
+  long step = (key == KEY_J || key == KEY_K) ? 5 : 1;
+  int cx = E.buf->cx, cy = E.buf->cy;
+  switch (key) {
+  case ARROW_DOWN:
+  case KEY_j:
+  case KEY_J:
+    if (E.buf->cy < E.buf->numrows - 1)
+      E.buf->cy = MIN(E.buf->cy + n * step, E.buf->numrows - 1);
+    editorClampCursor();
+    break;
+  case ARROW_UP:
+  case KEY_k:
+  case KEY_K:
+    E.buf->cy = MAX(E.buf->cy - n * step, 0);
+    editorClampCursor();
+    break;
+  default:
+    for (; n > 0; n--) {
+      int x = E.buf->cx, y = E.buf->cy;
+      editorMoveCursor(key);
+      if (E.buf->cx == x && E.buf->cy == y)
         break;
+    }
+  }
+
+  if (E.buf->cx == cx && E.buf->cy == cy)
+    editorMacroFail();
+}
+
+void destroyEditor(void) { dlog_close(E.logger); }
+
+void editorQuit(void) {
+  for (int j = 0; j < E.nbufs; j++) {
+    E.buf = E.bufs[j];
+    editorJournalClose();
+  }
+  term_write(E.term, CLEAR_SCREEN, CLEAR_SCREEN_SZ);
+  term_write(E.term, REPOS_CURSOR, REPOS_CURSOR_SZ);
+  exit(0);
+}
+
+// Normal mode keys which modify the buffer (or enter a mode that does)
+int editorIsEditKey(int c) {
+  switch (c) {
+  case KEY_i:
+  case KEY_I:
+  case KEY_a:
+  case KEY_A:
+  case KEY_o:
+  case KEY_O:
+  case KEY_x:
+  case KEY_X:
+  case KEY_p:
+  case KEY_P:
+  case KEY_d:
+  case KEY_y:
+  case KEY_v:
+  case KEY_V:
+    return 1;
+  }
+  return 0;
+}
+
+void editorProcessKeypressNormalMode(int c) {
+  static int quit_times = DITTO_QUIT_TIMES;
+
+  int cc = 0;
+
+  // Count prefix, '0' is a motion unless a count is being typed
+  if (isdigit(c) && (c != KEY_0 || E.count > 0)) {
+    E.count = MIN(E.count * 10 + (c - '0'), DITTO_MAX_COUNT);
+    return;
+  }
+
+  if (editorIsEditKey(c) && !editorCheckWritable()) {
+    E.count = 0;
+    return;
+  }
+
+  switch (c) {
+  case CTRL_KEY('c'):
+    if (editorBufferDirty() && quit_times > 1) {
+      editorSetStatusMessage("Unsaved changes. Press Ctrl-C again to quit.");
+      quit_times--;
+      return;
+    }
+    editorQuit();
+    break;
+  case CTRL_KEY('s'):
+    editorSave();
+    break;
+  case CTRL_KEY('w'):
+    editorWindowCommand(editorReadSequenceKey());
+    break;
+  case KEY_ESC:
+    editorChangeMode(NORMAL_MODE);
+    break;
+  case KEY_i:
+    editorChangeMode(INSERT_MODE);
+    break;
+  case KEY_v:
+  case KEY_V:
+    E.vis_y = E.buf->cy;
+    E.vis_x = E.buf->cx;
+    E.vis_line = c == KEY_V;
+    editorChangeMode(VISUAL_MODE);
+    break;
+  case KEY_COLON:
+    editorChangeMode(COMMAND_MODE);
+    break;
+  case ARROW_UP:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case ARROW_DOWN:
+  case KEY_j:
+  case KEY_k:
+  case KEY_h:
+  case KEY_l:
+  case KEY_J:
+  case KEY_K:
+  case KEY_H:
+  case KEY_L:
+    editorMoveCursorCount(c, MAX(E.count, 1));
+    break;
+
+  case KEY_0:
+    editorMoveCursor(KEY_0);
+    break;
+
+  case KEY_a:
+    editorMoveCursor(ARROW_RIGHT);
+    editorChangeMode(INSERT_MODE);
+    break;
+
+  case KEY_A:
+    editorMoveCursor(KEY_L);
+    editorMoveCursor(ARROW_RIGHT);
+    editorChangeMode(INSERT_MODE);
+    break;
+
+  case KEY_b:
+  case KEY_e:
+  case KEY_w:
+    editorMoveCursorCount(c, MAX(E.count, 1));
+    break;
+
+  case KEY_o:
+    editorInsertRow(E.buf->cy + 1, "", 0);
+    editorMoveCursor(ARROW_DOWN);
+    editorChangeMode(INSERT_MODE);
+    break;
+
+  case KEY_I:
+    editorMoveCursor(KEY_I);
+    editorChangeMode(INSERT_MODE);
+    break;
+
+  case KEY_O:
+    editorInsertRow(E.buf->cy, "", 0);
+    editorMoveCursor(KEY_0);
+    editorChangeMode(INSERT_MODE);
+    break;
+
+  case KEY_x:
+  case KEY_X:
+    editorDeleteCharsAtCursor(MAX(E.count, 1), c == KEY_X);
+    break;
+
+  case KEY_y:
+    cc = editorReadSequenceKey();
+    switch (cc) {
+    case KEY_y: {
+      long n = editorYank(E.buf->cy, MAX(E.count, 1));
+      editorSetStatusMessage("Yanked %ld lines", n);
+      break;
+    }
+    default:
+      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
+      break;
+    }
+    break;
+
+  case KEY_p:
+  case KEY_P:
+    editorPutAtCursor(c == KEY_p, MAX(E.count, 1));
+    break;
+
+  case KEY_q:
+    if (E.macro_reg) {
+      editorMacroStop();
+      break;
+    }
+    cc = editorReadSequenceKey();
+    if (editorRegister(cc) && cc != KEY_DQUOTE)
+      editorMacroStart(cc);
+    break;
+
+  case KEY_AT: {
+    long times = MAX(E.count, 1);
+    cc = editorReadSequenceKey();
+    E.count = 0;
+    editorMacroReplay(cc, times);
+    break;
+  }
+
+  case KEY_DQUOTE:
+    // Select the register for the next command, keeping the count
+    cc = editorReadSequenceKey();
+    if (editorRegister(cc)) {
+      E.reg_sel = cc;
+      return;
+    }
+    dlog_debug(E.logger, "no register '%c'", cc);
+    break;
+
+  case KEY_RBRACKET:
+  case KEY_LBRACKET:
+    cc = editorReadSequenceKey();
+    if (cc == KEY_c)
+      editorDiffJump(c == KEY_RBRACKET ? 1 : -1);
+    else
+      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
+    break;
+  case KEY_d:
+    cc = editorReadSequenceKey();
+    switch (cc) {
+    case KEY_d:
+      if (E.buf->cy < E.buf->numrows) {
+        long n = editorYank(E.buf->cy, MAX(E.count, 1));
+        editorDeleteRows(E.buf->cy, n);
+        E.buf->cy = MIN(E.buf->cy, MAX(E.buf->numrows - 1, 0));
+        E.buf->cx = 0;
+        if (n > 1)
+          editorSetStatusMessage("Deleted %ld lines", n);
       }
-      old = new;
+      break;
+    default:
+      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
+      break;
+    }
+    break;
+
+  case KEY_G:
+    editorMoveCursor(E.count ? CMD_GO_LINE : CMD_GO_BOTTOM_DOC);
+    break;
+
+  case KEY_SLASH:
+    editorSearch();
+    break;
+
+  case KEY_n:
+    editorFind(1);
+    break;
+
+  case KEY_N:
+    editorFind(-1);
+    break;
+
+  case KEY_g:
+    cc = editorReadSequenceKey();
+    switch (cc) {
+    case KEY_g:
+      editorMoveCursor(CMD_GO_TOP_DOC);
+      break;
+    default:
+      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
+      break;
     }
     break;
   }
 
-  // Full right
-  case KEY_L:
-    // TODO: Will need to move to the file line end, not the editor line end
-    E.cx = MAX(0, E.row[E.cy].size - 1);
+  E.count = 0;
+  E.reg_sel = KEY_DQUOTE;
+  quit_times = DITTO_QUIT_TIMES;
+}
+
+void editorProcessKeypressInsertMode(int c) {
+  switch (c) {
+  case KEY_ESC:
+    editorChangeMode(NORMAL_MODE);
     break;
-  // Full left
-  case KEY_H:
-    E.cx = 0;
+  case '\r':
+    editorInsertNewline();
     break;
-  // Fast down
-  case KEY_J:
-    E.cy = MIN(E.cy + 5, E.numrows - 1);
+  case CTRL_KEY('s'):
+    editorSave();
     break;
-  // Fast up
-  case KEY_K:
-    E.cy = MAX(E.cy - 5, 0);
+  case KEY_BACKSPACE:
+    editorDeleteChar();
+    break;
+  case CTRL_KEY('l'):
+    // case '\x1b':
+    break;
+  case ARROW_UP:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case ARROW_DOWN:
+    editorMoveCursor(c);
+    break;
+  default:
+    // Only insert printable characters (ASCII 32-126) and the bytes of
+    // UTF-8 sequences (128-255)
+    // 9 is tab
+    // 32 is space
+    if (c == KEY_TAB || (c >= 32 && c <= 126) || (c >= 128 && c <= 255)) {
+      editorInsertChar(c);
+    }
     break;
+  }
+}
 
-  // TODO: Need to move to top document, not just first editor row
-  // Go top of doc
-  case CMD_GO_TOP_DOC:
-    E.cy = 0;
+void editorProcessKeypressVisualMode(int c) {
+  int cc = 0;
+
+  // Count prefix, as in normal mode
+  if (isdigit(c) && (c != KEY_0 || E.count > 0)) {
+    E.count = MIN(E.count * 10 + (c - '0'), DITTO_MAX_COUNT);
+    return;
+  }
+
+  switch (c) {
+  case KEY_ESC:
+    editorChangeMode(NORMAL_MODE);
     break;
-  // Go bottom of doc
-  case CMD_GO_BOTTOM_DOC:
-    E.cy = E.numrows - 1;
+  case KEY_v:
+  case KEY_V:
+    // The other kind of selection switches to it, the same one leaves
+    if ((c == KEY_V) == E.vis_line)
+      editorChangeMode(NORMAL_MODE);
+    else
+      E.vis_line = c == KEY_V;
+    break;
+  case ARROW_UP:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case ARROW_DOWN:
+  case KEY_j:
+  case KEY_k:
+  case KEY_h:
+  case KEY_l:
+  case KEY_H:
+  case KEY_L:
+  case KEY_b:
+  case KEY_e:
+  case KEY_w:
+    editorMoveCursorCount(c, MAX(E.count, 1));
+    break;
+  case KEY_0:
+    editorMoveCursor(KEY_0);
+    break;
+  case KEY_G:
+    editorMoveCursor(E.count ? CMD_GO_LINE : CMD_GO_BOTTOM_DOC);
+    break;
+  case KEY_g:
+    cc = editorReadSequenceKey();
+    if (cc == KEY_g)
+      editorMoveCursor(CMD_GO_TOP_DOC);
+    break;
+  case KEY_DQUOTE:
+    // Select the register for the operator, keeping the count
+    cc = editorReadSequenceKey();
+    if (editorRegister(cc)) {
+      E.reg_sel = cc;
+      return;
+    }
+    break;
+  case KEY_y:
+  case KEY_d:
+  case KEY_GT:
+  case KEY_LT:
+  case KEY_J:
+    editorVisualApply(c);
+    editorChangeMode(NORMAL_MODE);
+    editorClampCursor();
     break;
   }
 
-  // New row after the movement
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
-  // Avoid ending up in an invalid x-position through vertical movements
-  // across lines with different size
-  if (E.cx > rowlen)
-    E.cx = rowlen;
+  E.count = 0;
+  if (E.mode != VISUAL_MODE)
+    E.reg_sel = KEY_DQUOTE;
 }
 
-void destroyEditor(void) { dlog_close(E.logger); }
+/*** substitute ***/
 
-void editorProcessKeypressNormalMode(int c) {
-  static int quit_times = DITTO_QUIT_TIMES;
+typedef struct {
+  int row;
+  int len;
+  // The new text of the row, which it takes over, and whether it's ASCII
+  char *chars;
+  int plain;
+} SubstLine;
 
-  int cc = 0;
+// A slice of the range handled by a single worker. The worker builds the
+// final text of the rows it replaces, so that the main thread only swaps
+// them in.
+typedef struct {
+  regex_t *re;
+  // Set when the pattern has no regex special chars
+  const char *literal;
+  size_t literal_len;
+  const char *rep;
+  int global;
+  int from, to;
+
+  SubstLine *lines;
+  int nlines;
+  int cap;
+  long nsubs;
+} SubstJob;
 
-  switch (c) {
-  case CTRL_KEY('c'):
-    if (E.dirty && quit_times > 1) {
-      editorSetStatusMessage("Unsaved changes. Press Ctrl-C again to quit.");
-      quit_times--;
+typedef struct {
+  char *b;
+  size_t len;
+  size_t cap;
+} SubstBuffer;
+
+void substAppend(SubstBuffer *sb, const char *s, size_t len) {
+  if (sb->len + len > sb->cap) {
+    while (sb->len + len > sb->cap)
+      sb->cap = sb->cap ? sb->cap * 2 : 256;
+    sb->b = drealloc(sb->b, sb->cap);
+  }
+  memcpy(sb->b + sb->len, s, len);
+  sb->len += len;
+}
+
+// Appends the replacement, expanding '&' and '\1'..'\9' with the matched text
+void substExpand(SubstBuffer *sb, const char *rep, const char *src,
+                 regmatch_t *m, int nmatch) {
+  for (const char *r = rep; *r; r++) {
+    if (*r == '&') {
+      substAppend(sb, src + m[0].rm_so, m[0].rm_eo - m[0].rm_so);
+    } else if (*r == '\\' && r[1] >= '0' && r[1] <= '9') {
+      int g = *++r - '0';
+      if (g < nmatch && m[g].rm_so != -1)
+        substAppend(sb, src + m[g].rm_so, m[g].rm_eo - m[g].rm_so);
+    } else if (*r == '\\' && r[1] != '\0') {
+      substAppend(sb, ++r, 1);
+    } else {
+      substAppend(sb, r, 1);
+    }
+  }
+}
+
+// Finds the next match in s, returns 0 if found like regexec
+int substMatch(SubstJob *job, const char *s, regmatch_t *m, int eflags) {
+  if (job->literal) {
+    const char *p = strstr(s, job->literal);
+    if (!p)
+      return REG_NOMATCH;
+    m[0].rm_so = p - s;
+    m[0].rm_eo = m[0].rm_so + job->literal_len;
+    return 0;
+  }
+  return regexec(job->re, s, DITTO_SUBST_GROUPS, m, eflags);
+}
+
+void *substWorker(void *arg) {
+  SubstJob *job = arg;
+  SubstBuffer sb = {NULL, 0, 0};
+  regmatch_t m[DITTO_SUBST_GROUPS];
+
+  for (int r = job->from; r < job->to; r++) {
+    const char *s = E.buf->row[r].chars;
+    const char *p = s;
+    int eflags = 0;
+    long nsubs = 0;
+
+    sb.len = 0;
+    while (*p || eflags == 0) {
+      if (substMatch(job, p, m, eflags) != 0)
+        break;
+
+      substAppend(&sb, p, m[0].rm_so);
+      substExpand(&sb, job->rep, p, m, job->literal ? 1 : DITTO_SUBST_GROUPS);
+      nsubs++;
+
+      if (m[0].rm_eo == m[0].rm_so) {
+        // Empty match, step over one char to make progress
+        if (p[m[0].rm_eo] == '\0') {
+          p += m[0].rm_eo;
+          break;
+        }
+        substAppend(&sb, p + m[0].rm_eo, 1);
+        p += m[0].rm_eo + 1;
+      } else {
+        p += m[0].rm_eo;
+      }
+
+      eflags = REG_NOTBOL;
+      if (!job->global)
+        break;
+    }
+
+    if (nsubs == 0)
+      continue;
+
+    substAppend(&sb, p, E.buf->row[r].size - (p - s));
+
+    if (job->nlines == job->cap) {
+      job->cap = job->cap ? job->cap * 2 : 64;
+      job->lines = drealloc(job->lines, sizeof(SubstLine) * job->cap);
+    }
+    SubstLine *l = &job->lines[job->nlines++];
+    l->row = r;
+    l->len = sb.len;
+    l->plain = utf8_is_plain(sb.b, sb.len);
+    // The buffer becomes the row, a new one is started for the next
+    substAppend(&sb, "", 1);
+    l->chars = drealloc(sb.b, sb.len);
+    sb = (SubstBuffer){NULL, 0, 0};
+    job->nsubs += nsubs;
+  }
+
+  dfree(sb.b);
+  return NULL;
+}
+
+// Splits ":s/pat/rep/flags" arguments in place, handling escaped delimiters.
+// Returns -1 on a malformed command.
+int substParse(char *args, char **pat, char **rep, int *global) {
+  char delim = args[0];
+  if (delim == '\0' || isalnum(delim) || delim == '\\' || delim == ' ')
+    return -1;
+
+  char *fields[3] = {args + 1, NULL, NULL};
+  int nf = 1;
+  char *w = args + 1;
+
+  for (char *p = args + 1; *p; p++) {
+    if (*p == '\\' && p[1] == delim) {
+      *w++ = *++p;
+    } else if (*p == delim && nf < 3) {
+      *w++ = '\0';
+      fields[nf++] = w;
+    } else {
+      *w++ = *p;
+    }
+  }
+  *w = '\0';
+
+  if (nf < 2 || fields[0][0] == '\0')
+    return -1;
+
+  *pat = fields[0];
+  *rep = fields[1];
+  *global = 0;
+  for (char *f = fields[2]; f && *f; f++) {
+    if (*f == 'g')
+      *global = 1;
+    else
+      return -1;
+  }
+
+  return 0;
+}
+
+// Substitutes across rows [line1, line2], splitting the range across worker
+// threads. The results are merged in one batch, as a single change.
+void editorSubstitute(int line1, int line2, char *args) {
+  char *pat, *rep;
+  int global;
+
+  if (substParse(args, &pat, &rep, &global) == -1) {
+    editorSetStatusMessage("Usage: :[range]s/pattern/replacement/[g]");
+    return;
+  }
+
+  // A compiled pattern per thread: glibc locks a regex_t while matching, so
+  // threads sharing one would take turns
+  regex_t res[DITTO_MAX_THREADS];
+  int literal = strpbrk(pat, ".[]*^$\\") == NULL;
+  if (!literal) {
+    int err = regcomp(&res[0], pat, 0);
+    if (err) {
+      char errbuf[64];
+      regerror(err, &res[0], errbuf, sizeof(errbuf));
+      editorSetStatusMessage("Invalid pattern: %s", errbuf);
+      return;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int nrows = line2 - line1 + 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = MIN(MAX(ncpu, 1), DITTO_MAX_THREADS);
+  nthreads = MIN(nthreads, MAX(nrows / DITTO_SUBST_MIN_ROWS, 1));
+
+  SubstJob jobs[DITTO_MAX_THREADS];
+  pthread_t tids[DITTO_MAX_THREADS];
+
+  // It compiled once, so it only fails here out of memory, and the thread
+  // then shares the first copy
+  int compiled = literal ? 0 : 1;
+  while (compiled > 0 && compiled < nthreads &&
+         regcomp(&res[compiled], pat, 0) == 0)
+    compiled++;
+
+  for (int t = 0; t < nthreads; t++) {
+    SubstJob *job = &jobs[t];
+    job->re = literal ? NULL : &res[t < compiled ? t : 0];
+    job->literal = literal ? pat : NULL;
+    job->literal_len = strlen(pat);
+    job->rep = rep;
+    job->global = global;
+    job->from = line1 + (long)nrows * t / nthreads;
+    job->to = line1 + (long)nrows * (t + 1) / nthreads;
+    job->lines = NULL;
+    job->nlines = 0;
+    job->cap = 0;
+    job->nsubs = 0;
+  }
+
+  // The first slice runs on this thread, also being the fallback if threads
+  // cannot be started
+  int started = 1;
+  for (int t = 1; t < nthreads; t++, started++) {
+    if (pthread_create(&tids[t], NULL, substWorker, &jobs[t]) != 0)
+      break;
+  }
+  substWorker(&jobs[0]);
+  for (int t = 1; t < started; t++)
+    pthread_join(tids[t], NULL);
+  for (int t = started; t < nthreads; t++)
+    substWorker(&jobs[t]);
+
+  // Merge everything back in one batch, the rows taking over the text
+  long nsubs = 0;
+  int nlines = 0;
+  int last = -1;
+  for (int t = 0; t < nthreads; t++) {
+    SubstJob *job = &jobs[t];
+    for (int i = 0; i < job->nlines; i++) {
+      SubstLine *l = &job->lines[i];
+      Row *row = &E.buf->row[l->row];
+      editorRowReleaseText(row);
+      row->chars = l->chars;
+      row->size = l->len;
+      editorUpdateRowFrom(row, 0, l->plain);
+      editorRowChanged(JOP_REPLACE_ROW, l->row, 0, l->chars, l->len);
+      last = l->row;
+    }
+    nlines += job->nlines;
+    nsubs += job->nsubs;
+    dfree(job->lines);
+  }
+  if (nlines > 0)
+    E.buf->dirty++;
+
+  for (int t = 0; t < compiled; t++)
+    regfree(&res[t]);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  dlog_debug(E.logger, "Substitute on %d rows with %d threads in %.1f ms",
+             nrows, nthreads,
+             (end.tv_sec - start.tv_sec) * 1000.0 +
+                 (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  if (nsubs == 0) {
+    editorSetStatusMessage("Pattern not found: %s", pat);
+    return;
+  }
+
+  E.buf->cy = last;
+  E.buf->cx = 0;
+  editorSetStatusMessage("%ld substitutions on %d lines", nsubs, nlines);
+}
+
+/*** commands ***/
+
+typedef struct {
+  // Rows the command applies to (inclusive), the current one by default
+  int line1, line2;
+  int has_range;
+  // Command followed by '!'
+  int bang;
+  // Whatever follows the command name
+  char *args;
+} EditorCommand;
+
+typedef struct {
+  const char *name;
+  void (*run)(EditorCommand *cmd);
+} EditorCommandDef;
+
+void cmdWrite(EditorCommand *cmd) {
+  if (cmd->args[0] != '\0') {
+    dfree(E.buf->filename);
+    E.buf->filename = dstrdup(cmd->args);
+    E.buf->file_exact = 0;
+    editorSelectSyntax();
+  }
+  editorSave();
+}
+
+void cmdQuit(EditorCommand *cmd) {
+  // With several windows only the current one is closed, the buffer stays
+  if (editorWindowClose())
+    return;
+
+  Buffer *dirty = editorBufferDirty();
+  if (E.buf->dirty && !cmd->bang) {
+    editorSetStatusMessage("No write since last change (add ! to override)");
+    return;
+  }
+  if (dirty && !cmd->bang) {
+    editorSetStatusMessage("No write since last change of %s (add ! to "
+                           "override)",
+                           dirty->filename ? dirty->filename : "[No Name]");
+    return;
+  }
+  editorQuit();
+}
+
+void cmdWriteQuit(EditorCommand *cmd) {
+  cmdWrite(cmd);
+  if (!E.buf->dirty)
+    cmdQuit(cmd);
+}
+
+void cmdSubstitute(EditorCommand *cmd) {
+  if (!editorCheckWritable())
+    return;
+  if (E.buf->numrows == 0) {
+    editorSetStatusMessage("Buffer is empty");
+    return;
+  }
+  editorSubstitute(cmd->line1, cmd->line2, cmd->args);
+}
+
+void cmdReload(EditorCommand *cmd) {
+  if (!E.buf->filename || E.buf->view || E.buf->follow || E.buf->loading) {
+    editorSetStatusMessage("Nothing to reload");
+    return;
+  }
+  if (E.buf->dirty && !cmd->bang) {
+    editorSetStatusMessage("No write since last change (add ! to override)");
+    return;
+  }
+  editorReload();
+}
+
+// ":diff" toggles the marks of the rows changed since the file on disk
+void cmdDiff(EditorCommand *cmd) {
+  UNUSED(cmd);
+  if (E.buf->diff) {
+    editorDiffStop();
+    editorSetStatusMessage("Diff off");
+    return;
+  }
+  if (!E.buf->filename || E.buf->view || E.buf->loading) {
+    editorSetStatusMessage("Nothing to diff against");
+    return;
+  }
+  editorDiffStart();
+}
+
+void cmdWrap(EditorCommand *cmd) {
+  UNUSED(cmd);
+  if (E.buf->view) {
+    editorSetStatusMessage("No soft wrap in view mode");
+    return;
+  }
+
+  E.buf->wrap = !E.buf->wrap;
+  E.buf->rowoff_sub = 0;
+  if (E.buf->wrap) {
+    E.buf->wrapidx = li_create(editorWrapLines, NULL);
+    li_build(E.buf->wrapidx, E.buf->numrows);
+    E.buf->wrap_width = E.screencols;
+    E.buf->wrapidxs[0] = E.buf->wrapidx;
+    E.buf->wrap_widths[0] = E.screencols;
+    E.buf->wrap_next = 0;
+  } else {
+    for (int j = 0; j < E.buf->numrows; j++) {
+      dfree(E.buf->row[j].wraps);
+      E.buf->row[j].wraps = NULL;
+      E.buf->row[j].nwraps = 0;
+      E.buf->row[j].wrap_cols = 0;
+    }
+    for (int k = 0; k < DITTO_WRAP_WIDTHS; k++) {
+      li_destroy(E.buf->wrapidxs[k]);
+      E.buf->wrapidxs[k] = NULL;
+    }
+    E.buf->wrapidx = NULL;
+  }
+  editorSetStatusMessage("Soft wrap %s", E.buf->wrap ? "on" : "off");
+}
+
+void cmdIndex(EditorCommand *cmd) {
+  UNUSED(cmd);
+  editorTrigramStats();
+}
+
+// ":goto [offset]" jumps to a byte offset (decimal, or hex with 0x), or shows
+// the offset of the cursor
+void cmdGoto(EditorCommand *cmd) {
+  if (cmd->args[0] == '\0') {
+    size_t off = E.buf->cy < E.buf->numrows
+                     ? li_line_to_offset(E.buf->lineidx, E.buf->cy)
+                     : 0;
+    off += E.buf->cx;
+    editorSetStatusMessage("Line %d, column %d, byte offset %zu (0x%zx)%s",
+                           E.buf->cy + 1, E.buf->cx + 1, off, off,
+                           E.buf->crlf ? " without the CRs of CRLF" : "");
+    return;
+  }
+
+  // The rows are short of the CRs, going there would land before the offset
+  if (E.buf->crlf) {
+    editorSetStatusMessage("Byte offsets don't match the file: its CRLF line "
+                           "endings were not kept");
+    return;
+  }
+
+  char *end;
+  errno = 0;
+  unsigned long long off = strtoull(cmd->args, &end, 0);
+  if (errno || *end != '\0') {
+    editorSetStatusMessage("Invalid offset: %s", cmd->args);
+    return;
+  }
+
+  E.count = off;
+  editorMoveCursor(CMD_GO_OFFSET);
+  E.count = 0;
+}
+
+// ":mem" shows the memory in use and how much of it is shared through slices
+void cmdMem(EditorCommand *cmd) {
+  UNUSED(cmd);
+  long lines = 0;
+  for (int r = 0; r < DITTO_REGISTERS; r++)
+    lines += E.regs[r].nlines;
+  editorSetStatusMessage(
+      "Memory: %.1f MB, %zu shared lines of %.1f MB, %ld lines in registers",
+      used_memory() / (1024.0 * 1024.0), slice_count(),
+      slice_bytes() / (1024.0 * 1024.0), lines);
+}
+
+// ":e file" opens the file in a new buffer, or switches to its buffer
+void cmdEdit(EditorCommand *cmd) {
+  if (cmd->args[0] == '\0') {
+    editorSetStatusMessage("No file name");
+    return;
+  }
+  for (int j = 0; j < E.nbufs; j++) {
+    if (E.bufs[j]->filename && strcmp(E.bufs[j]->filename, cmd->args) == 0) {
+      editorBufferSwitch(E.bufs[j]);
+      editorBufferInfo();
       return;
     }
-    write(STDOUT_FILENO, CLEAR_SCREEN, CLEAR_SCREEN_SZ);
-    write(STDOUT_FILENO, REPOS_CURSOR, REPOS_CURSOR_SZ);
-    exit(0);
-    break;
-  case CTRL_KEY('s'):
-    editorSave();
-    break;
-  case KEY_ESC:
-    editorChangeMode(NORMAL_MODE);
-    break;
-  case KEY_i:
-    editorChangeMode(INSERT_MODE);
-    break;
-  case KEY_v:
-    editorChangeMode(VISUAL_MODE);
-    break;
-  case KEY_COLON:
-    editorChangeMode(COMMAND_MODE);
-    break;
-  case ARROW_UP:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-  case ARROW_DOWN:
-  case KEY_j:
-  case KEY_k:
-  case KEY_h:
-  case KEY_l:
-  case KEY_J:
-  case KEY_K:
-  case KEY_H:
-  case KEY_L:
-    editorMoveCursor(c);
-    break;
+  }
 
-  case KEY_0:
-    editorMoveCursor(KEY_0);
-    break;
+  // Nothing changes if the file can't be opened
+  int fd = editorOpenFile(cmd->args);
+  if (fd == -2)
+    return;
 
-  case KEY_a:
-    editorMoveCursor(ARROW_RIGHT);
-    editorChangeMode(INSERT_MODE);
-    break;
+  // The empty buffer of an editor started without a file is reused
+  Buffer *b = E.buf;
+  if (b->filename || b->numrows > 0 || b->view || b->stream_fd != -1)
+    b = editorBufferNew();
+  editorBufferSwitch(b);
+  editorOpen(cmd->args, fd);
+}
 
-  case KEY_A:
-    editorMoveCursor(KEY_L);
-    editorMoveCursor(ARROW_RIGHT);
-    editorChangeMode(INSERT_MODE);
-    break;
+void cmdBufferNext(EditorCommand *cmd) {
+  UNUSED(cmd);
+  editorBufferSwitch(editorBufferNext(1));
+  editorBufferInfo();
+}
 
-  case KEY_b:
-    editorMoveCursor(KEY_b);
-    break;
+void cmdBufferPrev(EditorCommand *cmd) {
+  UNUSED(cmd);
+  editorBufferSwitch(editorBufferNext(-1));
+  editorBufferInfo();
+}
 
-  case KEY_e:
-    editorMoveCursor(KEY_e);
-    break;
+// ":sp [file]" and ":vs [file]" split the window, on the file if given
+void cmdSplit(EditorCommand *cmd) {
+  Window *w = E.win;
+  editorWindowSplit(0);
+  if (E.win != w && cmd->args[0] != '\0')
+    cmdEdit(cmd);
+}
 
-  case KEY_w:
-    editorMoveCursor(KEY_w);
-    break;
+void cmdVsplit(EditorCommand *cmd) {
+  Window *w = E.win;
+  editorWindowSplit(1);
+  if (E.win != w && cmd->args[0] != '\0')
+    cmdEdit(cmd);
+}
 
-  case KEY_o:
-    editorInsertRow(E.cy + 1, "", 0);
-    editorMoveCursor(ARROW_DOWN);
-    editorChangeMode(INSERT_MODE);
-    break;
+// ":trace" starts or stops tracing frames, ":trace file" writes the spans
+// recorded to the file
+void cmdTrace(EditorCommand *cmd) {
+  if (cmd->args[0] != '\0') {
+    editorTraceWrite(cmd->args);
+  } else if (trace_enabled) {
+    trace_stop();
+    editorSetStatusMessage("Tracing stopped, %zu spans recorded",
+                           trace_count());
+  } else {
+    editorTraceStart();
+  }
+}
 
-  case KEY_I:
-    editorMoveCursor(KEY_I);
-    editorChangeMode(INSERT_MODE);
-    break;
+// ":stats" shows or hides the overlay of latency and frame stats, ":stats!"
+// starts measuring the latency again
+void cmdStats(EditorCommand *cmd) {
+  if (cmd->bang) {
+    hist_reset(E.stats.latency);
+    editorSetStatusMessage("Stats reset");
+    return;
+  }
+  E.stats.shown = !E.stats.shown;
+  // Draw again what the overlay covered
+  if (!E.stats.shown)
+    editorWindowLayout();
+}
 
-  case KEY_O:
-    editorInsertRow(E.cy, "", 0);
-    editorMoveCursor(KEY_0);
-    editorChangeMode(INSERT_MODE);
-    break;
+void cmdClose(EditorCommand *cmd) {
+  UNUSED(cmd);
+  if (!editorWindowClose())
+    editorSetStatusMessage("Cannot close last window");
+}
 
-  case KEY_x:
-  case KEY_X:
-    if (c == KEY_x)
-      editorMoveCursor(ARROW_RIGHT);
-    editorDeleteChar();
-    break;
+// ":ls" lists the buffers, % marking the current one and + the modified ones
+void cmdList(EditorCommand *cmd) {
+  UNUSED(cmd);
+  char list[sizeof(E.statusmsg)];
+  int len = 0;
+  for (int j = 0; j < E.nbufs && len < (int)sizeof(list); j++) {
+    Buffer *b = E.bufs[j];
+    len += snprintf(list + len, sizeof(list) - len, "%s%d%s%s %s",
+                    j ? "  " : "", j + 1, b == E.buf ? "%" : "",
+                    b->dirty ? "+" : "",
+                    b->filename ? b->filename : "[No Name]");
+  }
+  editorSetStatusMessage("%s", list);
+}
 
-  case KEY_y:
-    // Sleep a bit to allow the possible sequence to be read
-    usleep(SEQUENCES_TIMEOUT_MICROSEC);
-    cc = editorReadKey();
-    switch (cc) {
-    case KEY_y:
-      dfree(E.reg);
-      E.reg = E.row[E.cy].chars;
-      editorSetStatusMessage("Yanked %d lines", 1);
-      break;
-    default:
-      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
-      break;
-    }
-    break;
+static const EditorCommandDef commands[] = {
+    {"w", cmdWrite},        {"write", cmdWrite},
+    {"q", cmdQuit},         {"quit", cmdQuit},
+    {"wq", cmdWriteQuit},   {"x", cmdWriteQuit},
+    {"s", cmdSubstitute},   {"substitute", cmdSubstitute},
+    {"index", cmdIndex},    {"goto", cmdGoto},
+    {"reload", cmdReload},  {"diff", cmdDiff},
+    {"wrap", cmdWrap},      {"mem", cmdMem},
+    {"e", cmdEdit},         {"edit", cmdEdit},
+    {"bn", cmdBufferNext},  {"bnext", cmdBufferNext},
+    {"bp", cmdBufferPrev},  {"bprevious", cmdBufferPrev},
+    {"ls", cmdList},        {"buffers", cmdList},
+    {"sp", cmdSplit},       {"split", cmdSplit},
+    {"vs", cmdVsplit},      {"vsplit", cmdVsplit},
+    {"clo", cmdClose},      {"close", cmdClose},
+    {"trace", cmdTrace},    {"stats", cmdStats},
+};
 
-  case KEY_p:
-    editorInsertRow(E.cy + 1, E.reg, strlen(E.reg));
-    break;
-  case KEY_P:
-    editorInsertRow(E.cy, E.reg, strlen(E.reg));
-    editorMoveCursor(E.cy - 1);
-    break;
+// Parses a single line address (number, '.' or '$'), storing the 0-based row.
+// Returns a pointer past the address, or NULL if there's none.
+char *editorParseAddress(char *p, int *line) {
+  if (isdigit(*p)) {
+    long n = strtol(p, &p, 10);
+    *line = (int)MIN(n, INT32_MAX) - 1;
+  } else if (*p == '.') {
+    *line = E.buf->cy;
+    p++;
+  } else if (*p == '$') {
+    *line = E.buf->numrows - 1;
+    p++;
+  } else {
+    return NULL;
+  }
+  return p;
+}
 
-  case KEY_d:
-    // Sleep a bit to allow the possible sequence to be read
-    usleep(SEQUENCES_TIMEOUT_MICROSEC);
-    cc = editorReadKey();
-    switch (cc) {
-    case KEY_d:
-      editorDeleteRow(E.cy);
-      break;
-    default:
-      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
-      break;
-    }
-    break;
+// Parses and runs a command line like "[range]name[!] [args]"
+void editorExecuteCommand(char *line) {
+  EditorCommand cmd;
+  char *p = line;
 
-  case KEY_G:
-    editorMoveCursor(CMD_GO_BOTTOM_DOC);
-    break;
+  while (isspace(*p))
+    p++;
 
-  case KEY_g:
-    // Sleep a bit to allow the possible sequence to be read
-    usleep(SEQUENCES_TIMEOUT_MICROSEC);
-    cc = editorReadKey();
-    switch (cc) {
-    case KEY_g:
-      editorMoveCursor(CMD_GO_TOP_DOC);
-      break;
-    default:
-      dlog_debug(E.logger, "no sequence for '%c%c'", c, cc);
-      break;
+  cmd.line1 = cmd.line2 = MIN(E.buf->cy, MAX(E.buf->numrows - 1, 0));
+  cmd.has_range = 0;
+  cmd.bang = 0;
+
+  // Range
+  if (*p == '%') {
+    cmd.line1 = 0;
+    cmd.line2 = MAX(E.buf->numrows - 1, 0);
+    cmd.has_range = 1;
+    p++;
+  } else {
+    char *next = editorParseAddress(p, &cmd.line1);
+    if (next) {
+      p = next;
+      cmd.line2 = cmd.line1;
+      cmd.has_range = 1;
+      if (*p == ',') {
+        next = editorParseAddress(p + 1, &cmd.line2);
+        if (!next) {
+          editorSetStatusMessage("Invalid range: %s", line);
+          return;
+        }
+        p = next;
+      }
     }
-    break;
   }
 
-  quit_times = DITTO_QUIT_TIMES;
-}
+  // Name
+  char name[32];
+  size_t len = 0;
+  while (isalpha(*p) && len < sizeof(name) - 1)
+    name[len++] = *p++;
+  name[len] = '\0';
 
-void editorProcessKeypressInsertMode(int c) {
-  switch (c) {
-  case KEY_ESC:
-    editorChangeMode(NORMAL_MODE);
-    break;
-  case '\r':
-    editorInsertNewline();
-    break;
-  case CTRL_KEY('s'):
-    editorSave();
-    break;
-  case KEY_BACKSPACE:
-    editorDeleteChar();
-    break;
-  case CTRL_KEY('l'):
-    // case '\x1b':
-    break;
-  case ARROW_UP:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-  case ARROW_DOWN:
-    editorMoveCursor(c);
-    break;
-  default:
-    // Only insert printable characters (ASCII 32-126)
-    // 9 is tab
-    // 32 is space
-    if (c == KEY_TAB || (c >= 32 && c <= 126)) {
-      editorInsertChar(c);
+  if (*p == '!') {
+    cmd.bang = 1;
+    p++;
+  }
+  while (*p == ' ')
+    p++;
+  cmd.args = p;
+
+  // A bare line number jumps there, like "NG"
+  if (len == 0) {
+    if (cmd.has_range && *p == '\0') {
+      E.count = MAX(cmd.line2 + 1, 1);
+      editorMoveCursor(CMD_GO_LINE);
+      E.count = 0;
+    } else {
+      editorSetStatusMessage("Not an editor command: %s", line);
     }
-    break;
+    return;
   }
-}
 
-void editorProcessKeypressVisualMode(int c) {
-  switch (c) {
-  case KEY_ESC:
-    editorChangeMode(NORMAL_MODE);
-    break;
-  default:
-    editorInsertChar(c);
-    break;
+  if (cmd.has_range) {
+    if (cmd.line1 > cmd.line2) {
+      int tmp = cmd.line1;
+      cmd.line1 = cmd.line2;
+      cmd.line2 = tmp;
+    }
+    if (cmd.line1 < 0 || cmd.line2 >= MAX(E.buf->numrows, 1)) {
+      editorSetStatusMessage("Invalid range: %s", line);
+      return;
+    }
   }
+
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strcmp(commands[i].name, name) == 0) {
+      commands[i].run(&cmd);
+      return;
+    }
+  }
+
+  editorSetStatusMessage("Not an editor command: %s", name);
 }
 
 void editorProcessKeypressCommandMode(int c) {
@@ -1386,15 +5877,19 @@ void editorProcessKeypressCommandMode(int c) {
     }
     break;
 
-  case '\r':
-    // TODO: Execute the command
-    editorSetStatusMessage("Command not implemented: %s", E.input_buffer);
+  case '\r': {
+    // Leave command mode first, the command may prompt or change mode itself
+    char *line = dstrdup(E.input_buffer);
+    editorSetStatusMessage("");
     editorChangeMode(NORMAL_MODE);
+    editorExecuteCommand(line);
+    dfree(line);
     break;
+  }
 
   default:
-    // Only insert printable characters
-    if (!iscntrl(c) && c < 128) {
+    // Only insert printable characters, UTF-8 included
+    if (!iscntrl(c) && c < 256) {
       // Expand buffer if needed
       if (E.input_buffer_len >= E.input_buffer_size - 1) {
         E.input_buffer_size *= 2;
@@ -1408,10 +5903,8 @@ void editorProcessKeypressCommandMode(int c) {
   }
 }
 
-void editorProcessKeypress(void) {
-  int c = editorReadKey();
-  // dlog_debug(E.logger, "Pressed '%c' (%d)", c, c);
-
+// Handles a key in the current mode, either typed or replayed from a macro
+void editorDispatchKey(int c) {
   switch (E.mode) {
   case NORMAL_MODE:
     editorProcessKeypressNormalMode(c);
@@ -1426,79 +5919,359 @@ void editorProcessKeypress(void) {
     editorProcessKeypressCommandMode(c);
     break;
   default:
-    editorSetStatusMessage("%s mode not handled yet", mode_str[E.mode]);
+    // Past the end of mode_str
+    editorSetStatusMessage("Mode %d not handled yet", (int)E.mode);
     break;
   }
 }
 
+void editorProcessKeypress(void) {
+  int c = editorReadKey();
+  // dlog_debug(E.logger, "Pressed '%c' (%d)", c, c);
+  int64_t t = trace_begin();
+  editorDispatchKey(c);
+  trace_end("edit", t);
+}
+
+/*** macros ***/
+
+void editorMacroRecord(int c) {
+  if (E.macro_len + 3 > E.macro_cap) {
+    E.macro_cap = MAX(E.macro_cap * 2, 64);
+    E.macro = drealloc(E.macro, E.macro_cap);
+  }
+  E.macro_last = E.macro_len;
+  if (c < 0xFF) {
+    E.macro[E.macro_len++] = c;
+  } else {
+    E.macro[E.macro_len++] = (char)0xFF;
+    E.macro[E.macro_len++] = c >> 8;
+    E.macro[E.macro_len++] = c & 0xFF;
+  }
+}
+
+// Next key of the macro being replayed. A sequence cut by the end of the
+// macro gets an escape, which cancels it.
+int editorMacroNextKey(void) {
+  MacroReplay *r = &E.replay;
+  if (r->pos >= r->len)
+    return KEY_ESC;
+  unsigned char c = r->keys[r->pos++];
+  if (c != 0xFF)
+    return c;
+  if (r->pos + 2 > r->len) {
+    r->pos = r->len;
+    return KEY_ESC;
+  }
+  int key = ((unsigned char)r->keys[r->pos] << 8) |
+            (unsigned char)r->keys[r->pos + 1];
+  r->pos += 2;
+  return key;
+}
+
+void editorMacroStart(int reg) {
+  E.macro_reg = reg;
+  E.macro_len = 0;
+  E.macro_last = 0;
+}
+
+// Stores the keys recorded in the register, as a single char-wise line
+void editorMacroStop(void) {
+  // Drop the q which stopped the recording
+  E.macro_len = E.macro_last;
+  Register *reg = editorRegister(E.macro_reg);
+  editorRegisterClear(reg);
+  reg->lines = dmalloc(sizeof(Slice *));
+  reg->lines[0] = slice_new(E.macro ? E.macro : "", E.macro_len);
+  reg->nlines = 1;
+  reg->charwise = 1;
+  E.macro_reg = 0;
+}
+
+// A command failed: the macros being replayed stop there, as in vim
+void editorMacroFail(void) {
+  if (E.replay_depth > 0)
+    E.replay_failed = 1;
+}
+
+// Whether Ctrl-C was typed. Only the next key typed ahead is looked at, and
+// pushed back unless it's Ctrl-C, so that keys are never reordered.
+int editorMacroInterrupted(void) {
+  struct pollfd pfd = {term_fd(E.term), POLLIN, 0};
+  unsigned char c;
+  if (term_pending(E.term) || pfd.fd == -1 || poll(&pfd, 1, 0) <= 0 ||
+      term_read(E.term, &c) != 1)
+    return 0;
+  if (c == CTRL_KEY('c'))
+    return 1;
+  term_unread(E.term, c);
+  return 0;
+}
+
+// Replays the keys in the register times over, feeding them straight to the
+// mode handlers. Nothing is drawn and debug logs are off meanwhile: the main
+// loop draws the result once. A failing command or Ctrl-C stops the replay,
+// and the ones it's nested in.
+void editorMacroReplay(int regc, long times) {
+  Register *reg = editorRegister(regc);
+  if (!reg || reg->nlines == 0) {
+    editorSetStatusMessage("Nothing in register %c", regc);
+    editorMacroFail();
+    return;
+  }
+  if (E.replay_depth >= DITTO_MACRO_DEPTH)
+    return;
+
+  // The lines of the register are typed with Enter between them. The keys
+  // are copied as the macro may overwrite the register.
+  AppendBuffer keys = ABUF_INIT;
+  for (long j = 0; j < reg->nlines; j++) {
+    abAppend(&keys, reg->lines[j]->data, reg->lines[j]->len);
+    if (j < reg->nlines - 1 || !reg->charwise)
+      abAppend(&keys, "\r", 1);
+  }
+
+  MacroReplay saved = E.replay;
+  int level = E.logger->level;
+  if (E.replay_depth++ == 0) {
+    E.logger->level = MIN(level, DLOG_LEVEL_WARN);
+    E.replay_failed = 0;
+  }
+
+  double poll_at = monotonicMs() + DITTO_MACRO_POLL_MS;
+  for (long t = 0; t < times && !E.replay_failed; t++) {
+    E.replay = (MacroReplay){keys.b, keys.len, 0};
+    while (E.replay.pos < E.replay.len && !E.replay_failed)
+      editorDispatchKey(editorReadKey());
+
+    if (monotonicMs() >= poll_at) {
+      if (editorMacroInterrupted()) {
+        editorSetStatusMessage("Interrupted");
+        E.replay_failed = 1;
+      }
+      poll_at = monotonicMs() + DITTO_MACRO_POLL_MS;
+    }
+  }
+
+  E.replay = saved;
+  if (--E.replay_depth == 0) {
+    E.logger->level = level;
+    editorSetCursorShape();
+  }
+  abFree(&keys);
+}
+
+/*** bench ***/
+
+// Records a frame written, and the latency of the command it shows, if any
+void editorBenchFrame(size_t bytes, double lat) {
+  Bench *b = &E.bench;
+  b->frames++;
+  b->bytes += bytes;
+  if (lat < 0)
+    return;
+
+  if (b->nlat == b->latcap) {
+    b->latcap = b->latcap ? b->latcap * 2 : 1024;
+    b->lat = drealloc(b->lat, sizeof(double) * b->latcap);
+  }
+  b->lat[b->nlat++] = lat;
+}
+
+int editorBenchCompare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Latency at quantile q (nearest rank) of the sorted samples
+double editorBenchQuantile(double q) {
+  if (E.bench.nlat == 0)
+    return 0;
+  return E.bench.lat[(size_t)(q * (E.bench.nlat - 1) + 0.5)];
+}
+
+// Prints the results of the run once the script is over
+void editorBenchReport(void) {
+  Bench *b = &E.bench;
+  qsort(b->lat, b->nlat, sizeof(double), editorBenchCompare);
+  printf("%-8s %6zu keys  p50 %7.3f ms  p99 %7.3f ms  max %8.3f ms  "
+         "%6.0f bytes/frame  peak %7.1f MB  open %7.1f ms  total %8.1f ms\n",
+         b->name, b->nlat, editorBenchQuantile(0.5),
+         editorBenchQuantile(0.99), b->nlat ? b->lat[b->nlat - 1] : 0,
+         b->frames ? (double)b->bytes / b->frames : 0,
+         peak_memory() / (1024.0 * 1024.0), b->open_ms,
+         monotonicMs() - b->start);
+}
+
+// Headless terminal typing the keys of the script, for a --bench run.
+// Exits on failure.
+Term *editorBenchStart(const char *script) {
+  FILE *fp = fopen(script, "rb");
+  if (fp == NULL) {
+    perror(script);
+    exit(1);
+  }
+  char *keys = NULL;
+  size_t len = 0, cap = 0, n;
+  do {
+    cap = cap ? cap * 2 : 4096;
+    keys = drealloc(keys, cap);
+    n = fread(keys + len, 1, cap - len, fp);
+    len += n;
+  } while (len == cap);
+  fclose(fp);
+
+  const char *slash = strrchr(script, '/');
+  E.bench.enabled = 1;
+  E.bench.name = slash ? slash + 1 : script;
+  E.bench.start = monotonicMs();
+  atexit(editorBenchReport);
+  return term_open_headless(DITTO_BENCH_ROWS, DITTO_BENCH_COLS, keys, len);
+}
+
 /*** init ***/
 
-void initEditor(DLogger *l) {
+void editorTermClose(void) { term_close(E.term); }
+
+void initEditor(DLogger *l, Term *term) {
   E.logger = l;
-  E.cx = 0;
-  E.rx = 0;
-  E.cy = 0;
-  E.ry = 0;
-  E.rowoff = 0;
-  E.coloff = 0;
-  E.numrows = 0;
-  E.row = NULL;
-  E.dirty = 0;
-  E.filename = NULL;
+  E.bufs = NULL;
+  E.nbufs = 0;
+  E.pollfds = NULL;
+  E.pollcap = 0;
+  E.buf = editorBufferNew();
+  E.win = editorWindowNew(E.buf);
+  E.root = E.win;
+  E.wins = NULL;
+  E.nwins = 0;
+  E.count = 0;
+  E.reg_sel = KEY_DQUOTE;
+  E.atomic_save = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.mode = NORMAL_MODE;
   E.screen_resized = 0;
+  E.trace_signal = 0;
   E.input_mode = 0;
   E.input_prompt = NULL;
   E.input_buffer = dmalloc(128);
   E.input_buffer_size = 128;
   E.input_buffer_len = 0;
   E.input_buffer[0] = '\0';
+  E.search = NULL;
+  E.trigram_enabled = 0;
+  E.retain = 0;
+  E.aio = NULL;
 
   E.messages = fss_create(10);
+  E.stats.latency = hist_create();
+  E.stats.period_start = monotonicMs();
 
-  enableRawMode();
+  E.term = term;
+  atexit(editorTermClose);
 
-  // Set up signal handler for window resize
+  // Set up signal handlers for window resize, and SIGUSR1 to trace frames
   signal(SIGWINCH, handleResize);
+  signal(SIGUSR1, handleTraceSignal);
 
   dlog_info(E.logger, "Welcome to Ditto Editor %s!", DITTO_VERSION);
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-    die("getWindowSize");
-
-  dlog_debug(E.logger, "Screen size: %d x %d", E.screenrows, E.screencols);
-
-  // Make space for the line numbers
-  E.screencols -= editorGetLineNumberWidth();
-
-  // Make space for status bar and status message
-  E.screenrows -= 2;
+  updateScreenSize();
 
   atexit(destroyEditor);
 }
 
 /*** main ***/
 
+// The microbenchmarks (bench/microbench.c) include this file for everything
+// but main
+#ifndef DITTO_NO_MAIN
 int main(int argc, char *argv[]) {
   FILE *f = fopen("/tmp/dittolog.txt", "a+");
   if (f == NULL)
     die("fopen");
   DLogger *l = dlog_initf(f, DLOG_LEVEL_DEBUG);
 
-  initEditor(l);
+  char *filename = NULL;
+  int index = 0;
+  int follow = 0;
+  int view = 0;
+  int retain = 0;
+  int atomic_save = 0;
+  const char *bench = NULL;
+  int trace = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--index") == 0)
+      index = 1;
+    else if (strcmp(argv[i], "--follow") == 0)
+      follow = 1;
+    else if (strcmp(argv[i], "--view") == 0)
+      view = 1;
+    else if (strcmp(argv[i], "--atomic-save") == 0)
+      atomic_save = 1;
+    else if (strcmp(argv[i], "--retain") == 0 && i + 1 < argc)
+      retain = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+      bench = argv[++i];
+    else if (strcmp(argv[i], "--trace") == 0)
+      trace = 1;
+    else
+      filename = argv[i];
+  }
+
+  // "-" reads the buffer from stdin, so keys must come from the terminal
+  int stream_fd = -1;
+  // Of the file opened, -2 if it can't be
+  int fd = -1;
+  if (filename && strcmp(filename, "-") == 0) {
+    stream_fd = editorStdinToTty();
+    filename = NULL;
+  }
 
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  // --bench types the keys of a script into a headless terminal
+  Term *term = bench ? editorBenchStart(bench) : term_open_tty();
+  if (term == NULL)
+    die("tcgetattr");
+  initEditor(l, term);
+  E.trigram_enabled = index;
+  E.retain = MAX(retain, 0);
+  E.atomic_save = atomic_save;
+  if (trace)
+    trace_start(DITTO_TRACE_SPANS);
+
+  if (stream_fd != -1) {
+    editorStreamStart(stream_fd);
+  } else if (filename && view) {
+    editorViewOpen(filename);
+  } else if (filename && (fd = editorOpenFile(filename)) != -2) {
+    // The followed file keeps changing, there's nothing to recover
+    E.buf->journal_enabled = !follow;
+    editorOpen(filename, fd);
+    // Benchmarks start on the loaded file
+    if (E.bench.enabled) {
+      editorLoadWait();
+      E.bench.open_ms = monotonicMs() - E.bench.start;
+    }
+    if (follow) {
+      editorLoadWait();
+      if (E.retain > 0 && E.buf->numrows > E.retain)
+        editorEvictRows(E.buf->numrows - E.retain);
+      editorFollowStart();
+    }
   }
 
-  editorSetStatusMessage("Ctrl-C to quit. Ctrl-S to save.");
+  // Unless the file couldn't be opened, which the status bar tells
+  if (fd != -2 && (!E.buf->journal || E.buf->dirty == 0))
+    editorSetStatusMessage("Ctrl-C to quit. Ctrl-S to save.");
 
   while (1) {
+    int64_t t = trace_begin();
+    editorProcessEvents();
+    trace_end("events", t);
     editorRefreshScreen();
     editorProcessKeypress();
   }
 
   return 0;
 }
+#endif
@@ -0,0 +1,101 @@
+#include "slice.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dmalloc.h"
+
+static size_t live_count = 0;
+static size_t live_bytes = 0;
+
+Slice *slice_wrap(char *data, size_t len) {
+  Slice *s = dmalloc(sizeof(Slice));
+  s->refs = 1;
+  s->len = len;
+  s->data = data;
+  live_count++;
+  live_bytes += len + 1;
+  return s;
+}
+
+Slice *slice_new(const char *s, size_t len) {
+  char *data = dmalloc(len + 1);
+  memcpy(data, s, len);
+  data[len] = '\0';
+  return slice_wrap(data, len);
+}
+
+Slice *slice_ref(Slice *s) {
+  s->refs++;
+  return s;
+}
+
+// Frees the slice, but not its text
+static void slice_release(Slice *s) {
+  live_count--;
+  live_bytes -= s->len + 1;
+  dfree(s);
+}
+
+void slice_unref(Slice *s) {
+  if (!s || --s->refs > 0)
+    return;
+  dfree(s->data);
+  slice_release(s);
+}
+
+char *slice_take(Slice *s) {
+  if (--s->refs > 0) {
+    char *copy = dmalloc(s->len + 1);
+    memcpy(copy, s->data, s->len + 1);
+    return copy;
+  }
+
+  char *data = s->data;
+  slice_release(s);
+  return data;
+}
+
+size_t slice_count(void) { return live_count; }
+
+size_t slice_bytes(void) { return live_bytes; }
+
+#ifdef TESTS_SLICE
+int main(void) {
+  Slice *s = slice_new("hello", 5);
+  if (s->len != 5 || strcmp(s->data, "hello") != 0 || slice_count() != 1 ||
+      slice_bytes() != 6) {
+    fprintf(stderr, "Wrong new slice\n");
+    exit(1);
+  }
+
+  // Shared: taking copies the text and keeps the slice
+  slice_ref(s);
+  char *copy = slice_take(s);
+  if (copy == s->data || strcmp(copy, "hello") != 0 || s->refs != 1) {
+    fprintf(stderr, "Taking a shared slice should copy it\n");
+    exit(1);
+  }
+  dfree(copy);
+
+  // Last reference: taking hands over the text
+  char *data = s->data;
+  char *own = slice_take(s);
+  if (own != data || slice_count() != 0 || slice_bytes() != 0) {
+    fprintf(stderr, "Taking the last reference should not copy\n");
+    exit(1);
+  }
+
+  // Wrapping takes over a buffer
+  s = slice_wrap(own, 5);
+  slice_ref(s);
+  slice_unref(s);
+  slice_unref(s);
+
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  return 0;
+}
+#endif
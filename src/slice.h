@@ -0,0 +1,41 @@
+#ifndef SLICE_H
+#define SLICE_H
+
+#include <stddef.h>
+
+// Immutable, reference-counted text. Readers share it, a writer first takes
+// its own copy with slice_take, which only copies if someone else still
+// holds a reference. Not thread-safe.
+typedef struct {
+  int refs;
+  size_t len;
+  // NUL-terminated, allocated with dmalloc
+  char *data;
+} Slice;
+
+/**
+ * New slice with a copy of the text.
+ */
+Slice *slice_new(const char *s, size_t len);
+
+/**
+ * New slice taking over data, a dmalloc'd buffer of len bytes plus a NUL.
+ */
+Slice *slice_wrap(char *data, size_t len);
+
+Slice *slice_ref(Slice *s);
+void slice_unref(Slice *s);
+
+/**
+ * Drop a reference, returning the text for the caller to own and modify:
+ * the data itself if it was the last reference, a copy otherwise.
+ */
+char *slice_take(Slice *s);
+
+/**
+ * Live slices and the bytes of their text.
+ */
+size_t slice_count(void);
+size_t slice_bytes(void);
+
+#endif
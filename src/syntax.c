@@ -0,0 +1,473 @@
+#include "syntax.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dmalloc.h"
+
+// Longest span, longer runs are split
+#define HL_SPAN_MAX ((1 << 24) - 1)
+
+static const char *const c_exts[] = {".c",   ".h",  ".cc", ".cpp",
+                                     ".cxx", ".hh", ".hpp", NULL};
+static const char *const c_keywords[] = {
+    "auto",   "break",    "case",   "const",    "continue", "default",
+    "do",     "else",     "enum",   "extern",   "for",      "goto",
+    "if",     "inline",   "register", "restrict", "return", "sizeof",
+    "static", "struct",   "switch", "typedef",  "union",    "volatile",
+    "while",  "NULL",     "true",   "false",    NULL};
+static const char *const c_types[] = {
+    "bool",     "char",     "double",  "float",    "int",      "long",
+    "short",    "signed",   "unsigned", "void",    "size_t",   "ssize_t",
+    "off_t",    "int8_t",   "int16_t", "int32_t",  "int64_t",  "uint8_t",
+    "uint16_t", "uint32_t", "uint64_t", "uintptr_t", "FILE",   NULL};
+
+static const Syntax syntaxes[] = {
+    {"c", c_exts, c_keywords, c_types},
+};
+
+typedef struct {
+  HlSpan *spans;
+  int n;
+  int cap;
+} SpanList;
+
+const Syntax *syntax_for_file(const char *filename) {
+  const char *ext = filename ? strrchr(filename, '.') : NULL;
+  if (!ext)
+    return NULL;
+
+  for (size_t s = 0; s < sizeof(syntaxes) / sizeof(syntaxes[0]); s++)
+    for (const char *const *e = syntaxes[s].exts; *e; e++)
+      if (strcmp(ext, *e) == 0)
+        return &syntaxes[s];
+  return NULL;
+}
+
+// Adds a span, merging it with the previous one when they touch
+static void span_add(SpanList *l, int start, int len, int cls) {
+  if (len <= 0 || cls == HL_NORMAL)
+    return;
+
+  if (l->n > 0) {
+    HlSpan *last = &l->spans[l->n - 1];
+    if (last->cls == (uint32_t)cls && last->start + last->len == (uint32_t)start &&
+        last->len + len <= HL_SPAN_MAX) {
+      last->len += len;
+      return;
+    }
+  }
+
+  while (len > 0) {
+    if (l->n == l->cap) {
+      l->cap = l->cap ? l->cap * 2 : 16;
+      l->spans = drealloc(l->spans, sizeof(HlSpan) * l->cap);
+    }
+    int take = len < HL_SPAN_MAX ? len : HL_SPAN_MAX;
+    l->spans[l->n].start = start;
+    l->spans[l->n].len = take;
+    l->spans[l->n].cls = cls;
+    l->n++;
+    start += take;
+    len -= take;
+  }
+}
+
+static int is_ident(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+static int find_comment_end(const char *text, int len, int from) {
+  for (int j = from; j + 1 < len; j++)
+    if (text[j] == '*' && text[j + 1] == '/')
+      return j + 2;
+  return -1;
+}
+
+// End of a string or char literal opened before from. Sets *open if a
+// backslash at the end of the line continues it on the next one.
+static int find_string_end(const char *text, int len, int from, char quote,
+                           int *open) {
+  *open = 0;
+  for (int j = from; j < len; j++) {
+    if (text[j] == '\\') {
+      if (j + 1 >= len) {
+        *open = 1;
+        return len;
+      }
+      j++;
+    } else if (text[j] == quote) {
+      return j + 1;
+    }
+  }
+  return len;
+}
+
+// End of a preprocessor directive, up to a comment. Sets *open if a
+// backslash at the end of the line continues it on the next one.
+static int find_preproc_end(const char *text, int len, int from, int *open) {
+  *open = 0;
+  for (int j = from; j < len; j++)
+    if (text[j] == '/' && j + 1 < len &&
+        (text[j + 1] == '/' || text[j + 1] == '*'))
+      return j;
+  *open = len > 0 && text[len - 1] == '\\';
+  return len;
+}
+
+static int lookup(const char *const *words, const char *s, int len) {
+  for (; *words; words++)
+    if ((int)strlen(*words) == len && memcmp(*words, s, len) == 0)
+      return 1;
+  return 0;
+}
+
+void syntax_lex(const Syntax *syn, const char *text, int len, int state,
+                HlRow *hl) {
+  SpanList l = {NULL, 0, 0};
+  int i = 0, open, j;
+  hl->start = state;
+
+  // Carry on with what the previous line left open
+  if (state == HL_STATE_COMMENT) {
+    j = find_comment_end(text, len, 0);
+    span_add(&l, 0, j == -1 ? len : j, HL_COMMENT);
+    i = j == -1 ? len : j;
+    state = j == -1 ? HL_STATE_COMMENT : HL_STATE_NORMAL;
+  } else if (state == HL_STATE_STRING) {
+    i = find_string_end(text, len, 0, '"', &open);
+    span_add(&l, 0, i, HL_STRING);
+    state = open ? HL_STATE_STRING : HL_STATE_NORMAL;
+  } else if (state == HL_STATE_PREPROC) {
+    i = find_preproc_end(text, len, 0, &open);
+    span_add(&l, 0, i, HL_PREPROC);
+    state = open ? HL_STATE_PREPROC : HL_STATE_NORMAL;
+  }
+
+  // Only blanks so far, where a directive can start
+  int bol = state == HL_STATE_NORMAL && i == 0;
+
+  while (i < len && state == HL_STATE_NORMAL) {
+    char c = text[i];
+
+    if (c == '/' && i + 1 < len && text[i + 1] == '/') {
+      span_add(&l, i, len - i, HL_COMMENT);
+      i = len;
+    } else if (c == '/' && i + 1 < len && text[i + 1] == '*') {
+      j = find_comment_end(text, len, i + 2);
+      span_add(&l, i, (j == -1 ? len : j) - i, HL_COMMENT);
+      if (j == -1)
+        state = HL_STATE_COMMENT;
+      i = j == -1 ? len : j;
+    } else if (c == '"' || c == '\'') {
+      j = find_string_end(text, len, i + 1, c, &open);
+      span_add(&l, i, j - i, HL_STRING);
+      if (open && c == '"')
+        state = HL_STATE_STRING;
+      i = j;
+    } else if (c == '#' && bol) {
+      j = find_preproc_end(text, len, i, &open);
+      span_add(&l, i, j - i, HL_PREPROC);
+      if (open)
+        state = HL_STATE_PREPROC;
+      i = j;
+    } else if (isdigit((unsigned char)c) && (i == 0 || !is_ident(text[i - 1]))) {
+      j = i + 1;
+      while (j < len && (is_ident(text[j]) || text[j] == '.'))
+        j++;
+      span_add(&l, i, j - i, HL_NUMBER);
+      i = j;
+    } else if (is_ident(c)) {
+      j = i + 1;
+      while (j < len && is_ident(text[j]))
+        j++;
+      if (lookup(syn->keywords, text + i, j - i))
+        span_add(&l, i, j - i, HL_KEYWORD);
+      else if (lookup(syn->types, text + i, j - i))
+        span_add(&l, i, j - i, HL_TYPE);
+      i = j;
+    } else {
+      i++;
+    }
+
+    if (!isspace((unsigned char)c))
+      bol = 0;
+  }
+
+  // Keep exactly what's needed
+  dfree(hl->spans);
+  hl->spans = NULL;
+  if (l.n > 0) {
+    hl->spans = dmalloc(sizeof(HlSpan) * l.n);
+    memcpy(hl->spans, l.spans, sizeof(HlSpan) * l.n);
+  }
+  hl->nspans = l.n;
+  hl->end = state;
+  hl->valid = 1;
+  hl->dropped = 0;
+  dfree(l.spans);
+}
+
+long syntax_update(const Syntax *syn, SyntaxLineFn line, void *ctx, long from,
+                   long to) {
+  const char *text;
+  int len;
+  int state = from > 0 ? line(ctx, from - 1, &text, &len)->end
+                       : HL_STATE_NORMAL;
+  long lexed = 0;
+
+  for (long i = from; i < to; i++) {
+    HlRow *hl = line(ctx, i, &text, &len);
+    if (!hl->valid || hl->start != state) {
+      syntax_lex(syn, text, len, state, hl);
+      lexed++;
+    }
+    state = hl->end;
+  }
+  return lexed;
+}
+
+void syntax_free(HlRow *hl) {
+  dfree(hl->spans);
+  hl->spans = NULL;
+  hl->nspans = 0;
+  hl->valid = 0;
+  hl->dropped = 0;
+}
+
+void syntax_drop(HlRow *hl) {
+  if (!hl->valid)
+    return;
+  dfree(hl->spans);
+  hl->spans = NULL;
+  hl->nspans = 0;
+  hl->dropped = 1;
+}
+
+#if defined(TESTS_SYNTAX) || defined(BENCH_SYNTAX)
+#include <time.h>
+
+typedef struct {
+  char *text;
+  int len;
+  HlRow hl;
+} TestLine;
+
+static TestLine *test_lines;
+static long test_n;
+
+static HlRow *test_line(void *ctx, long i, const char **text, int *len) {
+  (void)ctx;
+  *text = test_lines[i].text;
+  *len = test_lines[i].len;
+  return &test_lines[i].hl;
+}
+
+static void test_set(long i, const char *s) {
+  dfree(test_lines[i].text);
+  test_lines[i].text = dstrdup(s);
+  test_lines[i].len = strlen(s);
+  test_lines[i].hl.valid = 0;
+}
+
+// A C file of n lines, made of repeated functions
+static void test_generate(long n) {
+  static const char *const snippet[] = {
+      "#include <stdio.h>",
+      "/* Adds the numbers",
+      " * of the two arguments */",
+      "static int add(int a, int b) {",
+      "  const char *s = \"a string with // inside\";",
+      "  long x = 0x1f + 42; // trailing comment",
+      "  if (a > b)",
+      "    return a + b;",
+      "  return sizeof(s) + x;",
+      "}",
+  };
+  int nsnippet = sizeof(snippet) / sizeof(snippet[0]);
+
+  test_n = n;
+  test_lines = dmalloc(sizeof(TestLine) * n);
+  memset(test_lines, 0, sizeof(TestLine) * n);
+  for (long i = 0; i < n; i++)
+    test_set(i, snippet[i % nsnippet]);
+}
+
+static void test_destroy(void) {
+  for (long i = 0; i < test_n; i++) {
+    dfree(test_lines[i].text);
+    syntax_free(&test_lines[i].hl);
+  }
+  dfree(test_lines);
+}
+#endif
+
+#ifdef TESTS_SYNTAX
+static int test_class_at(HlRow *hl, int col) {
+  for (int s = 0; s < hl->nspans; s++)
+    if ((int)hl->spans[s].start <= col &&
+        col < (int)(hl->spans[s].start + hl->spans[s].len))
+      return hl->spans[s].cls;
+  return HL_NORMAL;
+}
+
+int main(void) {
+  const Syntax *syn = syntax_for_file("dir/file.c");
+  if (!syn || syntax_for_file("notes.txt") || syntax_for_file("Makefile")) {
+    fprintf(stderr, "Wrong syntax lookup\n");
+    exit(1);
+  }
+
+  // --------- Classes ---------
+  HlRow hl = {NULL, 0, 0, 0, 0, 0};
+  const char *line = "  int x = 42; /* c */ return \"s\\\"t\"; // end";
+  syntax_lex(syn, line, strlen(line), HL_STATE_NORMAL, &hl);
+  if (test_class_at(&hl, 2) != HL_TYPE || test_class_at(&hl, 6) != HL_NORMAL ||
+      test_class_at(&hl, 10) != HL_NUMBER ||
+      test_class_at(&hl, 15) != HL_COMMENT ||
+      test_class_at(&hl, 22) != HL_KEYWORD ||
+      test_class_at(&hl, 31) != HL_STRING ||
+      test_class_at(&hl, 40) != HL_COMMENT || hl.end != HL_STATE_NORMAL) {
+    fprintf(stderr, "Wrong classes\n");
+    exit(1);
+  }
+
+  // --------- States carried across lines ---------
+  line = "x = 1; /* open";
+  syntax_lex(syn, line, strlen(line), HL_STATE_NORMAL, &hl);
+  if (hl.end != HL_STATE_COMMENT) {
+    fprintf(stderr, "Comment should stay open\n");
+    exit(1);
+  }
+  line = "still */ int";
+  syntax_lex(syn, line, strlen(line), HL_STATE_COMMENT, &hl);
+  if (test_class_at(&hl, 0) != HL_COMMENT || test_class_at(&hl, 9) != HL_TYPE ||
+      hl.end != HL_STATE_NORMAL) {
+    fprintf(stderr, "Comment should close\n");
+    exit(1);
+  }
+  line = "#define M(x) \\";
+  syntax_lex(syn, line, strlen(line), HL_STATE_NORMAL, &hl);
+  if (hl.end != HL_STATE_PREPROC || test_class_at(&hl, 3) != HL_PREPROC) {
+    fprintf(stderr, "Directive should continue\n");
+    exit(1);
+  }
+  syntax_free(&hl);
+
+  // --------- Incremental updates ---------
+  test_generate(100000);
+  long lexed = syntax_update(syn, test_line, NULL, 0, test_n);
+  if (lexed != test_n) {
+    fprintf(stderr, "Everything is lexed the first time\n");
+    exit(1);
+  }
+  if (syntax_update(syn, test_line, NULL, 0, test_n) != 0) {
+    fprintf(stderr, "Nothing to lex without edits\n");
+    exit(1);
+  }
+
+  // Edits which don't change the end state only lex the line
+  test_set(50003, "static long add(long a, long b) {");
+  if ((lexed = syntax_update(syn, test_line, NULL, 0, test_n)) != 1) {
+    fprintf(stderr, "Expected 1 line lexed, got %ld\n", lexed);
+    exit(1);
+  }
+
+  // Opening a comment lexes until the state matches again, the line after
+  // the next comment opening
+  test_set(50005, "  long x = 0x1f + 42; /* trailing comment");
+  if ((lexed = syntax_update(syn, test_line, NULL, 0, test_n)) != 7 ||
+      test_class_at(&test_lines[50006].hl, 4) != HL_COMMENT) {
+    fprintf(stderr, "Expected 7 lines lexed, got %ld\n", lexed);
+    exit(1);
+  }
+
+  // Dropped spans come back from the kept start state, and the lines after
+  // aren't lexed again
+  for (long i = 0; i < test_n; i++)
+    syntax_drop(&test_lines[i].hl);
+  if (syntax_update(syn, test_line, NULL, 0, test_n) != 0 ||
+      !test_lines[50006].hl.dropped) {
+    fprintf(stderr, "Dropped spans should keep the states\n");
+    exit(1);
+  }
+  for (long i = 0; i < test_n; i++) {
+    TestLine *l = &test_lines[i];
+    syntax_lex(syn, l->text, l->len, l->hl.start, &l->hl);
+  }
+  if (test_class_at(&test_lines[50006].hl, 4) != HL_COMMENT) {
+    fprintf(stderr, "Dropped spans should come back\n");
+    exit(1);
+  }
+
+  // Same result as lexing everything again
+  for (long i = 0; i < test_n; i++) {
+    HlRow full = {NULL, 0, 0, 0, 0, 0};
+    int state = i > 0 ? test_lines[i - 1].hl.end : HL_STATE_NORMAL;
+    syntax_lex(syn, test_lines[i].text, test_lines[i].len, state, &full);
+    if (full.nspans != test_lines[i].hl.nspans || full.end != test_lines[i].hl.end ||
+        (full.nspans && memcmp(full.spans, test_lines[i].hl.spans,
+                               sizeof(HlSpan) * full.nspans) != 0)) {
+      fprintf(stderr, "Line %ld differs from a full lex\n", i);
+      exit(1);
+    }
+    syntax_free(&full);
+  }
+
+  test_destroy();
+
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  return 0;
+}
+#endif
+
+#ifdef BENCH_SYNTAX
+// Re-highlighting after edits on a 100k-line C file, as the editor does:
+// lines are lexed from the edit down to the end of the screen
+#define BENCH_LINES 100000
+#define BENCH_SCREEN 50
+#define BENCH_ROUNDS 1000
+
+static double test_now_ms(void) {
+  return clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+int main(void) {
+  const Syntax *syn = syntax_for_file("bench.c");
+  test_generate(BENCH_LINES);
+
+  double start = test_now_ms();
+  syntax_update(syn, test_line, NULL, 0, test_n);
+  double full = test_now_ms() - start;
+
+  // One char typed in a line in the middle of the screen
+  long lexed = 0;
+  start = test_now_ms();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    long at = (long)r * 97 % (BENCH_LINES - BENCH_SCREEN);
+    test_lines[at].hl.valid = 0;
+    lexed += syntax_update(syn, test_line, NULL, at, at + BENCH_SCREEN);
+  }
+  double edit = (test_now_ms() - start) / BENCH_ROUNDS;
+
+  // A comment opened and closed again, in the worst case all the lines
+  // below are relexed until the state matches again
+  start = test_now_ms();
+  test_set(10, "/* open");
+  long opened = syntax_update(syn, test_line, NULL, 10, test_n);
+  test_set(10, "#include <stdio.h>");
+  long closed = syntax_update(syn, test_line, NULL, 10, test_n);
+  double comment = test_now_ms() - start;
+
+  printf("Full highlight of %d lines:        %8.2f ms\n", BENCH_LINES, full);
+  printf("Re-highlight after an edit:         %8.4f ms (%.1f lines)\n", edit,
+         (double)lexed / BENCH_ROUNDS);
+  printf("Open and close a comment:           %8.2f ms (%ld + %ld lines)\n",
+         comment, opened, closed);
+
+  test_destroy();
+  return 0;
+}
+#endif
@@ -0,0 +1,90 @@
+#ifndef SYNTAX_H
+#define SYNTAX_H
+
+#include <stdint.h>
+
+// Highlight classes, 0 is plain text
+enum HlClass {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_STRING,
+  HL_NUMBER,
+  HL_KEYWORD,
+  HL_TYPE,
+  HL_PREPROC,
+};
+
+// Lexer state at the end of a line, carried over to the next one
+enum HlState {
+  HL_STATE_NORMAL = 0,
+  HL_STATE_COMMENT,
+  HL_STATE_STRING,
+  HL_STATE_PREPROC,
+};
+
+// Run of text of a class other than HL_NORMAL
+typedef struct {
+  uint32_t start;
+  uint32_t len : 24;
+  uint32_t cls : 8;
+} HlSpan;
+
+// Highlight of a line, cached along with the states it was lexed from and
+// ended in
+typedef struct {
+  HlSpan *spans;
+  int nspans;
+  unsigned char start;
+  unsigned char end;
+  // Cleared when the text of the line changes
+  unsigned char valid;
+  // Set when the spans were dropped to save memory, the states are still
+  // valid and lexing from start gets the spans back
+  unsigned char dropped;
+} HlRow;
+
+typedef struct {
+  const char *name;
+  // File extensions, including the dot
+  const char *const *exts;
+  const char *const *keywords;
+  const char *const *types;
+} Syntax;
+
+// Returns the text of line i and its highlight
+typedef HlRow *(*SyntaxLineFn)(void *ctx, long i, const char **text,
+                               int *len);
+
+/**
+ * Syntax for the file name, NULL if there's none.
+ */
+const Syntax *syntax_for_file(const char *filename);
+
+/**
+ * Lex a line starting in the given state, replacing the spans of hl.
+ */
+void syntax_lex(const Syntax *syn, const char *text, int len, int state,
+                HlRow *hl);
+
+/**
+ * Bring the highlight of lines [from, to) up to date, given that the lines
+ * before from are. Only lines whose text changed or which now start in a
+ * different state are lexed again, so after an edit the cost is the lines
+ * from the edit until the end state matches the cached one. Returns the
+ * number of lines lexed.
+ */
+long syntax_update(const Syntax *syn, SyntaxLineFn line, void *ctx, long from,
+                   long to);
+
+/**
+ * Free the spans of a line.
+ */
+void syntax_free(HlRow *hl);
+
+/**
+ * Free the spans of a line but keep its states, so that the lines after it
+ * don't need to be lexed again.
+ */
+void syntax_drop(HlRow *hl);
+
+#endif
@@ -0,0 +1,365 @@
+#include "term.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "dmalloc.h"
+
+// Bytes pushed back
+#define TERM_UNREAD 8
+// Longest control sequence understood by the headless screen
+#define TERM_SEQ 32
+
+struct Term {
+  int headless;
+  size_t written;
+  unsigned char unread[TERM_UNREAD];
+  int nunread;
+
+  // Terminal
+  int in, out;
+  struct termios orig;
+
+  // Headless: the keys left to type, and the screen, rows lines of cols
+  // characters and a NUL each
+  const char *keys;
+  size_t nkeys;
+  size_t pos;
+  int rows, cols;
+  char *screen;
+  int cy, cx;
+  // Control sequence being parsed, split across writes
+  char seq[TERM_SEQ];
+  int seqlen;
+};
+
+Term *term_open_tty(void) {
+  Term *t = dmalloc(sizeof(Term));
+  memset(t, 0, sizeof(Term));
+  t->in = STDIN_FILENO;
+  t->out = STDOUT_FILENO;
+
+  if (tcgetattr(t->in, &t->orig) == -1) {
+    dfree(t);
+    return NULL;
+  }
+
+  struct termios raw = t->orig;
+
+  // Disabling some Input flags:
+  // - Break condition causing sigint
+  // - Signal ctrl-m (fix specific)
+  // - Parity check (old)
+  // - 8th bit each input being stripped out
+  // - Signals flow control (ctrl-s, ctrl-q)
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+
+  // Disabling some Output flags:
+  // - Output processing (\n, \r\n) -> must add \r ourself now
+  raw.c_oflag &= ~(OPOST);
+
+  // Disabling some Local flags:
+  // - Echoing
+  // - Canonical (byte by byte read) mode
+  // - Signals Ctrl-v (wait input), ctrl-o fix in macos
+  // - Signals int and tstp (ctrl-c, ctrl-z)
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+
+  // Disabling some Control flags:
+  // - Old stuff
+  raw.c_cflag |= (CS8);
+
+  // Setting some Control Characters:
+  // read() witll return as soon as any byte is read
+  raw.c_cc[VMIN] = 0;
+  // max amount of time to wait before read() returns (tenths of a second)
+  raw.c_cc[VTIME] = 1;
+
+  if (tcsetattr(t->in, TCSAFLUSH, &raw) == -1) {
+    dfree(t);
+    return NULL;
+  }
+  return t;
+}
+
+Term *term_open_headless(int rows, int cols, const char *keys, size_t len) {
+  Term *t = dmalloc(sizeof(Term));
+  memset(t, 0, sizeof(Term));
+  t->headless = 1;
+  t->in = -1;
+  t->out = -1;
+  t->keys = keys;
+  t->nkeys = len;
+  t->rows = rows;
+  t->cols = cols;
+  t->screen = dmalloc((size_t)rows * (cols + 1));
+  for (int y = 0; y < rows; y++) {
+    memset(t->screen + (size_t)y * (cols + 1), ' ', cols);
+    t->screen[(size_t)y * (cols + 1) + cols] = '\0';
+  }
+  return t;
+}
+
+void term_close(Term *t) {
+  if (!t->headless)
+    tcsetattr(t->in, TCSAFLUSH, &t->orig);
+  dfree(t->screen);
+  dfree(t);
+}
+
+// Asks the terminal where the cursor is, as a fallback to find its size
+static int term_cursor_position(Term *t, int *rows, int *cols) {
+  char buf[32];
+  unsigned long i = 0;
+
+  if (write(t->out, "\x1b[6n", 4) != 4)
+    return -1;
+
+  while (i < sizeof(buf) - 1) {
+    if (read(t->in, &buf[i], 1) != 1)
+      break;
+    if (buf[i] == 'R')
+      break;
+    i++;
+  }
+  buf[i] = '\0';
+
+  if (buf[0] != '\x1b' || buf[1] != '[')
+    return -1;
+  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+    return -1;
+
+  return 0;
+}
+
+int term_size(Term *t, int *rows, int *cols) {
+  if (t->headless) {
+    *rows = t->rows;
+    *cols = t->cols;
+    return 0;
+  }
+
+  struct winsize ws;
+
+  // Get the size of the terminals on most systems
+  // (Terminal Input Output Control Get WINdow SiZe)
+  // There is a fallback in case it would fail
+  if (ioctl(t->out, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    // Position the cursor to the bottom right and get rows,cols (use 999 just
+    // to be sure)
+    if (write(t->out, "\x1b[999C\x1b[999B", 12) != 12)
+      return -1;
+
+    return term_cursor_position(t, rows, cols);
+  }
+
+  *cols = ws.ws_col;
+  *rows = ws.ws_row;
+
+  return 0;
+}
+
+int term_fd(Term *t) { return t->in; }
+
+int term_read(Term *t, unsigned char *c) {
+  if (t->nunread > 0) {
+    *c = t->unread[--t->nunread];
+    return 1;
+  }
+  if (t->headless) {
+    if (t->pos == t->nkeys)
+      return 0;
+    *c = (unsigned char)t->keys[t->pos++];
+    return 1;
+  }
+
+  ssize_t nread = read(t->in, c, 1);
+  if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  return (int)nread;
+}
+
+void term_unread(Term *t, unsigned char c) {
+  if (t->nunread < TERM_UNREAD)
+    t->unread[t->nunread++] = c;
+}
+
+int term_pending(Term *t) {
+  return t->nunread > 0 || (t->headless && t->pos < t->nkeys);
+}
+
+int term_eof(Term *t) {
+  return t->headless && t->nunread == 0 && t->pos == t->nkeys;
+}
+
+static void term_erase(Term *t, int y, int from) {
+  if (y < 0 || y >= t->rows || from >= t->cols)
+    return;
+  from = from < 0 ? 0 : from;
+  memset(t->screen + (size_t)y * (t->cols + 1) + from, ' ', t->cols - from);
+}
+
+// Applies a complete control sequence: cursor moves and erases, anything
+// else (colors, cursor shape...) doesn't change the text
+static void term_control(Term *t) {
+  char final = t->seq[t->seqlen - 1];
+  int args[2] = {0, 0}, nargs = 0;
+  for (int j = 2; j < t->seqlen - 1 && nargs < 2; j++) {
+    if (t->seq[j] >= '0' && t->seq[j] <= '9')
+      args[nargs] = args[nargs] * 10 + (t->seq[j] - '0');
+    else if (t->seq[j] == ';')
+      nargs++;
+    else if (t->seq[j] != '?' && t->seq[j] != ' ')
+      return;
+  }
+
+  switch (final) {
+  case 'H':
+    t->cy = (args[0] ? args[0] : 1) - 1;
+    t->cx = (args[1] ? args[1] : 1) - 1;
+    break;
+  case 'B':
+    t->cy += args[0] ? args[0] : 1;
+    break;
+  case 'C':
+    t->cx += args[0] ? args[0] : 1;
+    break;
+  case 'K':
+    term_erase(t, t->cy, t->cx);
+    break;
+  case 'J':
+    if (args[0] == 2)
+      for (int y = 0; y < t->rows; y++)
+        term_erase(t, y, 0);
+    break;
+  }
+  t->cy = t->cy < 0 ? 0 : t->cy >= t->rows ? t->rows - 1 : t->cy;
+  t->cx = t->cx < 0 ? 0 : t->cx > t->cols ? t->cols : t->cx;
+}
+
+static void term_put(Term *t, unsigned char c) {
+  if (t->seqlen > 0) {
+    t->seq[t->seqlen++] = c;
+    // The final byte of a CSI sequence is in @..~
+    if ((t->seqlen == 2 && c != '[') ||
+        (t->seqlen > 2 && c >= '@' && c <= '~')) {
+      if (t->seqlen > 2)
+        term_control(t);
+      t->seqlen = 0;
+    } else if (t->seqlen == TERM_SEQ) {
+      t->seqlen = 0;
+    }
+    return;
+  }
+
+  if (c == '\x1b') {
+    t->seq[t->seqlen++] = c;
+  } else if (c == '\r') {
+    t->cx = 0;
+  } else if (c == '\n') {
+    if (t->cy < t->rows - 1)
+      t->cy++;
+  } else if (c >= ' ' && (c & 0xC0) != 0x80) {
+    if (t->cx < t->cols)
+      t->screen[(size_t)t->cy * (t->cols + 1) + t->cx] = c < 0x80 ? c : '?';
+    t->cx++;
+  }
+}
+
+ssize_t term_write(Term *t, const char *buf, size_t len) {
+  t->written += len;
+  if (!t->headless)
+    return write(t->out, buf, len);
+
+  for (size_t j = 0; j < len; j++)
+    term_put(t, (unsigned char)buf[j]);
+  return (ssize_t)len;
+}
+
+size_t term_written(Term *t) { return t->written; }
+
+const char *term_line(Term *t, int y) {
+  return t->screen + (size_t)y * (t->cols + 1);
+}
+
+void term_cursor(Term *t, int *y, int *x) {
+  *y = t->cy;
+  *x = t->cx;
+}
+
+#ifdef TESTS_TERM
+static void expect_line(Term *t, int y, const char *text) {
+  char want[128];
+  snprintf(want, sizeof(want), "%-20s", text);
+  if (strcmp(term_line(t, y), want) != 0) {
+    fprintf(stderr, "Line %d is '%s', expected '%s'\n", y, term_line(t, y),
+            want);
+    exit(1);
+  }
+}
+
+int main(void) {
+  const char keys[] = "\x1bj\x1b[A";
+  Term *t = term_open_headless(4, 20, keys, sizeof(keys) - 1);
+  int rows, cols;
+  if (term_size(t, &rows, &cols) != 0 || rows != 4 || cols != 20) {
+    fprintf(stderr, "Wrong size %dx%d\n", rows, cols);
+    exit(1);
+  }
+
+  // --------- Keys, with a byte pushed back ---------
+  unsigned char c;
+  if (term_read(t, &c) != 1 || c != '\x1b' || term_read(t, &c) != 1 ||
+      c != 'j') {
+    fprintf(stderr, "Wrong keys\n");
+    exit(1);
+  }
+  term_unread(t, c);
+  if (!term_pending(t) || term_read(t, &c) != 1 || c != 'j') {
+    fprintf(stderr, "Byte pushed back not read again\n");
+    exit(1);
+  }
+  for (int j = 0; j < 3; j++)
+    term_read(t, &c);
+  if (c != 'A' || !term_eof(t) || term_read(t, &c) != 0) {
+    fprintf(stderr, "Script not over\n");
+    exit(1);
+  }
+
+  // --------- Screen ---------
+  const char frame[] = "\x1b[?25l\x1b[Hhello\r\nworld\x1b[2;3H\x1b[K"
+                       "\x1b[7mX\x1b[m\x1b[4;18Habcdef\xc3\xa9";
+  // Sequences may be split across writes
+  term_write(t, frame, 9);
+  term_write(t, frame + 9, sizeof(frame) - 1 - 9);
+  expect_line(t, 0, "hello");
+  expect_line(t, 1, "woX");
+  expect_line(t, 2, "");
+  expect_line(t, 3, "                 abc");
+  if (term_written(t) != sizeof(frame) - 1) {
+    fprintf(stderr, "Wrong count of bytes written\n");
+    exit(1);
+  }
+
+  const char more[] = "\x1b[4;1H\xc3\xa9t\xc3\xa9\x1b[2J";
+  term_write(t, more, sizeof(more) - 1);
+  int y, x;
+  term_cursor(t, &y, &x);
+  expect_line(t, 3, "");
+  if (y != 3 || x != 3) {
+    fprintf(stderr, "Cursor at %d,%d\n", y, x);
+    exit(1);
+  }
+
+  term_close(t);
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked %zu bytes\n", used_memory());
+    exit(1);
+  }
+  printf("All tests passed\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,76 @@
+#ifndef TERM_H
+#define TERM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Where keys come from and the screen goes to: the terminal on stdin and
+// stdout, or a headless one replaying a script of keys into a screen kept in
+// memory, for tests and benchmarks
+typedef struct Term Term;
+
+/**
+ * Put the terminal on stdin in raw mode, writing to stdout. Returns NULL on
+ * failure.
+ */
+Term *term_open_tty(void);
+
+/**
+ * Headless terminal of the given size, typing the len bytes of keys.
+ */
+Term *term_open_headless(int rows, int cols, const char *keys, size_t len);
+
+/**
+ * Restore the mode of the terminal and free it.
+ */
+void term_close(Term *t);
+
+/**
+ * Size of the screen. Returns -1 on failure.
+ */
+int term_size(Term *t, int *rows, int *cols);
+
+/**
+ * Descriptor to poll for keys, -1 if there's none (headless).
+ */
+int term_fd(Term *t);
+
+/**
+ * Read a byte of input, waiting a little for it on a terminal. Bytes pushed
+ * back come first. Returns 1, 0 if there's none, -1 on error.
+ */
+int term_read(Term *t, unsigned char *c);
+
+/**
+ * Push a byte back, to be read again first.
+ */
+void term_unread(Term *t, unsigned char c);
+
+/**
+ * Nonzero if a byte can be read right away.
+ */
+int term_pending(Term *t);
+
+/**
+ * Nonzero once the keys of a headless terminal have all been read.
+ */
+int term_eof(Term *t);
+
+/**
+ * Write to the screen. Returns the bytes written or -1.
+ */
+ssize_t term_write(Term *t, const char *buf, size_t len);
+
+/**
+ * Bytes written so far.
+ */
+size_t term_written(Term *t);
+
+/**
+ * Text of line y of a headless screen, NUL-terminated, and the cursor
+ * position. Characters other than ASCII are kept as '?', a column each.
+ */
+const char *term_line(Term *t, int y);
+void term_cursor(Term *t, int *y, int *x);
+
+#endif
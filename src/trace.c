@@ -0,0 +1,166 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dmalloc.h"
+
+typedef struct {
+  const char *name;
+  int64_t start;
+  int64_t dur;
+} TraceSpan;
+
+int trace_enabled;
+
+// Ring of the last cap spans, the next one going at next
+static TraceSpan *spans;
+static size_t cap, next, count;
+
+void trace_start(size_t size) {
+  if (size == 0)
+    size = 1;
+  if (size != cap) {
+    dfree(spans);
+    spans = dmalloc(sizeof(TraceSpan) * size);
+    cap = size;
+  }
+  next = 0;
+  count = 0;
+  trace_enabled = 1;
+}
+
+void trace_stop(void) { trace_enabled = 0; }
+
+void trace_free(void) {
+  trace_enabled = 0;
+  dfree(spans);
+  spans = NULL;
+  cap = next = count = 0;
+}
+
+int64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_record(const char *name, int64_t start) {
+  // Started before the trace was freed
+  if (spans == NULL)
+    return;
+
+  TraceSpan *s = &spans[next];
+  s->name = name;
+  s->start = start;
+  s->dur = trace_now() - start;
+  next = next + 1 == cap ? 0 : next + 1;
+  if (count < cap)
+    count++;
+}
+
+size_t trace_count(void) { return count; }
+
+// Complete events ("ph": "X") of the main thread, in microseconds from the
+// oldest span. Spans recorded within another one nest under it.
+int trace_write(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+
+  int pid = (int)getpid();
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(fp,
+          "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+          "\"args\": {\"name\": \"ditto\"}}",
+          pid);
+  size_t first = (next + cap - count) % (cap ? cap : 1);
+  int64_t origin = count ? spans[first].start : 0;
+  for (size_t j = 0; j < count; j++) {
+    TraceSpan *s = &spans[(first + j) % cap];
+    fprintf(fp,
+            ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+            "\"ts\": %.3f, \"dur\": %.3f}",
+            s->name, pid, pid, (s->start - origin) / 1000.0, s->dur / 1000.0);
+  }
+  fprintf(fp, "\n]}\n");
+
+  int err = ferror(fp);
+  if (fclose(fp) != 0 || err)
+    return -1;
+  return 0;
+}
+
+#ifdef TESTS_TRACE
+int main(void) {
+  const char *names[] = {"a", "b", "c", "d", "e", "f"};
+
+  // --------- Disabled ---------
+  trace_end("off", trace_begin());
+  if (trace_count() != 0) {
+    fprintf(stderr, "Span recorded while disabled\n");
+    exit(1);
+  }
+
+  // --------- Ring ---------
+  trace_start(4);
+  for (int j = 0; j < 6; j++) {
+    int64_t t = trace_begin();
+    trace_end(names[j], t);
+  }
+  if (trace_count() != 4) {
+    fprintf(stderr, "%zu spans, expected 4\n", trace_count());
+    exit(1);
+  }
+
+  // A span ending once stopped is still recorded
+  int64_t t = trace_begin();
+  trace_stop();
+  trace_end("g", t);
+  trace_end("h", trace_begin());
+
+  // --------- Export ---------
+  char path[] = "/tmp/ditto-trace-test.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1 || trace_write(path) != 0) {
+    fprintf(stderr, "Failed to write the trace\n");
+    exit(1);
+  }
+  close(fd);
+
+  FILE *fp = fopen(path, "r");
+  char json[4096];
+  size_t len = fread(json, 1, sizeof(json) - 1, fp);
+  json[len] = '\0';
+  fclose(fp);
+  unlink(path);
+
+  // The 4 latest spans, oldest first
+  const char *want[] = {"\"d\"", "\"e\"", "\"f\"", "\"g\""};
+  const char *p = json;
+  for (int j = 0; j < 4; j++) {
+    p = strstr(p, want[j]);
+    if (p == NULL) {
+      fprintf(stderr, "Span %s missing or out of order in:\n%s", want[j],
+              json);
+      exit(1);
+    }
+  }
+  if (strstr(json, "\"c\"") || strstr(json, "\"h\"") ||
+      strncmp(json, "{\"displayTimeUnit\"", 18) != 0 ||
+      strcmp(json + len - 4, "\n]}\n") != 0) {
+    fprintf(stderr, "Wrong trace:\n%s", json);
+    exit(1);
+  }
+
+  trace_free();
+  trace_end("freed", t);
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked %zu bytes\n", used_memory());
+    exit(1);
+  }
+  printf("All tests passed\n");
+  return 0;
+}
+#endif
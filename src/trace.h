@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Spans of time spent in the stages of the main loop, kept in a ring of the
+// latest ones and written out as a Chrome trace, for chrome://tracing or
+// ui.perfetto.dev
+
+// Nonzero while spans are recorded. trace_begin tests it inline, so that a
+// span costs a load and a branch when tracing is off.
+extern int trace_enabled;
+
+/**
+ * Start recording into a ring of the last cap spans, dropping the spans
+ * recorded before. The ring is allocated here, recording never allocates.
+ */
+void trace_start(size_t cap);
+
+/**
+ * Stop recording, keeping the spans recorded.
+ */
+void trace_stop(void);
+
+/**
+ * Free the spans.
+ */
+void trace_free(void);
+
+/**
+ * Monotonic clock, in nanoseconds.
+ */
+int64_t trace_now(void);
+
+/**
+ * Record the span name from start until now. name must outlive the trace
+ * (a string literal).
+ */
+void trace_record(const char *name, int64_t start);
+
+/**
+ * Start of a span, 0 if tracing is off.
+ */
+static inline int64_t trace_begin(void) {
+  return trace_enabled ? trace_now() : 0;
+}
+
+/**
+ * End of the span name started at start, if any.
+ */
+static inline void trace_end(const char *name, int64_t start) {
+  if (start)
+    trace_record(name, start);
+}
+
+/**
+ * Number of spans in the ring.
+ */
+size_t trace_count(void);
+
+/**
+ * Write the spans in the ring, oldest first, as Chrome trace JSON. Returns
+ * -1 on failure.
+ */
+int trace_write(const char *path);
+
+#endif
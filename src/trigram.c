@@ -0,0 +1,408 @@
+#include "trigram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dmalloc.h"
+
+#define TRI_INITIAL_SLOTS 4096
+#define TRI_READ_CHUNK (1 << 20)
+#define TRI_MAGIC "DTRI0002"
+#define TRI_MAGIC_SZ 8
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static size_t tri_hash(uint32_t tri, size_t nslots) {
+  // Fibonacci hashing, nslots is always a power of two
+  return (size_t)((tri * 2654435769u) >> 8) & (nslots - 1);
+}
+
+static TrigramIndex *tri_create(void) {
+  TrigramIndex *t = dmalloc(sizeof(TrigramIndex));
+  t->nslots = TRI_INITIAL_SLOTS;
+  t->slots = dmalloc(sizeof(TrigramPosting) * t->nslots);
+  memset(t->slots, 0, sizeof(TrigramPosting) * t->nslots);
+  t->nterms = 0;
+  t->npostings = 0;
+  t->nrows = 0;
+  t->fsize = 0;
+  t->fmtime = 0;
+  t->build_ms = 0;
+  t->from_cache = 0;
+  return t;
+}
+
+static TrigramPosting *tri_lookup(TrigramIndex *t, uint32_t tri) {
+  size_t i = tri_hash(tri, t->nslots);
+  while (t->slots[i].tri != 0) {
+    if (t->slots[i].tri == tri)
+      return &t->slots[i];
+    i = (i + 1) & (t->nslots - 1);
+  }
+  return NULL;
+}
+
+static void tri_grow(TrigramIndex *t) {
+  TrigramPosting *old = t->slots;
+  size_t oldn = t->nslots;
+
+  t->nslots *= 2;
+  t->slots = dmalloc(sizeof(TrigramPosting) * t->nslots);
+  memset(t->slots, 0, sizeof(TrigramPosting) * t->nslots);
+
+  for (size_t j = 0; j < oldn; j++) {
+    if (old[j].tri == 0)
+      continue;
+    size_t i = tri_hash(old[j].tri, t->nslots);
+    while (t->slots[i].tri != 0)
+      i = (i + 1) & (t->nslots - 1);
+    t->slots[i] = old[j];
+  }
+
+  dfree(old);
+}
+
+// Returns the posting list for the trigram, creating it if missing
+static TrigramPosting *tri_slot(TrigramIndex *t, uint32_t tri) {
+  // Keep the load factor under 1/2
+  if ((t->nterms + 1) * 2 > t->nslots)
+    tri_grow(t);
+
+  size_t i = tri_hash(tri, t->nslots);
+  while (t->slots[i].tri != 0) {
+    if (t->slots[i].tri == tri)
+      return &t->slots[i];
+    i = (i + 1) & (t->nslots - 1);
+  }
+
+  t->slots[i].tri = tri;
+  t->slots[i].len = 0;
+  t->slots[i].cap = 0;
+  t->slots[i].rows = NULL;
+  t->nterms++;
+  return &t->slots[i];
+}
+
+static void tri_add(TrigramIndex *t, uint32_t tri, uint32_t row) {
+  TrigramPosting *p = tri_slot(t, tri);
+
+  // Rows are added in order, so deduplicating only needs the last one
+  if (p->len > 0 && p->rows[p->len - 1] == row)
+    return;
+
+  if (p->len == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 4;
+    p->rows = drealloc(p->rows, sizeof(uint32_t) * p->cap);
+  }
+  p->rows[p->len++] = row;
+  t->npostings++;
+}
+
+TrigramIndex *tri_build_file(const char *path, uint64_t fsize,
+                             int64_t fmtime) {
+  double start = now_ms();
+
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+
+  TrigramIndex *t = tri_create();
+  t->fsize = fsize;
+  t->fmtime = fmtime;
+
+  char *buf = dmalloc(TRI_READ_CHUNK);
+  uint32_t row = 0;
+  // Rolling window of the last bytes in the current line, and how many of
+  // them are valid
+  uint32_t window = 0;
+  int valid = 0;
+  int empty = 1;
+  size_t n;
+
+  while ((n = fread(buf, 1, TRI_READ_CHUNK, f)) > 0) {
+    for (size_t j = 0; j < n; j++) {
+      unsigned char c = buf[j];
+      empty = 0;
+      if (c == '\n') {
+        row++;
+        valid = 0;
+        empty = 1;
+        continue;
+      }
+      // Line terminators and NULs never show up in search patterns
+      if (c == '\r' || c == '\0') {
+        valid = 0;
+        continue;
+      }
+      window = ((window << 8) | c) & 0xffffff;
+      if (++valid >= 3)
+        tri_add(t, window, row);
+    }
+  }
+
+  // Last line without a trailing newline
+  t->nrows = empty ? row : row + 1;
+
+  dfree(buf);
+  fclose(f);
+
+  t->build_ms = now_ms() - start;
+  return t;
+}
+
+int tri_save(TrigramIndex *t, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return -1;
+
+  uint64_t nterms = t->nterms;
+  int err = 0;
+  err |= fwrite(TRI_MAGIC, 1, TRI_MAGIC_SZ, f) != TRI_MAGIC_SZ;
+  err |= fwrite(&t->fsize, sizeof(t->fsize), 1, f) != 1;
+  err |= fwrite(&t->fmtime, sizeof(t->fmtime), 1, f) != 1;
+  err |= fwrite(&t->nrows, sizeof(t->nrows), 1, f) != 1;
+  err |= fwrite(&nterms, sizeof(nterms), 1, f) != 1;
+
+  for (size_t i = 0; i < t->nslots && !err; i++) {
+    TrigramPosting *p = &t->slots[i];
+    if (p->tri == 0)
+      continue;
+    err |= fwrite(&p->tri, sizeof(p->tri), 1, f) != 1;
+    err |= fwrite(&p->len, sizeof(p->len), 1, f) != 1;
+    err |= fwrite(p->rows, sizeof(uint32_t), p->len, f) != p->len;
+  }
+
+  if (fclose(f) != 0)
+    err = 1;
+  if (err) {
+    remove(path);
+    return -1;
+  }
+  return 0;
+}
+
+TrigramIndex *tri_load(const char *path, uint64_t fsize, int64_t fmtime) {
+  double start = now_ms();
+
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+
+  char magic[TRI_MAGIC_SZ];
+  uint64_t size, nterms;
+  int64_t mtime;
+  uint32_t nrows;
+
+  if (fread(magic, 1, TRI_MAGIC_SZ, f) != TRI_MAGIC_SZ ||
+      memcmp(magic, TRI_MAGIC, TRI_MAGIC_SZ) != 0 ||
+      fread(&size, sizeof(size), 1, f) != 1 ||
+      fread(&mtime, sizeof(mtime), 1, f) != 1 ||
+      fread(&nrows, sizeof(nrows), 1, f) != 1 ||
+      fread(&nterms, sizeof(nterms), 1, f) != 1 || size != fsize ||
+      mtime != fmtime) {
+    fclose(f);
+    return NULL;
+  }
+
+  TrigramIndex *t = tri_create();
+  t->fsize = size;
+  t->fmtime = mtime;
+  t->nrows = nrows;
+
+  for (uint64_t k = 0; k < nterms; k++) {
+    uint32_t tri, len;
+    if (fread(&tri, sizeof(tri), 1, f) != 1 ||
+        fread(&len, sizeof(len), 1, f) != 1 || tri == 0 || len == 0)
+      goto corrupted;
+
+    TrigramPosting *p = tri_slot(t, tri);
+    if (p->len != 0)
+      goto corrupted;
+    p->rows = dmalloc(sizeof(uint32_t) * len);
+    p->len = p->cap = len;
+    if (fread(p->rows, sizeof(uint32_t), len, f) != len)
+      goto corrupted;
+    t->npostings += len;
+  }
+
+  fclose(f);
+  t->build_ms = now_ms() - start;
+  t->from_cache = 1;
+  return t;
+
+corrupted:
+  fclose(f);
+  tri_destroy(t);
+  return NULL;
+}
+
+// Intersects the sorted list a (len *alen) with b, in place
+static void tri_intersect(uint32_t *a, size_t *alen, const uint32_t *b,
+                          size_t blen) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < *alen && j < blen) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (a[i] > b[j]) {
+      j++;
+    } else {
+      a[k++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  *alen = k;
+}
+
+long tri_candidates(TrigramIndex *t, const char *pat, size_t len,
+                    uint32_t **rows) {
+  *rows = NULL;
+  if (len < 3)
+    return -1;
+
+  // Pick the shortest posting list to start with, to keep the intersection
+  // bounded by the rarest trigram of the pattern
+  size_t nlists = len - 2;
+  TrigramPosting **lists = dmalloc(sizeof(TrigramPosting *) * nlists);
+  size_t shortest = 0;
+
+  for (size_t j = 0; j < nlists; j++) {
+    const unsigned char *p = (const unsigned char *)pat + j;
+    uint32_t tri = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    lists[j] = tri_lookup(t, tri);
+    if (!lists[j]) {
+      // A trigram never seen means no row can match
+      dfree(lists);
+      *rows = dmalloc(sizeof(uint32_t));
+      return 0;
+    }
+    if (lists[j]->len < lists[shortest]->len)
+      shortest = j;
+  }
+
+  size_t n = lists[shortest]->len;
+  uint32_t *res = dmalloc(sizeof(uint32_t) * (n ? n : 1));
+  memcpy(res, lists[shortest]->rows, sizeof(uint32_t) * n);
+
+  for (size_t j = 0; j < nlists && n > 0; j++) {
+    if (j == shortest)
+      continue;
+    tri_intersect(res, &n, lists[j]->rows, lists[j]->len);
+  }
+
+  dfree(lists);
+  *rows = res;
+  return (long)n;
+}
+
+size_t tri_memory(TrigramIndex *t) {
+  size_t mem = sizeof(TrigramIndex) + sizeof(TrigramPosting) * t->nslots;
+  for (size_t i = 0; i < t->nslots; i++) {
+    if (t->slots[i].tri != 0)
+      mem += sizeof(uint32_t) * t->slots[i].cap;
+  }
+  return mem;
+}
+
+void tri_destroy(TrigramIndex *t) {
+  if (!t)
+    return;
+  for (size_t i = 0; i < t->nslots; i++)
+    dfree(t->slots[i].rows);
+  dfree(t->slots);
+  dfree(t);
+}
+
+#ifdef TESTS_TRIGRAM
+int main(void) {
+  const char *path = "/tmp/ditto-trigram-test.txt";
+  const char *cache = "/tmp/.ditto-trigram-test.txt.dtri";
+
+  FILE *f = fopen(path, "w");
+  fprintf(f, "hello world\n");
+  fprintf(f, "nothing here\n");
+  fprintf(f, "say hello again\r\n");
+  fprintf(f, "id=0xdeadbeef\n");
+  fprintf(f, "hel\n");
+  fprintf(f, "last hello");
+  fclose(f);
+
+  TrigramIndex *t = tri_build_file(path, 79, 1234);
+  if (!t || t->nrows != 6) {
+    fprintf(stderr, "Wrong number of rows after build\n");
+    exit(1);
+  }
+
+  uint32_t *rows;
+  long n = tri_candidates(t, "hello", 5, &rows);
+  if (n != 3 || rows[0] != 0 || rows[1] != 2 || rows[2] != 5) {
+    fprintf(stderr, "Wrong candidates for 'hello' = %ld\n", n);
+    exit(1);
+  }
+  dfree(rows);
+
+  n = tri_candidates(t, "deadbeef", 8, &rows);
+  if (n != 1 || rows[0] != 3) {
+    fprintf(stderr, "Wrong candidates for 'deadbeef' = %ld\n", n);
+    exit(1);
+  }
+  dfree(rows);
+
+  n = tri_candidates(t, "missing", 7, &rows);
+  if (n != 0) {
+    fprintf(stderr, "Wrong candidates for 'missing' = %ld\n", n);
+    exit(1);
+  }
+  dfree(rows);
+
+  if (tri_candidates(t, "he", 2, &rows) != -1) {
+    fprintf(stderr, "Short patterns should not be narrowed\n");
+    exit(1);
+  }
+
+  // --------- Persistence ---------
+  if (tri_save(t, cache) != 0) {
+    fprintf(stderr, "Could not save the index\n");
+    exit(1);
+  }
+
+  TrigramIndex *l = tri_load(cache, t->fsize, t->fmtime + 1);
+  if (l) {
+    fprintf(stderr, "Stale index should not be loaded\n");
+    exit(1);
+  }
+
+  l = tri_load(cache, t->fsize, t->fmtime);
+  if (!l || l->nterms != t->nterms || l->npostings != t->npostings ||
+      !l->from_cache) {
+    fprintf(stderr, "Wrong index after load\n");
+    exit(1);
+  }
+
+  n = tri_candidates(l, "hello", 5, &rows);
+  if (n != 3 || rows[2] != 5) {
+    fprintf(stderr, "Wrong candidates for 'hello' after load = %ld\n", n);
+    exit(1);
+  }
+  dfree(rows);
+
+  printf("terms: %zu, postings: %zu, memory: %zu bytes\n", l->nterms,
+         l->npostings, tri_memory(l));
+
+  tri_destroy(t);
+  tri_destroy(l);
+  remove(path);
+  remove(cache);
+
+  if (used_memory() != 0) {
+    fprintf(stderr, "Leaked memory = %zu\n", used_memory());
+    exit(1);
+  }
+
+  return 0;
+}
+#endif
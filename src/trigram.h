@@ -0,0 +1,68 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rows are 0-based line numbers of the indexed file
+typedef struct {
+  // 24-bit trigram, 0 marks an empty slot
+  uint32_t tri;
+  uint32_t len;
+  uint32_t cap;
+  // Sorted and deduplicated rows containing the trigram
+  uint32_t *rows;
+} TrigramPosting;
+
+typedef struct {
+  TrigramPosting *slots;
+  size_t nslots;
+  size_t nterms;
+  size_t npostings;
+  uint32_t nrows;
+  // Identity of the indexed file, used to validate the persisted index. The
+  // mtime is in nanoseconds on Linux, in seconds elsewhere.
+  uint64_t fsize;
+  int64_t fmtime;
+  // Time spent building or loading the index
+  double build_ms;
+  int from_cache;
+} TrigramIndex;
+
+/**
+ * Build the index reading the file at path, stamped with the size and mtime
+ * the caller got for it. Returns NULL on failure.
+ * It doesn't touch any editor state, so it's safe to run in a background
+ * thread.
+ */
+TrigramIndex *tri_build_file(const char *path, uint64_t fsize,
+                             int64_t fmtime);
+
+/**
+ * Load a persisted index, only if it was built for a file with the given size
+ * and mtime. Returns NULL if missing, stale or corrupted.
+ */
+TrigramIndex *tri_load(const char *path, uint64_t fsize, int64_t fmtime);
+
+/**
+ * Persist the index to path. Returns -1 on error, 0 otherwise.
+ */
+int tri_save(TrigramIndex *t, const char *path);
+
+/**
+ * Find the rows which may contain the pattern, to be verified by the caller.
+ * Returns -1 if the index cannot narrow down the search (pattern shorter than
+ * a trigram), otherwise the number of candidates, stored sorted in *rows
+ * (to be freed with dfree).
+ */
+long tri_candidates(TrigramIndex *t, const char *pat, size_t len,
+                    uint32_t **rows);
+
+/**
+ * Bytes of memory used by the index.
+ */
+size_t tri_memory(TrigramIndex *t);
+
+void tri_destroy(TrigramIndex *t);
+
+#endif
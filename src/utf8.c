@@ -0,0 +1,368 @@
+#include "utf8.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+  uint32_t lo;
+  uint32_t hi;
+} Utf8Range;
+
+// Combining marks, joiners and other code points drawn over the previous one
+static const Utf8Range zero_width[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0711, 0x0711},
+    {0x0730, 0x074A},   {0x07A6, 0x07B0},   {0x07EB, 0x07F3},
+    {0x0816, 0x0819},   {0x081B, 0x0823},   {0x0825, 0x0827},
+    {0x0829, 0x082D},   {0x0859, 0x085B},   {0x08D3, 0x08E1},
+    {0x08E3, 0x0902},   {0x093A, 0x093A},   {0x093C, 0x093C},
+    {0x0941, 0x0948},   {0x094D, 0x094D},   {0x0951, 0x0957},
+    {0x0962, 0x0963},   {0x0981, 0x0981},   {0x09BC, 0x09BC},
+    {0x09C1, 0x09C4},   {0x09CD, 0x09CD},   {0x09E2, 0x09E3},
+    {0x0A01, 0x0A02},   {0x0A3C, 0x0A3C},   {0x0A41, 0x0A51},
+    {0x0A70, 0x0A71},   {0x0A81, 0x0A82},   {0x0ABC, 0x0ABC},
+    {0x0AC1, 0x0AC8},   {0x0ACD, 0x0ACD},   {0x0B01, 0x0B01},
+    {0x0B3C, 0x0B3C},   {0x0B3F, 0x0B3F},   {0x0B41, 0x0B44},
+    {0x0B4D, 0x0B4D},   {0x0BC0, 0x0BC0},   {0x0BCD, 0x0BCD},
+    {0x0C3E, 0x0C40},   {0x0C46, 0x0C56},   {0x0CBC, 0x0CBC},
+    {0x0CCC, 0x0CCD},   {0x0D41, 0x0D44},   {0x0D4D, 0x0D4D},
+    {0x0E31, 0x0E31},   {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},
+    {0x0EB1, 0x0EB1},   {0x0EB4, 0x0EBC},   {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19},   {0x0F35, 0x0F35},   {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39},   {0x0F71, 0x0F7E},   {0x0F80, 0x0F84},
+    {0x0F86, 0x0F87},   {0x102D, 0x1030},   {0x1032, 0x1037},
+    {0x1039, 0x103A},   {0x1160, 0x11FF},   {0x135D, 0x135F},
+    {0x1712, 0x1714},   {0x17B4, 0x17B5},   {0x17B7, 0x17BD},
+    {0x17C6, 0x17C6},   {0x17C9, 0x17D3},   {0x180B, 0x180E},
+    {0x1A17, 0x1A18},   {0x1AB0, 0x1AFF},   {0x1B00, 0x1B03},
+    {0x1B34, 0x1B34},   {0x1B36, 0x1B3A},   {0x1B6B, 0x1B73},
+    {0x1DC0, 0x1DFF},   {0x200B, 0x200F},   {0x202A, 0x202E},
+    {0x2060, 0x2064},   {0x20D0, 0x20F0},   {0x2CEF, 0x2CF1},
+    {0x2DE0, 0x2DFF},   {0x302A, 0x302D},   {0x3099, 0x309A},
+    {0xA66F, 0xA672},   {0xA674, 0xA67D},   {0xA69E, 0xA69F},
+    {0xA6F0, 0xA6F1},   {0xA8E0, 0xA8F1},   {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F},   {0xFEFF, 0xFEFF},   {0x1D167, 0x1D169},
+    {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0xE0001, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+// East Asian Wide and Fullwidth code points, emoji included
+static const Utf8Range wide[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248},
+    {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393},
+    {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0},
+    {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440},
+    {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+    {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5},
+    {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7},
+    {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+    {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+static int in_table(const Utf8Range *t, int n, uint32_t cp) {
+  if (cp < t[0].lo || cp > t[n - 1].hi)
+    return 0;
+
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < t[mid].lo)
+      hi = mid - 1;
+    else if (cp > t[mid].hi)
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+int utf8_decode(const char *s, int len, uint32_t *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  uint32_t c, min;
+  int n;
+
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+
+  if ((u[0] & 0xE0) == 0xC0) {
+    n = 2;
+    c = u[0] & 0x1F;
+    min = 0x80;
+  } else if ((u[0] & 0xF0) == 0xE0) {
+    n = 3;
+    c = u[0] & 0x0F;
+    min = 0x800;
+  } else if ((u[0] & 0xF8) == 0xF0) {
+    n = 4;
+    c = u[0] & 0x07;
+    min = 0x10000;
+  } else {
+    goto invalid;
+  }
+
+  if (n > len)
+    goto invalid;
+  for (int k = 1; k < n; k++) {
+    if ((u[k] & 0xC0) != 0x80)
+      goto invalid;
+    c = (c << 6) | (u[k] & 0x3F);
+  }
+  // Overlong forms, surrogates and values past the last plane
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    goto invalid;
+
+  *cp = c;
+  return n;
+
+invalid:
+  *cp = 0xFFFD;
+  return 1;
+}
+
+int utf8_encode(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3F);
+  out[2] = 0x80 | ((cp >> 6) & 0x3F);
+  out[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+int utf8_width(uint32_t cp) {
+  // Latin-1 needs no lookup
+  if (cp < 0x300)
+    return 1;
+  if (in_table(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp))
+    return 0;
+  if (in_table(wide, sizeof(wide) / sizeof(wide[0]), cp))
+    return 2;
+  return 1;
+}
+
+int utf8_is_plain(const char *s, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // 16 bytes at a time: the sign bits are the bytes past ASCII
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab))))
+      return 0;
+  }
+#endif
+
+  // 8 bytes at a time otherwise, and for what's left
+  const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, s + i, 8);
+    uint64_t t = w ^ (ones * '\t');
+    if ((w | ((t - ones) & ~t)) & highs)
+      return 0;
+  }
+
+  for (; i < len; i++)
+    if ((unsigned char)s[i] >= 0x80 || s[i] == '\t')
+      return 0;
+  return 1;
+}
+
+// Start of the code point containing the byte at i, i itself unless it's
+// the continuation of a valid sequence
+static int utf8_start(const char *s, int len, int i) {
+  for (int p = i - 1; p >= 0 && p >= i - 3; p--) {
+    if (((unsigned char)s[p] & 0xC0) != 0x80) {
+      uint32_t cp;
+      if (((unsigned char)s[i] & 0xC0) == 0x80 &&
+          p + utf8_decode(s + p, len - p, &cp) > i)
+        return p;
+      return i;
+    }
+  }
+  return i;
+}
+
+int utf8_next(const char *s, int len, int i) {
+  uint32_t cp;
+  if (i >= len)
+    return len;
+
+  i += utf8_decode(s + i, len - i, &cp);
+  while (i < len && (unsigned char)s[i] >= 0x80) {
+    int n = utf8_decode(s + i, len - i, &cp);
+    if (utf8_width(cp) != 0)
+      break;
+    i += n;
+  }
+  return i;
+}
+
+int utf8_snap(const char *s, int len, int i) {
+  if (i >= len)
+    return i;
+
+  i = utf8_start(s, len, i);
+  while (i > 0) {
+    uint32_t cp;
+    utf8_decode(s + i, len - i, &cp);
+    if (utf8_width(cp) != 0)
+      break;
+    i = utf8_start(s, len, i - 1);
+  }
+  return i;
+}
+
+int utf8_prev(const char *s, int len, int i) {
+  return i <= 0 ? 0 : utf8_snap(s, len, i - 1);
+}
+
+int utf8_columns(const char *s, int len, int tabstop, int *cols) {
+  int col = 0, i = 0;
+
+  while (i < len) {
+    unsigned char b = s[i];
+    if (b < 0x80) {
+      cols[i++] = col;
+      col += b == '\t' ? tabstop - col % tabstop : 1;
+      continue;
+    }
+
+    uint32_t cp;
+    int n = utf8_decode(s + i, len - i, &cp);
+    int w = utf8_width(cp);
+    // Zero-width code points belong to the character before them
+    int at = w == 0 && i > 0 ? cols[i - 1] : col;
+    for (int k = 0; k < n; k++)
+      cols[i + k] = at;
+    col += w;
+    i += n;
+  }
+
+  cols[len] = col;
+  return col;
+}
+
+#ifdef TESTS_UTF8
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void) {
+  // --------- Decoding ---------
+  uint32_t cp;
+  char buf[4];
+  uint32_t samples[] = {'a', 0xE9, 0x4E2D, 0x1F600, 0x10FFFF};
+  for (size_t k = 0; k < sizeof(samples) / sizeof(samples[0]); k++) {
+    int n = utf8_encode(samples[k], buf);
+    if (utf8_decode(buf, n, &cp) != n || cp != samples[k]) {
+      fprintf(stderr, "Round trip of U+%X failed\n", samples[k]);
+      exit(1);
+    }
+  }
+  // Truncated, overlong and stray continuation bytes
+  if (utf8_decode("\xE4\xB8", 2, &cp) != 1 || cp != 0xFFFD ||
+      utf8_decode("\xC0\xAF", 2, &cp) != 1 || cp != 0xFFFD ||
+      utf8_decode("\x80", 1, &cp) != 1 || cp != 0xFFFD) {
+    fprintf(stderr, "Invalid sequences should decode as one byte\n");
+    exit(1);
+  }
+
+  // --------- Widths ---------
+  if (utf8_width('a') != 1 || utf8_width(0xE9) != 1 ||
+      utf8_width(0x301) != 0 || utf8_width(0x4E2D) != 2 ||
+      utf8_width(0xFF21) != 2 || utf8_width(0x1F600) != 2 ||
+      utf8_width(0x200D) != 0) {
+    fprintf(stderr, "Wrong widths\n");
+    exit(1);
+  }
+
+  // --------- Plain text detection at every position ---------
+  char text[100];
+  memset(text, 'x', sizeof(text));
+  if (!utf8_is_plain(text, sizeof(text))) {
+    fprintf(stderr, "ASCII should be plain\n");
+    exit(1);
+  }
+  for (int k = 0; k < (int)sizeof(text); k++) {
+    text[k] = '\t';
+    int tab = utf8_is_plain(text, sizeof(text));
+    text[k] = (char)0xC3;
+    int high = utf8_is_plain(text, sizeof(text));
+    text[k] = 'x';
+    if (tab || high) {
+      fprintf(stderr, "Byte %d should make the text not plain\n", k);
+      exit(1);
+    }
+  }
+
+  // --------- Columns and characters ---------
+  // a, tab, wide U+4E2D, e with a combining acute, an invalid byte, b
+  const char *s = "a\t\xE4\xB8\xAD" "e\xCC\x81" "\xFF" "b";
+  int len = strlen(s);
+  int cols[16];
+  int expect[] = {0, 1, 4, 4, 4, 6, 6, 6, 7, 8, 9};
+  if (utf8_columns(s, len, 4, cols) != 9 ||
+      memcmp(cols, expect, sizeof(expect)) != 0) {
+    fprintf(stderr, "Wrong columns\n");
+    exit(1);
+  }
+
+  int starts[] = {0, 1, 2, 5, 8, 9, 10};
+  int nstarts = sizeof(starts) / sizeof(starts[0]);
+  for (int k = 0; k + 1 < nstarts; k++) {
+    if (utf8_next(s, len, starts[k]) != starts[k + 1] ||
+        utf8_prev(s, len, starts[k + 1]) != starts[k]) {
+      fprintf(stderr, "Wrong step from byte %d\n", starts[k]);
+      exit(1);
+    }
+    for (int i = starts[k]; i < starts[k + 1]; i++)
+      if (utf8_snap(s, len, i) != starts[k]) {
+        fprintf(stderr, "Byte %d should snap to %d\n", i, starts[k]);
+        exit(1);
+      }
+  }
+
+  return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Decode the code point at s, of at most len bytes, returning its length.
+ * Invalid or truncated sequences decode as a single byte U+FFFD.
+ */
+int utf8_decode(const char *s, int len, uint32_t *cp);
+
+/**
+ * Encode the code point into out, which must have room for 4 bytes.
+ * Returns the length.
+ */
+int utf8_encode(uint32_t cp, char *out);
+
+/**
+ * Columns taken by a code point: 0 for combining marks and other zero-width
+ * ones, 2 for East Asian wide and fullwidth ones, 1 otherwise.
+ */
+int utf8_width(uint32_t cp);
+
+/**
+ * Nonzero if the text is ASCII without tabs, so that every byte takes a
+ * column.
+ */
+int utf8_is_plain(const char *s, size_t len);
+
+/**
+ * Offset of the character after (or before) the one at i. A character is a
+ * code point along with the zero-width ones following it.
+ */
+int utf8_next(const char *s, int len, int i);
+int utf8_prev(const char *s, int len, int i);
+
+/**
+ * Start of the character containing the byte at i.
+ */
+int utf8_snap(const char *s, int len, int i);
+
+/**
+ * Fill cols[0..len] with the column each byte is displayed at, the column of
+ * the character it belongs to, with tabs expanded to the next multiple of
+ * tabstop. cols[len] is the width of the text, which is returned.
+ */
+int utf8_columns(const char *s, int len, int tabstop, int *cols);
+
+#endif